@@ -0,0 +1,20 @@
+#include <iostream>
+
+#include <evmjit/JIT.h>
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <socket-path>\n"
+				  << "Compilation options are read from the EVMJIT environment variable.\n";
+		return 1;
+	}
+
+	if (!dev::evmjit::JIT::runCompileServer(argv[1]))
+	{
+		std::cerr << "Cannot listen on " << argv[1] << "\n";
+		return 1;
+	}
+	return 0;
+}
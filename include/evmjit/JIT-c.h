@@ -39,6 +39,8 @@ typedef struct evmjit_runtime_data
 	int64_t 	timestamp;
 	char const* code;
 	uint64_t 	codeSize;
+	evmjit_i256 const* blockHashes;
+	uint64_t 	blockHashesBase;
 	evmjit_i256	codeHash;
 } evmjit_runtime_data;
 
@@ -52,11 +54,22 @@ typedef enum evmjit_return_code
 	// Standard error codes
 	OutOfGas           = -1,
 
+	Cancelled          = -2,
+
 	// Internal error codes
 	LLVMError           = -101,
+	CompilationRejected = -102,
 	UnexpectedException = -111
 } evmjit_return_code;
 
+typedef struct evmjit_log
+{
+	char const* data;
+	uint64_t 	dataSize;
+	evmjit_i256 const* topics;
+	uint64_t 	numTopics;
+} evmjit_log;
+
 typedef struct evmjit_context evmjit_context;
 
 EVMJIT_API evmjit_context* evmjit_create(evmjit_runtime_data* _data, void* _env);
@@ -65,6 +78,16 @@ EVMJIT_API evmjit_return_code evmjit_exec(evmjit_context* _context, void* _sched
 
 EVMJIT_API void evmjit_destroy(evmjit_context* _context);
 
+/// Moves the output of RETURN out of the context without copying.
+/// @param o_memory	memory block containing the output. Must be freed with evmjit_free_output().
+EVMJIT_API char const* evmjit_take_output(evmjit_context* _context, uint64_t* o_size, void** o_memory);
+
+EVMJIT_API void evmjit_free_output(void* _memory);
+
+EVMJIT_API void evmjit_enable_buffered_logs(evmjit_context* _context);
+
+EVMJIT_API evmjit_log const* evmjit_get_logs(evmjit_context* _context, uint64_t* o_numLogs);
+
 
 inline char const* evmjit_get_output(evmjit_runtime_data* _data) { return _data->callData; }
 inline uint64_t evmjit_get_output_size(evmjit_runtime_data* _data) { return _data->callDataSize; }
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <memory>
 #include <type_traits>
+#include <utility>
 
 #ifdef _MSC_VER
 #ifdef evmjit_EXPORTS
@@ -73,13 +76,15 @@ struct RuntimeData
 		Timestamp,
 		Code,
 		CodeSize,
+		BlockHashes,
+		BlockHashesBase,
 
 		SuicideDestAddress = Address,		///< Suicide balance destination address
 		ReturnData 		   = CallData,		///< Return data pointer (set only in case of RETURN)
 		ReturnDataSize 	   = CallDataSize,	///< Return data size (set only in case of RETURN)
 	};
 
-	static size_t const numElements = CodeSize + 1;
+	static size_t const numElements = BlockHashesBase + 1;
 
 	int64_t 	gas = 0;
 	int64_t 	gasPrice = 0;
@@ -97,7 +102,15 @@ struct RuntimeData
 	int64_t 	timestamp = 0;
 	byte const* code = nullptr;
 	uint64_t 	codeSize = 0;
+	h256 const* blockHashes = nullptr;	///< Optional table of recent block hashes, see blockHashTableSize
+	uint64_t 	blockHashesBase = 0;	///< Number of the block which hash is the first entry of blockHashes
 	h256		codeHash;
+
+	/// Number of entries of the recent block hashes table.
+	/// The i-th entry contains the hash of block blockHashesBase + i in the same
+	/// format as returned by env_blockhash callback. If the table is not provided
+	/// BLOCKHASH is handled by the env_blockhash callback.
+	static size_t const blockHashTableSize = 256;
 };
 
 struct JITSchedule
@@ -136,9 +149,6 @@ struct JITSchedule
 	EVMJIT_API std::string codeIdentifier(h256 const& _codeHash) const;
 };
 
-/// VM Environment (ExtVM) opaque type
-struct Env;
-
 enum class ReturnCode
 {
 	// Success codes
@@ -149,14 +159,122 @@ enum class ReturnCode
 	// Standard error codes
 	OutOfGas           = -1,
 
+	// Execution interrupted by the host, see ExecutionContext::setCancelFlag()
+	Cancelled          = -2,
+
 	// Internal error codes
 	LLVMError          = -101,
+	CompilationRejected = -102,	///< Code exceeds compilation limits. Must be executed by an interpreter.
 
 	UnexpectedException = -111,
 
 	LinkerWorkaround = -299,
 };
 
+/// VM Environment (ExtVM) opaque type
+struct Env;
+
+/// Log entry created by LOG instruction in buffered logs mode
+struct LogEntry
+{
+	byte const* data;
+	uint64_t 	dataSize;
+	h256 const* topics;		///< Topics in big-endian byte order (as passed to env_log)
+	uint64_t 	numTopics;
+};
+
+using logs_ref = std::tuple<LogEntry const*, size_t>;
+
+class LogBuffer;
+class ExecutionContext;
+
+/// Granularity of execution tracing
+enum class TraceLevel
+{
+	None,
+	Instruction,	///< Before every instruction
+	Block,			///< At the beginning of every basic block
+	Call,			///< Before every CALL, CALLCODE, DELEGATECALL and CREATE instruction
+};
+
+/// Execution tracer. When set for an execution context the code is executed by
+/// a tracing variant of the compiled code (cached separately from regular code).
+struct Tracer
+{
+	TraceLevel level;
+
+	/// Called with the state before the instruction at _pc is executed.
+	/// _stack points to the bottom of the EVM stack of _stackSize items in native byte order.
+	void (*step)(Env* _env, uint64_t _pc, byte _opcode, int64_t _gas, i256 const* _stack, uint64_t _stackSize);
+};
+
+/// Return data that owns the EVM memory of the execution it comes from.
+/// Allows handing over the output of a call without copying it.
+class ReturnData
+{
+public:
+	ReturnData() = default;
+	ReturnData(ReturnData&& _other) noexcept { *this = std::move(_other); }
+	EVMJIT_API ReturnData& operator=(ReturnData&& _other) noexcept;
+	ReturnData(ReturnData const&) = delete;
+	ReturnData& operator=(ReturnData const&) = delete;
+	EVMJIT_API ~ReturnData() noexcept;
+
+	byte const* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+	/// Releases the ownership of the memory block. It must be freed with ext_free().
+	byte* release() { auto memory = m_memory; m_memory = nullptr; return memory; }
+
+private:
+	ReturnData(byte* _memory, byte const* _data, size_t _size): m_memory(_memory), m_data(_data), m_size(_size) {}
+
+	byte* m_memory = nullptr;		///< EVM memory block containing the data
+	byte const* m_data = nullptr;
+	size_t m_size = 0;
+
+	friend class ExecutionContext;
+};
+
+/// Parameters of a message call passed to CallHooks::enter
+struct CallParams
+{
+	int64_t 	gas;			///< Gas requested by the call instruction
+	h256 const* senderAddress;	///< Addresses in big-endian byte order (as passed to env_call)
+	h256 const* receiveAddress;
+	h256 const* codeAddress;
+	i256 const* valueTransfer;
+	i256 const* apparentValue;
+	byte const* inData;
+	uint64_t 	inSize;
+};
+
+class CodeHandle;
+
+/// State transition hooks provided by the host to enable direct JIT-to-JIT calls.
+/// When the hooks are set for an execution context nested calls do not go through
+/// env_call. The host only prepares and finishes the call, the JIT compiles
+/// the callee's code and executes it directly.
+struct CallHooks
+{
+	/// Resolves the code at the call's code address, e.g. to a handle kept with the account.
+	/// Called before enter. The code is compiled before any state changes: if it
+	/// cannot be compiled (or the hook returns null) env_call is used instead.
+	CodeHandle const* (*code)(Env* _env, h256 const* _codeAddress);
+
+	/// Prepares a message call: charges the call cost, transfers the value,
+	/// snapshots the state and fills the callee's runtime data and environment.
+	/// @returns false if the call cannot be executed directly (e.g. a precompiled
+	/// contract or call depth limit reached). env_call is used in that case.
+	bool (*enter)(Env* _env, int64_t* io_gas, CallParams const& _params, RuntimeData& o_data, Env*& o_env);
+
+	/// Finishes a message call prepared by enter: commits or reverts the state
+	/// changes of the callee and gives the unused gas back to the caller.
+	/// The output is already copied to the caller's out buffer. If _returnCode is
+	/// Return the host can keep the whole output without copying with _callee.takeReturnData().
+	void (*leave)(Env* _env, int64_t* io_gas, ExecutionContext& _callee, Env* _calleeEnv, ReturnCode _returnCode);
+};
+
 class ExecutionContext
 {
 public:
@@ -171,21 +289,90 @@ public:
 	byte const* code() const { return m_data->code; }
 	uint64_t codeSize() const { return m_data->codeSize; }
 	h256 const& codeHash() const { return m_data->codeHash; }
+	int64_t gas() const { return m_data->gas; }
+	Env* env() const { return m_env; }
+
+	/// Enables direct JIT-to-JIT calls, see CallHooks. Nested contexts inherit the hooks.
+	void setCallHooks(CallHooks const* _hooks) { m_callHooks = _hooks; }
+	CallHooks const* callHooks() const { return m_callHooks; }
+
+	/// Sets a flag checked by compiled code at loop back-edges (dynamic jumps and
+	/// backward static jumps). When the flag is raised, execution ends with
+	/// ReturnCode::Cancelled. The flag can be raised from any thread.
+	void setCancelFlag(std::atomic<bool> const* _flag) { m_cancelFlag = _flag; }
+	std::atomic<bool> const* cancelFlag() const { return m_cancelFlag; }
+
+	/// Enables execution tracing, see Tracer. Nested contexts of direct calls inherit the tracer.
+	void setTracer(Tracer const* _tracer) { m_tracer = _tracer; }
+	Tracer const* tracer() const { return m_tracer; }
 
 	bytes_ref getReturnData() const;
 
+	/// Moves the EVM memory together with the data returned by RETURN out of the context.
+	/// The context memory becomes empty and returnData is reset.
+	/// Empty and the memory is kept if the last execution did not end with RETURN of non-empty data.
+	EVMJIT_API ReturnData takeReturnData();
+
+	/// Enables buffered logs mode. LOG instructions append entries to a buffer
+	/// owned by the context instead of calling env_log. The entries are available
+	/// with getLogs() after successful execution and are discarded otherwise.
+	EVMJIT_API void enableBufferedLogs();
+	bool hasBufferedLogs() const { return m_logBuffer != nullptr; }
+
+	/// Reference to logs created during last execution in buffered logs mode
+	EVMJIT_API logs_ref getLogs() const;
+
+	/// Discards buffered logs. Memory of the buffer is kept for reuse.
+	EVMJIT_API void clearLogs();
+
+	/// Appends buffered logs of a successful nested execution to the buffer of this context
+	EVMJIT_API void appendLogs(ExecutionContext const& _nested);
+
 protected:
 	RuntimeData* m_data = nullptr;	///< Pointer to data. Expected by compiled contract.
 	Env* m_env = nullptr;			///< Pointer to environment proxy. Expected by compiled contract.
 	byte* m_memData = nullptr;
 	uint64_t m_memSize = 0;
 	uint64_t m_memCap = 0;
+	LogBuffer* m_logBuffer = nullptr;	///< Buffer for logs. Null if buffered logs mode is disabled.
+	CallHooks const* m_callHooks = nullptr;	///< Hooks for direct calls. Null if calls go through env_call.
+	std::atomic<bool> const* m_cancelFlag = nullptr;	///< Cancellation flag. Null if cancellation is not used.
+	Tracer const* m_tracer = nullptr;
 
 public:
 	/// Reference to returned data (RETURN opcode used)
 	bytes_ref returnData;
 };
 
+/// Location in EVM code of a native code address
+struct CodeLocation
+{
+	std::string const* codeIdentifier;	///< Identifier of the code. Valid as long as the JIT.
+	uint64_t pc;						///< Program counter of the EVM instruction
+	uint64_t blockPc;					///< Program counter of the first instruction of the basic block
+};
+
+/// Handle of EVM code registered with JIT::registerCode().
+/// Holds the compiled code once it is available, so executions by the handle
+/// need no code identifier building nor code lookups.
+/// Copies of a handle share the code (reference counted).
+class CodeHandle
+{
+public:
+	CodeHandle() = default;
+
+	explicit operator bool() const { return m_state != nullptr; }
+
+	/// @returns true if the code has been compiled and can be executed without overhead
+	EVMJIT_API bool isReady() const;
+
+private:
+	struct State;
+	std::shared_ptr<State> m_state;
+
+	friend class JIT;
+};
+
 class JIT
 {
 public:
@@ -204,8 +391,72 @@ public:
 		JITSchedule const& _schedule
 	);
 
+	/// Schedules compilation of the EVM code in background with low priority,
+	/// e.g. for code likely to be executed soon. Compilation of code that
+	/// executions wait for and of hot code takes precedence. The request is
+	/// dropped if it is not started within @a _deadlineMs milliseconds (0 - no deadline).
+	EVMJIT_API static void prefetch(
+		byte const* _code,
+		uint64_t _codeSize,
+		std::string const& _codeIdentifier,
+		JITSchedule const& _schedule,
+		unsigned _deadlineMs = 0
+	);
+
 	/// Execude the code given in @a _context and compile it if necessary.
 	EVMJIT_API static ReturnCode exec(ExecutionContext& _context, JITSchedule const& _schedule);
+
+	/// Registers EVM code for repeated execution. The code is copied.
+	/// Code already compiled for the same hash and schedule is reused.
+	EVMJIT_API static CodeHandle registerCode(
+		byte const* _code,
+		uint64_t _codeSize,
+		h256 const& _codeHash,
+		JITSchedule const& _schedule
+	);
+
+	/// Compiles the registered code if not compiled yet.
+	EVMJIT_API static void compile(CodeHandle const& _code);
+
+	/// Compiles the registered code if needed, the tracing variant if @a _tracer is given.
+	/// @returns ReturnCode::Stop if the code can be executed, otherwise the error exec() would return
+	EVMJIT_API static ReturnCode prepare(CodeHandle const& _code, Tracer const* _tracer = nullptr);
+
+	/// Schedules compilation of the registered code in background, see prefetch() above.
+	EVMJIT_API static void prefetch(CodeHandle const& _code, unsigned _deadlineMs = 0);
+
+	/// Executes the registered code and compiles it if necessary.
+	/// Runtime data of @a _context must describe the same code.
+	/// Executions with a tracer use the tracing variant of the code, which is looked up as in exec() above.
+	EVMJIT_API static ReturnCode exec(ExecutionContext& _context, CodeHandle const& _code);
+
+	/// Frees the machine code of the code with given identifier, e.g. of code not executed recently.
+	/// The code must not be executing nor start executing in any thread until the call returns.
+	/// The code is compiled again (or loaded from cache) when executed next time, also by its handles.
+	/// @returns false if the code is not compiled or its machine code cannot be freed:
+	/// with the mcjit engine or when loaded from a cache image
+	EVMJIT_API static bool evictCode(std::string const& _codeIdentifier);
+
+	/// Finds the EVM instruction the native code at given address was compiled from.
+	/// Intended for sampling profilers. Requires the code to be compiled with -pcmap option.
+	/// Not async-signal-safe: resolve sampled addresses outside of a signal handler.
+	/// @returns false if the address does not belong to compiled EVM code.
+	EVMJIT_API static bool findCodeLocation(void const* _addr, CodeLocation& o_location);
+
+	/// Runs the compile server on given Unix socket. Processes started with
+	/// the -compile-server option send code to the server for compilation and
+	/// load the returned objects. Compilation options and limits are sent by
+	/// the clients, the server uses its own options (EVMJIT environment variable)
+	/// for the object cache.
+	/// @returns false if the socket cannot be set up, otherwise does not return
+	EVMJIT_API static bool runCompileServer(std::string const& _socketPath);
+
+	/// Runs an in-memory cache storage server on given address (<host>:<port>
+	/// or Unix socket path) for processes started with -cache-storage=remote:<address>.
+	/// ":<port>" listens on loopback, "*:<port>" on all interfaces. The server is not
+	/// authenticated and clients execute the code it returns, so it must be trusted.
+	/// @returns false if the address cannot be listened on, otherwise does not return
+	EVMJIT_API static bool runCacheServer(std::string const& _address);
 };
 
 }
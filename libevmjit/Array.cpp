@@ -1,5 +1,8 @@
 #include "Array.h"
 
+#include <cstdlib>
+#include <cstring>
+
 #include "preprocessor/llvm_includes_start.h"
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Function.h>
@@ -47,9 +50,9 @@ llvm::Function* Array::createArrayPushFunc()
 	auto dataPtr = m_builder.CreateStructGEP(getType(), arrayPtr, 0, "dataPtr");
 	auto sizePtr = m_builder.CreateStructGEP(getType(), arrayPtr, 1, "sizePtr");
 	auto capPtr = m_builder.CreateStructGEP(getType(), arrayPtr, 2, "capPtr");
-	auto data = m_builder.CreateLoad(dataPtr, "data");
-	auto size = m_builder.CreateLoad(sizePtr, "size");
-	auto cap = m_builder.CreateLoad(capPtr, "cap");
+	auto data = tagAccess(m_builder.CreateLoad(dataPtr, "data"), Type::tbaaRuntime);
+	auto size = tagAccess(m_builder.CreateLoad(sizePtr, "size"), Type::tbaaRuntime);
+	auto cap = tagAccess(m_builder.CreateLoad(capPtr, "cap"), Type::tbaaRuntime);
 	auto reallocReq = m_builder.CreateICmpEQ(cap, size, "reallocReq");
 	m_builder.CreateCondBr(reallocReq, reallocBB, pushBB);
 
@@ -59,8 +62,8 @@ llvm::Function* Array::createArrayPushFunc()
 	auto bytes = m_builder.CreateBitCast(data, Type::BytePtr, "bytes");
 	auto newBytes = m_reallocFunc.call(m_builder, {bytes, reallocSize}, "newBytes");
 	auto newData = m_builder.CreateBitCast(newBytes, Type::WordPtr, "newData");
-	m_builder.CreateStore(newData, dataPtr);
-	m_builder.CreateStore(newCap, capPtr);
+	tagAccess(m_builder.CreateStore(newData, dataPtr), Type::tbaaRuntime);
+	tagAccess(m_builder.CreateStore(newCap, capPtr), Type::tbaaRuntime);
 	m_builder.CreateBr(pushBB);
 
 	m_builder.SetInsertPoint(pushBB);
@@ -68,9 +71,9 @@ llvm::Function* Array::createArrayPushFunc()
 	dataPhi->addIncoming(data, entryBB);
 	dataPhi->addIncoming(newData, reallocBB);
 	auto newElemPtr = m_builder.CreateGEP(dataPhi, size, "newElemPtr");
-	m_builder.CreateStore(value, newElemPtr);
+	tagAccess(m_builder.CreateStore(value, newElemPtr), Type::tbaaMemory);
 	auto newSize = m_builder.CreateNUWAdd(size, m_builder.getInt64(1), "newSize");
-	m_builder.CreateStore(newSize, sizePtr);
+	tagAccess(m_builder.CreateStore(newSize, sizePtr), Type::tbaaRuntime);
 	m_builder.CreateRetVoid();
 
 	return func;
@@ -94,9 +97,9 @@ llvm::Function* Array::createArraySetFunc()
 	InsertPointGuard guard{m_builder};
 	m_builder.SetInsertPoint(llvm::BasicBlock::Create(m_builder.getContext(), {}, func));
 	auto dataPtr = m_builder.CreateStructGEP(getType(), arrayPtr, 0, "dataPtr");
-	auto data = m_builder.CreateLoad(dataPtr, "data");
+	auto data = tagAccess(m_builder.CreateLoad(dataPtr, "data"), Type::tbaaRuntime);
 	auto valuePtr = m_builder.CreateGEP(data, index, "valuePtr");
-	m_builder.CreateStore(value, valuePtr);
+	tagAccess(m_builder.CreateStore(value, valuePtr), Type::tbaaMemory);
 	m_builder.CreateRetVoid();
 	return func;
 }
@@ -117,9 +120,9 @@ llvm::Function* Array::createArrayGetFunc()
 	InsertPointGuard guard{m_builder};
 	m_builder.SetInsertPoint(llvm::BasicBlock::Create(m_builder.getContext(), {}, func));
 	auto dataPtr = m_builder.CreateStructGEP(getType(), arrayPtr, 0, "dataPtr");
-	auto data = m_builder.CreateLoad(dataPtr, "data");
+	auto data = tagAccess(m_builder.CreateLoad(dataPtr, "data"), Type::tbaaRuntime);
 	auto valuePtr = m_builder.CreateGEP(data, index, "valuePtr");
-	auto value = m_builder.CreateLoad(valuePtr, "value");
+	auto value = tagAccess(m_builder.CreateLoad(valuePtr, "value"), Type::tbaaMemory);
 	m_builder.CreateRet(value);
 	return func;
 }
@@ -140,7 +143,7 @@ llvm::Function* Array::createGetPtrFunc()
 	InsertPointGuard guard{m_builder};
 	m_builder.SetInsertPoint(llvm::BasicBlock::Create(m_builder.getContext(), {}, func));
 	auto dataPtr = m_builder.CreateBitCast(arrayPtr, Type::BytePtr->getPointerTo(), "dataPtr");
-	auto data = m_builder.CreateLoad(dataPtr, "data");
+	auto data = tagAccess(m_builder.CreateLoad(dataPtr, "data"), Type::tbaaRuntime);
 	auto bytePtr = m_builder.CreateGEP(data, index, "bytePtr");
 	auto wordPtr = m_builder.CreateBitCast(bytePtr, Type::WordPtr, "wordPtr");
 	m_builder.CreateRet(wordPtr);
@@ -153,9 +156,13 @@ llvm::Function* Array::createFreeFunc()
 	func->setDoesNotThrow();
 	func->setDoesNotCapture(1);
 
-	auto freeFunc = llvm::Function::Create(llvm::FunctionType::get(Type::Void, Type::BytePtr, false), llvm::Function::ExternalLinkage, "ext_free", getModule());
-	freeFunc->setDoesNotThrow();
-	freeFunc->setDoesNotCapture(1);
+	auto freeFunc = getModule()->getFunction("ext_free");
+	if (!freeFunc)
+	{
+		freeFunc = llvm::Function::Create(llvm::FunctionType::get(Type::Void, Type::BytePtr, false), llvm::Function::ExternalLinkage, "ext_free", getModule());
+		freeFunc->setDoesNotThrow();
+		freeFunc->setDoesNotCapture(1);
+	}
 
 	auto arrayPtr = &func->getArgumentList().front();
 	arrayPtr->setName("arrayPtr");
@@ -163,7 +170,7 @@ llvm::Function* Array::createFreeFunc()
 	InsertPointGuard guard{m_builder};
 	m_builder.SetInsertPoint(llvm::BasicBlock::Create(m_builder.getContext(), {}, func));
 	auto dataPtr = m_builder.CreateStructGEP(getType(), arrayPtr, 0, "dataPtr");
-	auto data = m_builder.CreateLoad(dataPtr, "data");
+	auto data = tagAccess(m_builder.CreateLoad(dataPtr, "data"), Type::tbaaRuntime);
 	auto mem = m_builder.CreateBitCast(data, Type::BytePtr, "mem");
 	m_builder.CreateCall(freeFunc, mem);
 	m_builder.CreateRetVoid();
@@ -201,15 +208,15 @@ llvm::Function* Array::createExtendFunc()
 	auto dataPtr = m_builder.CreateBitCast(arrayPtr, Type::BytePtr->getPointerTo(), "dataPtr");// TODO: Use byte* in Array
 	auto sizePtr = m_builder.CreateStructGEP(getType(), arrayPtr, 1, "sizePtr");
 	auto capPtr = m_builder.CreateStructGEP(getType(), arrayPtr, 2, "capPtr");
-	auto data = m_builder.CreateLoad(dataPtr, "data");
-	auto size = m_builder.CreateLoad(sizePtr, "size");
+	auto data = tagAccess(m_builder.CreateLoad(dataPtr, "data"), Type::tbaaRuntime);
+	auto size = tagAccess(m_builder.CreateLoad(sizePtr, "size"), Type::tbaaRuntime);
 	auto extSize = m_builder.CreateNUWSub(newSize, size, "extSize");
 	auto newData = m_reallocFunc.call(m_builder, {data, newSize}, "newData"); // TODO: Check realloc result for null
 	auto extPtr = m_builder.CreateGEP(newData, size, "extPtr");
-	m_builder.CreateMemSet(extPtr, m_builder.getInt8(0), extSize, 16);
-	m_builder.CreateStore(newData, dataPtr);
-	m_builder.CreateStore(newSize, sizePtr);
-	m_builder.CreateStore(newSize, capPtr);
+	m_builder.CreateMemSet(extPtr, m_builder.getInt8(0), extSize, RuntimeManager::wordAlignment); // Memory size is a multiple of word size
+	tagAccess(m_builder.CreateStore(newData, dataPtr), Type::tbaaRuntime);
+	tagAccess(m_builder.CreateStore(newSize, sizePtr), Type::tbaaRuntime);
+	tagAccess(m_builder.CreateStore(newSize, capPtr), Type::tbaaRuntime);
 	m_builder.CreateRetVoid();
 	return func;
 }
@@ -225,29 +232,29 @@ Array::Array(IRBuilder& _builder, char const* _name) :
 	CompilerHelper(_builder)
 {
 	m_array = m_builder.CreateAlloca(getType(), nullptr, _name);
-	m_builder.CreateStore(llvm::ConstantAggregateZero::get(getType()), m_array);
+	tagAccess(m_builder.CreateStore(llvm::ConstantAggregateZero::get(getType()), m_array), Type::tbaaRuntime);
 }
 
 Array::Array(IRBuilder& _builder, llvm::Value* _array) :
 	CompilerHelper(_builder),
 	m_array(_array)
 {
-	m_builder.CreateStore(llvm::ConstantAggregateZero::get(getType()), m_array);
+	tagAccess(m_builder.CreateStore(llvm::ConstantAggregateZero::get(getType()), m_array), Type::tbaaRuntime);
 }
 
 
 void Array::pop(llvm::Value* _count)
 {
 	auto sizePtr = m_builder.CreateStructGEP(getType(), m_array, 1, "sizePtr");
-	auto size = m_builder.CreateLoad(sizePtr, "size");
+	auto size = tagAccess(m_builder.CreateLoad(sizePtr, "size"), Type::tbaaRuntime);
 	auto newSize = m_builder.CreateNUWSub(size, _count, "newSize");
-	m_builder.CreateStore(newSize, sizePtr);
+	tagAccess(m_builder.CreateStore(newSize, sizePtr), Type::tbaaRuntime);
 }
 
 llvm::Value* Array::size(llvm::Value* _array)
 {
 	auto sizePtr = m_builder.CreateStructGEP(getType(), _array ? _array : m_array, 1, "sizePtr");
-	return m_builder.CreateLoad(sizePtr, "array.size");
+	return tagAccess(m_builder.CreateLoad(sizePtr, "array.size"), Type::tbaaRuntime);
 }
 
 void Array::extend(llvm::Value* _arrayPtr, llvm::Value* _size)
@@ -263,13 +270,30 @@ void Array::extend(llvm::Value* _arrayPtr, llvm::Value* _size)
 
 extern "C"
 {
+	// Blocks are aligned to RuntimeManager::wordAlignment. The offset of the aligned
+	// block from the block returned by std::realloc is kept in the byte preceding it.
+
 	EVMJIT_API void* ext_realloc(void* _data, size_t _size) noexcept
 	{
-		return std::realloc(_data, _size);
+		using namespace dev::eth::jit;
+		static const auto c_alignment = RuntimeManager::wordAlignment;
+
+		auto data = static_cast<uint8_t*>(_data);
+		size_t oldOffset = data ? data[-1] : 0;
+		auto raw = static_cast<uint8_t*>(std::realloc(data ? data - oldOffset : nullptr, _size + c_alignment));
+		if (!raw)
+			return nullptr;
+
+		auto offset = c_alignment - reinterpret_cast<uintptr_t>(raw) % c_alignment; // in range [1, c_alignment]
+		if (data && offset != oldOffset)
+			std::memmove(raw + offset, raw + oldOffset, _size);
+		raw[offset - 1] = static_cast<uint8_t>(offset);
+		return raw + offset;
 	}
 
 	EVMJIT_API void ext_free(void* _data) noexcept
 	{
-		std::free(_data);
+		if (auto data = static_cast<uint8_t*>(_data))
+			std::free(data - data[-1]);
 	}
 }
@@ -93,7 +93,7 @@ llvm::Value* LocalStack::get(size_t _index)
 		// Fetch an item from global stack
 		ssize_t globalIdx = -static_cast<ssize_t>(idx) - 1;
 		auto slot = m_builder.CreateConstGEP1_64(m_sp, globalIdx);
-		item = m_builder.CreateAlignedLoad(slot, 16); // TODO: Handle malloc alignment. Also for 32-bit systems.
+		item = tagAccess(m_builder.CreateAlignedLoad(slot, RuntimeManager::wordAlignment), Type::tbaaStack);
 		m_minSize = std::min(m_minSize, globalIdx); 	// remember required stack size
 	}
 
@@ -137,11 +137,27 @@ void LocalStack::finalize()
 		else
 			item = *localIt++;	// store new items
 
+		if (isLoadedFrom(item, globalIdx))
+			continue;			// item not modified, no need to store it back
+
 		auto slot = m_builder.CreateConstGEP1_64(m_sp, globalIdx);
-		m_builder.CreateAlignedStore(item, slot, 16); // TODO: Handle malloc alignment. Also for 32-bit systems.
+		tagAccess(m_builder.CreateAlignedStore(item, slot, RuntimeManager::wordAlignment), Type::tbaaStack);
 	}
 }
 
+bool LocalStack::isLoadedFrom(llvm::Value* _item, ssize_t _globalIdx) const
+{
+	auto load = llvm::dyn_cast<llvm::LoadInst>(_item);
+	if (!load)
+		return false;
+
+	auto gep = llvm::dyn_cast<llvm::GetElementPtrInst>(load->getPointerOperand());
+	if (!gep || gep->getPointerOperand() != m_sp || gep->getNumIndices() != 1)
+		return false;
+
+	auto idx = llvm::dyn_cast<llvm::ConstantInt>(gep->idx_begin()->get());
+	return idx && idx->getSExtValue() == _globalIdx;
+}
 
 llvm::Function* LocalStack::getStackPrepareFunc()
 {
@@ -48,6 +48,9 @@ private:
 	/// Sets _index'th value from top (counting from 0)
 	void set(size_t _index, llvm::Value* _value);
 
+	/// Checks if _item is the unmodified value loaded from the _globalIdx'th slot of the global stack
+	bool isLoadedFrom(llvm::Value* _item, ssize_t _globalIdx) const;
+
 	llvm::Function* getStackPrepareFunc();
 
 	/// Items fetched from global stack. First element matches the top of the global stack.
@@ -1,20 +1,28 @@
 #include "Cache.h"
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
 #include <mutex>
+#include <thread>
 
 #include "preprocessor/llvm_includes_start.h"
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/Support/Compression.h>
 #include <llvm/Support/Path.h>
-#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/raw_os_ostream.h>
 #include "preprocessor/llvm_includes_end.h"
 
 #include "support/Path.h"
+#include "CacheStorage.h"
 #include "ExecStats.h"
 #include "Utils.h"
+#include "BuildInfo.gen.h"
 
 namespace dev
 {
@@ -26,14 +34,77 @@ namespace
 	/// The ABI version of jitted codes. It reflects how a generated code
 	/// communicates with outside world. When this communication changes old
 	/// cached code must be invalidated.
-	const auto c_internalABIVersion = 1;
+	const auto c_internalABIVersion = 5;
+
+	/// Extension of keys of pre-linked images
+	const auto c_imageExtension = ".image";
+
+	/// Header of compressed cache files: magic "EVJZ" and uncompressed size
+	const auto c_compressedMagic = llvm::StringRef{"EVJZ"};
+	const auto c_compressedHeaderSize = c_compressedMagic.size() + sizeof(uint64_t);
+	const auto c_maxObjectSize = uint64_t(64) * 1024 * 1024;	///< Limits decompression of corrupted or forged files
 
 	using Guard = std::lock_guard<std::mutex>;
 	std::mutex x_cacheMutex;
 	CacheMode g_mode;
+	CacheOptions g_options;
+	std::shared_ptr<CacheStorage> g_storage;
+	std::string g_keyPrefix;	///< Prefix of storage keys, see getKeyPrefix()
 	std::unique_ptr<llvm::MemoryBuffer> g_lastObject;
 	JITListener* g_listener;
 
+	/// In-memory tier of recently used objects in front of the cache storage
+	class MemoryTier
+	{
+	public:
+		std::unique_ptr<llvm::MemoryBuffer> get(std::string const& _id)
+		{
+			auto it = m_index.find(_id);
+			if (it == m_index.end())
+				return nullptr;
+			m_entries.splice(m_entries.begin(), m_entries, it->second);	// Mark as most recently used
+			return llvm::MemoryBuffer::getMemBufferCopy(it->second->second);
+		}
+
+		void put(std::string const& _id, llvm::StringRef _object)
+		{
+			if (_object.size() > g_options.memoryLimit)
+				return;
+
+			auto it = m_index.find(_id);
+			if (it != m_index.end())
+			{
+				m_size -= it->second->second.size();
+				m_entries.erase(it->second);
+			}
+			m_entries.emplace_front(_id, _object.str());
+			m_index[_id] = m_entries.begin();
+			m_size += _object.size();
+
+			while (m_size > g_options.memoryLimit)
+			{
+				auto& lru = m_entries.back();
+				m_size -= lru.second.size();
+				m_index.erase(lru.first);
+				m_entries.pop_back();
+			}
+		}
+
+		void clear()
+		{
+			m_entries.clear();
+			m_index.clear();
+			m_size = 0;
+		}
+
+	private:
+		using Entry = std::pair<std::string, std::string>;
+		std::list<Entry> m_entries;	///< Most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+		size_t m_size = 0;
+	};
+	MemoryTier g_memoryTier;
+
 	std::string getVersionedCacheDir()
 	{
 		llvm::SmallString<256> path{path::user_cache_directory()};
@@ -42,9 +113,186 @@ namespace
 		return path.str();
 	}
 
+	/// Storage keys start with a hash of the ABI version, the EVMJIT and LLVM versions
+	/// and the code generation target followed by a dash. Shared storages (shm, remote)
+	/// are not versioned by directory, so entries of other builds must not match.
+	std::string getKeyPrefix(CacheOptions const& _options)
+	{
+		auto version = std::to_string(c_internalABIVersion) + " " EVMJIT_VERSION " " LLVM_VERSION " " + _options.target;
+
+		// FNV-1a
+		uint64_t h = 0xcbf29ce484222325;
+		for (auto c : version)
+			h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+		return llvm::utohexstr(h) + "-";
+	}
+
+	/// Creates a module that MCJIT loads from the object cache instead of compiling it
+	std::unique_ptr<llvm::Module> createStubModule(std::string const& _id)
+	{
+		auto&& context = llvm::getGlobalContext();
+		auto module = llvm::make_unique<llvm::Module>(_id, context);
+		auto mainFuncType = llvm::FunctionType::get(llvm::Type::getVoidTy(context), {}, false);
+		auto mainFunc = llvm::Function::Create(mainFuncType, llvm::Function::ExternalLinkage, _id, module.get());
+		auto bb = llvm::BasicBlock::Create(context, {}, mainFunc);
+		bb->getInstList().push_back(new llvm::UnreachableInst{context});
+		return module;
+	}
+
+	/// Persists objects in a background thread so that compilation does not wait for storage I/O
+	class Writer
+	{
+	public:
+		~Writer()
+		{
+			{
+				Guard g{x_queue};
+				m_stop = true;
+			}
+			m_queueCondition.notify_one();
+			if (m_thread.joinable())
+				m_thread.join();	// Pending writes are finished
+		}
+
+		void enqueue(std::string const& _id, llvm::StringRef _object)
+		{
+			{
+				Guard g{x_queue};
+				if (m_queue.size() >= c_maxQueueSize)
+				{
+					DLOG(cache) << _id << ": write queue full, dropped\n";
+					return;
+				}
+				m_queue.push_back(Job{_id, _object.str(), g_options, g_keyPrefix, g_storage});
+				if (!m_thread.joinable())
+					m_thread = std::thread{&Writer::run, this};
+			}
+			m_queueCondition.notify_one();
+		}
+
+		/// @returns the object waiting to be written, null if none
+		std::unique_ptr<llvm::MemoryBuffer> find(std::string const& _id)
+		{
+			Guard g{x_queue};
+			for (auto jobs : {&m_queue, &m_batch})
+				for (auto it = jobs->rbegin(); it != jobs->rend(); ++it)
+					if (it->id == _id)
+						return llvm::MemoryBuffer::getMemBufferCopy(it->object);
+			return nullptr;
+		}
+
+	private:
+		struct Job
+		{
+			std::string id;
+			std::string object;
+			CacheOptions options;
+			std::string keyPrefix;
+			std::shared_ptr<CacheStorage> storage;
+		};
+
+		static const size_t c_maxQueueSize = 256;
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock{x_queue};
+			while (true)
+			{
+				m_queueCondition.wait(lock, [this]{ return m_stop || !m_queue.empty(); });
+				if (m_queue.empty())
+					return;
+
+				// Write all queued objects as a batch, jobs stay visible to find() until written
+				m_batch.swap(m_queue);
+				lock.unlock();
+				for (auto&& job : m_batch)	// Only modified by this thread
+					write(job);
+				lock.lock();
+				m_batch.clear();
+			}
+		}
+
+		void write(Job const& _job)
+		{
+			DLOG(cache) << _job.id << ": write\n";
+			auto key = _job.keyPrefix + _job.id;
+			llvm::SmallVector<char, 0> compressed;
+			if (_job.options.compress && llvm::zlib::isAvailable() &&
+				llvm::zlib::compress(_job.object, compressed) == llvm::zlib::StatusOK)
+			{
+				uint64_t size = _job.object.size();
+				auto content = c_compressedMagic.str();
+				content.append(reinterpret_cast<char const*>(&size), sizeof(size));
+				content.append(compressed.data(), compressed.size());
+				_job.storage->store(key, content);
+			}
+			else
+				_job.storage->store(key, _job.object);
+
+			// Images are only loaded by mapping files
+			if (_job.options.images && !_job.storage->getFilePath(key + c_imageExtension).empty())
+			{
+				auto image = Image::create(llvm::MemoryBufferRef{_job.object, _job.id}, _job.id);
+				if (!image.empty())
+					_job.storage->store(key + c_imageExtension, image);
+			}
+		}
+
+		std::mutex x_queue;
+		std::condition_variable m_queueCondition;
+		std::deque<Job> m_queue;
+		std::deque<Job> m_batch;	///< Jobs being written
+		bool m_stop = false;
+		std::thread m_thread;
+	};
+	Writer g_writer;
+
+	/// Decompresses the content of a cache file if it is compressed
+	std::unique_ptr<llvm::MemoryBuffer> decodeObject(llvm::StringRef _content)
+	{
+		if (!_content.startswith(c_compressedMagic))
+			return llvm::MemoryBuffer::getMemBufferCopy(_content);
+
+		uint64_t size = 0;
+		if (_content.size() < c_compressedHeaderSize || !llvm::zlib::isAvailable())
+			return nullptr;
+		std::memcpy(&size, _content.data() + c_compressedMagic.size(), sizeof(size));
+		if (size > c_maxObjectSize)
+			return nullptr;
+		llvm::SmallVector<char, 0> object;
+		if (llvm::zlib::uncompress(_content.substr(c_compressedHeaderSize), object, static_cast<size_t>(size)) != llvm::zlib::StatusOK)
+			return nullptr;
+		return llvm::MemoryBuffer::getMemBufferCopy({object.data(), object.size()});
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> readObject(std::string const& _id)
+	{
+		if (auto object = g_memoryTier.get(_id))
+			return object;
+		if (auto object = g_writer.find(_id))
+			return object;
+
+		if (auto content = g_storage->lookup(g_keyPrefix + _id))
+		{
+			auto object = decodeObject(content->getBuffer());
+			if (object)
+				g_memoryTier.put(_id, object->getBuffer());
+			else
+				DLOG(cache) << _id << ": cannot decompress\n";
+			return object;
+		}
+		return nullptr;
+	}
+
+	void writeObject(std::string const& _id, llvm::StringRef _object)
+	{
+		g_memoryTier.put(_id, _object);
+		g_writer.enqueue(_id, _object);
+	}
+
 }
 
-ObjectCache* Cache::init(CacheMode _mode, JITListener* _listener)
+ObjectCache* Cache::init(CacheMode _mode, JITListener* _listener, CacheOptions const& _options)
 {
 	DLOG(cache) << "Cache dir: " << getVersionedCacheDir() << "\n";
 
@@ -52,6 +300,14 @@ ObjectCache* Cache::init(CacheMode _mode, JITListener* _listener)
 
 	g_mode = _mode;
 	g_listener = _listener;
+	g_options = _options;
+	g_keyPrefix = getKeyPrefix(g_options);
+	g_storage = CacheStorage::create(g_options.storage, getVersionedCacheDir());
+	if (!g_storage)
+	{
+		DLOG(cache) << "Invalid cache storage " << g_options.storage << ", using default\n";
+		g_storage = CacheStorage::create({}, getVersionedCacheDir());
+	}
 
 	if (g_mode == CacheMode::clear)
 	{
@@ -59,22 +315,21 @@ ObjectCache* Cache::init(CacheMode _mode, JITListener* _listener)
 		g_mode = CacheMode::off;
 	}
 
-	if (g_mode != CacheMode::off)
-	{
-		static ObjectCache objectCache;
-		return &objectCache;
-	}
-	return nullptr;
+	// The object cache is also needed to load objects compiled out of process, see addObject().
+	// Disk operations check the mode.
+	static ObjectCache objectCache;
+	return &objectCache;
 }
 
 void Cache::clear()
 {
 	Guard g{x_cacheMutex};
 
-	auto cachePath = getVersionedCacheDir();
-	std::error_code err;
-	for (auto it = llvm::sys::fs::directory_iterator{cachePath, err}; it != decltype(it){}; it.increment(err))
-		llvm::sys::fs::remove(it->path());
+	// Shared storages hold entries of other builds and targets too
+	g_memoryTier.clear();
+	for (auto&& key : g_storage->enumerate())
+		if (llvm::StringRef{key}.startswith(g_keyPrefix))
+			g_storage->evict(key);
 }
 
 void Cache::preload(llvm::ExecutionEngine& _ee, std::unordered_map<std::string, uint64_t>& _funcCache)
@@ -85,11 +340,11 @@ void Cache::preload(llvm::ExecutionEngine& _ee, std::unordered_map<std::string,
 	auto listener = g_listener;
 	g_listener = nullptr;
 
-	auto cachePath = getVersionedCacheDir();
-	std::error_code err;
-	for (auto it = llvm::sys::fs::directory_iterator{cachePath, err}; it != decltype(it){}; it.increment(err))
+	for (auto&& key : g_storage->enumerate())
 	{
-		auto name = it->path().substr(cachePath.size() + 1);
+		if (!llvm::StringRef{key}.startswith(g_keyPrefix) || llvm::sys::path::extension(key) == c_imageExtension)
+			continue;	// Other targets or versions
+		auto name = key.substr(g_keyPrefix.size());
 		if (auto module = getObject(name))
 		{
 			DLOG(cache) << "Preload: " << name << "\n";
@@ -118,29 +373,57 @@ std::unique_ptr<llvm::Module> Cache::getObject(std::string const& id)
 	if (!CHECK(!g_lastObject))
 		g_lastObject = nullptr;
 
-	llvm::SmallString<256> cachePath{getVersionedCacheDir()};
-	llvm::sys::path::append(cachePath, id);
-
-	if (auto r = llvm::MemoryBuffer::getFile(cachePath, -1, false))
-		g_lastObject = llvm::MemoryBuffer::getMemBufferCopy(r.get()->getBuffer());
-	else if (r.getError() != std::make_error_code(std::errc::no_such_file_or_directory))
-		DLOG(cache) << r.getError().message(); // TODO: Add warning log
-
+	g_lastObject = readObject(id);
 	if (g_lastObject)  // if object found create fake module
 	{
 		DLOG(cache) << id << ": found\n";
-		auto&& context = llvm::getGlobalContext();
-		auto module = llvm::make_unique<llvm::Module>(id, context);
-		auto mainFuncType = llvm::FunctionType::get(llvm::Type::getVoidTy(context), {}, false);
-		auto mainFunc = llvm::Function::Create(mainFuncType, llvm::Function::ExternalLinkage, id, module.get());
-		auto bb = llvm::BasicBlock::Create(context, {}, mainFunc);
-		bb->getInstList().push_back(new llvm::UnreachableInst{context});
-		return module;
+		return createStubModule(id);
 	}
 	DLOG(cache) << id << ": not found\n";
 	return nullptr;
 }
 
+std::unique_ptr<llvm::Module> Cache::addObject(std::string const& _id, std::unique_ptr<llvm::MemoryBuffer> _object)
+{
+	Guard g{x_cacheMutex};
+
+	if (!CHECK(!g_lastObject))
+		g_lastObject = nullptr;
+	g_lastObject = std::move(_object);
+	return createStubModule(_id);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> Cache::loadObject(std::string const& _id)
+{
+	Guard g{x_cacheMutex};
+
+	if (g_mode != CacheMode::on && g_mode != CacheMode::read)
+		return nullptr;
+	return readObject(_id);
+}
+
+void Cache::storeObject(std::string const& _id, llvm::StringRef _object)
+{
+	Guard g{x_cacheMutex};
+
+	if (g_mode != CacheMode::on && g_mode != CacheMode::write)
+		return;
+	writeObject(_id, _object);
+}
+
+uint64_t Cache::loadImage(std::string const& _id, Image::SymbolResolver const& _resolver)
+{
+	Guard g{x_cacheMutex};
+
+	if (!g_options.images || (g_mode != CacheMode::on && g_mode != CacheMode::read))
+		return 0;
+
+	auto path = g_storage->getFilePath(g_keyPrefix + _id + c_imageExtension);
+	auto addr = path.empty() ? 0 : Image::load(path, _resolver);
+	DLOG(cache) << _id << (addr ? ": image mapped\n" : ": image not available\n");
+	return addr;
+}
+
 
 void ObjectCache::notifyObjectCompiled(llvm::Module const* _module, llvm::MemoryBufferRef _object)
 {
@@ -154,20 +437,7 @@ void ObjectCache::notifyObjectCompiled(llvm::Module const* _module, llvm::Memory
 	// if (g_listener)
 		// g_listener->stateChanged(ExecState::CacheWrite);
 
-	auto&& id = _module->getModuleIdentifier();
-	llvm::SmallString<256> cachePath{getVersionedCacheDir()};
-	if (auto err = llvm::sys::fs::create_directories(cachePath))
-	{
-		DLOG(cache) << "Cannot create cache dir " << cachePath.str().str() << " (error: " << err.message() << "\n";
-		return;
-	}
-
-	llvm::sys::path::append(cachePath, id);
-
-	DLOG(cache) << id << ": write\n";
-	std::error_code error;
-	llvm::raw_fd_ostream cacheFile(cachePath, error, llvm::sys::fs::F_None);
-	cacheFile << _object.getBuffer();
+	writeObject(_module->getModuleIdentifier(), _object.getBuffer());
 }
 
 std::unique_ptr<llvm::MemoryBuffer> ObjectCache::getObject(llvm::Module const* _module)
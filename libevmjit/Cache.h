@@ -3,6 +3,8 @@
 #include <memory>
 #include <unordered_map>
 
+#include "Image.h"
+
 #include "preprocessor/llvm_includes_start.h"
 #include <llvm/ExecutionEngine/ObjectCache.h>
 #include "preprocessor/llvm_includes_end.h"
@@ -28,6 +30,28 @@ enum class CacheMode
 	preload
 };
 
+struct CacheOptions
+{
+	/// Also store objects as pre-linked images, see Image.
+	/// The objects must be compiled as position independent code.
+	bool images = false;
+
+	/// Compress objects on disk (if LLVM is built with zlib)
+	bool compress = false;
+
+	/// Size limit in bytes of the in-memory tier of recently used objects, 0 disables it.
+	/// Compiled code is looked up in the cache only when it is not loaded, so the tier serves
+	/// code evicted with JIT::evictCode() and requests of compile server clients.
+	size_t memoryLimit = 0;
+
+	/// Location of the storage, see CacheStorage::create(). Default: directory in user cache directory
+	std::string storage;
+
+	/// Code generation target of the objects, see getTargetId(). Hashed into the prefix
+	/// of storage keys, so storage shared by hosts with different CPUs keeps their objects apart.
+	std::string target;
+};
+
 class ObjectCache : public llvm::ObjectCache
 {
 public:
@@ -45,10 +69,24 @@ public:
 class Cache
 {
 public:
-	static ObjectCache* init(CacheMode _mode, JITListener* _listener);
+	static ObjectCache* init(CacheMode _mode, JITListener* _listener, CacheOptions const& _options = {});
 	static std::unique_ptr<llvm::Module> getObject(std::string const& id);
 
-	/// Clears cache storage
+	/// Provides an object compiled elsewhere (e.g. by the compile server).
+	/// @returns a fake module for which the execution engine loads the object
+	static std::unique_ptr<llvm::Module> addObject(std::string const& _id, std::unique_ptr<llvm::MemoryBuffer> _object);
+
+	/// Reads the object from cache storage. Null if not found or reading is disabled.
+	static std::unique_ptr<llvm::MemoryBuffer> loadObject(std::string const& _id);
+
+	/// Writes the object to cache storage if writing is enabled
+	static void storeObject(std::string const& _id, llvm::StringRef _object);
+
+	/// Maps the cached image of the code if images are enabled.
+	/// @returns the address of the main function, 0 if not available
+	static uint64_t loadImage(std::string const& _id, Image::SymbolResolver const& _resolver);
+
+	/// Clears entries of this build and target from cache storage
 	static void clear();
 
 	/// Loads all available cached objects to ExecutionEngine
@@ -0,0 +1,233 @@
+#include "CacheStorage.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include "preprocessor/llvm_includes_end.h"
+
+#include "support/Path.h"
+#include "RemoteStorage.h"
+#include "Utils.h"
+
+#if !UTILS_OS_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dev
+{
+namespace evmjit
+{
+
+namespace
+{
+	/// Extension of files being written
+	const auto c_tmpExtension = ".tmp";
+
+	/// Files in a directory. Files are written to temporary files and renamed
+	/// when complete, so readers and other processes never see partial entries.
+	class FileStorage : public CacheStorage
+	{
+	public:
+		explicit FileStorage(std::string const& _dir): m_dir(_dir) {}
+
+		std::unique_ptr<llvm::MemoryBuffer> lookup(std::string const& _key) override
+		{
+			if (auto r = llvm::MemoryBuffer::getFile(getFilePath(_key), -1, false))
+				return std::move(r.get());
+			else if (r.getError() != std::make_error_code(std::errc::no_such_file_or_directory))
+				DLOG(cache) << r.getError().message(); // TODO: Add warning log
+			return nullptr;
+		}
+
+		bool store(std::string const& _key, llvm::StringRef _value) override
+		{
+			auto path = getFilePath(_key);
+			if (writeFile(path, _value))
+				return true;
+
+			// The directory is only created when needed
+			if (auto err = llvm::sys::fs::create_directories(m_dir))
+			{
+				DLOG(cache) << "Cannot create cache dir " << m_dir << " (error: " << err.message() << "\n";
+				return false;
+			}
+			return writeFile(path, _value);
+		}
+
+		bool evict(std::string const& _key) override
+		{
+			return !llvm::sys::fs::remove(getFilePath(_key));
+		}
+
+		std::vector<std::string> enumerate() override
+		{
+			std::vector<std::string> keys;
+			std::error_code err;
+			for (auto it = llvm::sys::fs::directory_iterator{m_dir, err}; it != decltype(it){}; it.increment(err))
+			{
+				auto name = llvm::sys::path::filename(it->path());
+				if (llvm::sys::path::extension(name) != c_tmpExtension)
+					keys.push_back(name.str());
+			}
+			return keys;
+		}
+
+		std::string getFilePath(std::string const& _key) override
+		{
+			llvm::SmallString<256> path{m_dir};
+			llvm::sys::path::append(path, _key);
+			return path.str();
+		}
+
+	private:
+		bool writeFile(std::string const& _path, llvm::StringRef _value)
+		{
+			int fd = -1;
+			llvm::SmallString<256> tmpPath;
+			if (llvm::sys::fs::createUniqueFile(_path + "-%%%%%%" + c_tmpExtension, fd, tmpPath))
+				return false;
+			{
+				llvm::raw_fd_ostream file(fd, true);
+				file << _value;
+				file.flush();
+#if !UTILS_OS_WINDOWS
+				::fsync(fd);
+#endif
+			}	// Closes the file
+			if (llvm::sys::fs::rename(tmpPath, _path))
+			{
+				llvm::sys::fs::remove(tmpPath);
+				return false;
+			}
+			return true;
+		}
+
+		std::string m_dir;
+	};
+
+#if !UTILS_OS_WINDOWS
+	/// POSIX shared memory objects, one per entry. Entries survive the processes
+	/// using them until the host restarts, without disk I/O.
+	/// Each object holds the header followed by the value. The header is completed
+	/// after the value is written, so readers skip entries being written.
+	class SharedMemoryStorage : public CacheStorage
+	{
+	public:
+		explicit SharedMemoryStorage(std::string const& _name): m_prefix("evmjit." + _name + ".") {}
+
+		std::unique_ptr<llvm::MemoryBuffer> lookup(std::string const& _key) override
+		{
+			auto fd = ::shm_open(getName(_key).c_str(), O_RDONLY, 0);
+			if (fd < 0)
+				return nullptr;
+
+			std::unique_ptr<llvm::MemoryBuffer> value;
+			struct stat st;
+			if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header))
+			{
+				auto size = static_cast<size_t>(st.st_size);
+				auto mem = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+				if (mem != MAP_FAILED)
+				{
+					auto header = static_cast<Header const*>(mem);
+					if (header->magic.load(std::memory_order_acquire) == c_magic && header->size == size - sizeof(Header))
+						value = llvm::MemoryBuffer::getMemBufferCopy({static_cast<char const*>(mem) + sizeof(Header), header->size});
+					::munmap(mem, size);
+				}
+			}
+			::close(fd);
+			return value;
+		}
+
+		bool store(std::string const& _key, llvm::StringRef _value) override
+		{
+			auto name = getName(_key);
+			auto fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd < 0)
+				return errno == EEXIST;	// Entries are immutable, already stored by another process
+
+			auto size = sizeof(Header) + _value.size();
+			auto mem = ::ftruncate(fd, static_cast<off_t>(size)) == 0 ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+			::close(fd);
+			if (mem == MAP_FAILED)
+			{
+				::shm_unlink(name.c_str());
+				return false;
+			}
+
+			auto header = static_cast<Header*>(mem);
+			header->size = _value.size();
+			std::memcpy(static_cast<char*>(mem) + sizeof(Header), _value.data(), _value.size());
+			header->magic.store(c_magic, std::memory_order_release);
+			::munmap(mem, size);
+			return true;
+		}
+
+		bool evict(std::string const& _key) override
+		{
+			return ::shm_unlink(getName(_key).c_str()) == 0;
+		}
+
+		std::vector<std::string> enumerate() override
+		{
+			// Shared memory objects can only be listed where they are files
+			std::vector<std::string> keys;
+			std::error_code err;
+			for (auto it = llvm::sys::fs::directory_iterator{"/dev/shm", err}; it != decltype(it){}; it.increment(err))
+			{
+				auto name = llvm::sys::path::filename(it->path());
+				if (name.startswith(m_prefix))
+					keys.push_back(name.substr(m_prefix.size()).str());
+			}
+			return keys;
+		}
+
+	private:
+		struct Header
+		{
+			std::atomic<uint64_t> magic;
+			uint64_t size;
+		};
+
+		/// Marks complete entries
+		static const uint64_t c_magic = 0x4d48534a56450001;
+
+		std::string getName(std::string const& _key) const
+		{
+			return "/" + m_prefix + _key;
+		}
+
+		std::string m_prefix;
+	};
+#endif
+}
+
+std::unique_ptr<CacheStorage> CacheStorage::create(std::string const& _location, std::string const& _defaultDir)
+{
+	auto colon = _location.find(':');
+	auto kind = _location.substr(0, colon);
+	auto arg = colon != std::string::npos ? _location.substr(colon + 1) : std::string{};
+
+	if (_location.empty())
+		return std::unique_ptr<CacheStorage>{new FileStorage{_defaultDir}};
+	if (kind == "file" && !arg.empty())
+		return std::unique_ptr<CacheStorage>{new FileStorage{arg}};
+#if !UTILS_OS_WINDOWS
+	if (kind == "shm" && !arg.empty() && arg.find('/') == std::string::npos)
+		return std::unique_ptr<CacheStorage>{new SharedMemoryStorage{arg}};
+	if (kind == "remote" && !arg.empty())
+		return std::unique_ptr<CacheStorage>{new RemoteStorage{arg}};
+#endif
+	return nullptr;
+}
+
+}
+}
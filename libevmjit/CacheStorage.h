@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/Support/MemoryBuffer.h>
+#include "preprocessor/llvm_includes_end.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+/// Backend storing cache entries (compiled objects and images) by key.
+///
+/// Implementations must be thread-safe. Lookups are done by compiling threads,
+/// stores are done by the cache writer thread (see Cache), so backends may
+/// block on I/O there without delaying compilation. Entries are immutable:
+/// a key always maps to the same content.
+class CacheStorage
+{
+public:
+	/// Creates the storage of given location:
+	///   ""                  - files in _defaultDir
+	///   "file:<dir>"        - files in the directory
+	///   "shm:<name>"        - POSIX shared memory objects shared by processes of the host
+	///   "remote:<address>"  - key-value server, e.g. evmjit-cached, see RemoteStorage
+	/// @returns null if the location is not valid or not supported on the platform
+	static std::unique_ptr<CacheStorage> create(std::string const& _location, std::string const& _defaultDir);
+
+	virtual ~CacheStorage() = default;
+
+	/// @returns the entry, null if not found
+	virtual std::unique_ptr<llvm::MemoryBuffer> lookup(std::string const& _key) = 0;
+
+	virtual bool store(std::string const& _key, llvm::StringRef _value) = 0;
+
+	virtual bool evict(std::string const& _key) = 0;
+
+	/// @returns keys of all entries
+	virtual std::vector<std::string> enumerate() = 0;
+
+	/// @returns local file containing exactly the entry, so it can be mapped into memory. Empty if not available.
+	virtual std::string getFilePath(std::string const&) { return {}; }
+};
+
+}
+}
@@ -0,0 +1,160 @@
+#include "CompileScheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace dev
+{
+namespace evmjit
+{
+
+CompileScheduler::CompileScheduler(unsigned _numThreads)
+{
+	for (unsigned i = 0; i < _numThreads; ++i)
+		m_workers.emplace_back(&CompileScheduler::work, this);
+}
+
+CompileScheduler::~CompileScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock{x_jobs};
+		m_stop = true;
+		m_stats.cancelled += m_queue.size();
+		m_queue.clear();
+	}
+	m_jobQueued.notify_all();
+	for (auto& worker : m_workers)
+		worker.join();
+}
+
+void CompileScheduler::submit(std::string const& _key, CompilePriority _priority, Task _task, clock::time_point _deadline)
+{
+	{
+		std::lock_guard<std::mutex> lock{x_jobs};
+		if (m_running.count(_key))
+		{
+			++m_stats.coalesced;
+			return;
+		}
+
+		auto it = std::find_if(m_queue.begin(), m_queue.end(), [&](Job const& _job) { return _job.key == _key; });
+		if (it != m_queue.end())
+		{
+			it->priority = std::min(it->priority, _priority);
+			it->deadline = std::max(it->deadline, _deadline);
+			++m_stats.coalesced;
+			return;
+		}
+
+		m_queue.push_back({_key, _priority, std::move(_task), _deadline, clock::now(), m_sequence++});
+		if (m_queue.size() > m_stats.maxQueueDepth)
+			m_stats.maxQueueDepth = m_queue.size();
+	}
+	m_jobQueued.notify_one();
+}
+
+void CompileScheduler::run(std::string const& _key, Task const& _task)
+{
+	auto startTime = clock::now();
+	{
+		std::unique_lock<std::mutex> lock{x_jobs};
+		auto it = std::find_if(m_queue.begin(), m_queue.end(), [&](Job const& _job) { return _job.key == _key; });
+		if (it != m_queue.end())
+		{
+			m_queue.erase(it);	// Taken over by this request
+			++m_stats.coalesced;
+		}
+		m_jobDone.wait(lock, [&] { return !m_running.count(_key); });
+		m_running.insert(_key);
+	}
+	recordWait(CompilePriority::blocking, clock::now() - startTime);
+
+	struct Finish
+	{
+		CompileScheduler& scheduler;
+		std::string const& key;
+		~Finish()
+		{
+			{
+				std::lock_guard<std::mutex> lock{scheduler.x_jobs};
+				scheduler.m_running.erase(key);
+			}
+			scheduler.m_jobDone.notify_all();
+		}
+	} finish{*this, _key};
+	_task();
+}
+
+bool CompileScheduler::cancel(std::string const& _key)
+{
+	std::lock_guard<std::mutex> lock{x_jobs};
+	auto it = std::find_if(m_queue.begin(), m_queue.end(), [&](Job const& _job) { return _job.key == _key; });
+	if (it == m_queue.end())
+		return false;
+	m_queue.erase(it);
+	++m_stats.cancelled;
+	return true;
+}
+
+size_t CompileScheduler::pickJob(clock::time_point _now)
+{
+	auto expired = [&](Job const& _job) { return _job.deadline < _now; };
+	auto end = std::remove_if(m_queue.begin(), m_queue.end(), expired);
+	m_stats.cancelled += static_cast<uint64_t>(m_queue.end() - end);
+	m_queue.erase(end, m_queue.end());
+
+	// Keys of queued jobs are never running, submit() and run() coalesce such requests
+	auto best = m_queue.size();
+	for (size_t i = 0; i < m_queue.size(); ++i)
+	{
+		if (best == m_queue.size() ||
+			std::make_pair(m_queue[i].priority, m_queue[i].sequence) < std::make_pair(m_queue[best].priority, m_queue[best].sequence))
+			best = i;
+	}
+	return best;
+}
+
+void CompileScheduler::work()
+{
+	std::unique_lock<std::mutex> lock{x_jobs};
+	while (true)
+	{
+		size_t index = 0;
+		auto ready = [&]
+		{
+			if (m_stop)
+				return true;
+			index = pickJob(clock::now());
+			return index != m_queue.size();
+		};
+		m_jobQueued.wait(lock, ready);
+		if (m_stop)
+			return;
+
+		auto job = std::move(m_queue[index]);
+		m_queue.erase(m_queue.begin() + static_cast<std::ptrdiff_t>(index));
+		m_running.insert(job.key);
+		lock.unlock();
+
+		recordWait(job.priority, clock::now() - job.submitTime);
+		job.task();
+
+		lock.lock();
+		m_running.erase(job.key);
+		m_jobDone.notify_all();
+	}
+}
+
+void CompileScheduler::recordWait(CompilePriority _priority, clock::duration _waitTime)
+{
+	auto i = static_cast<size_t>(_priority);
+	assert(i < CompileSchedulerStats::numPriorities);
+	auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(_waitTime).count());
+	++m_stats.jobs[i];
+	m_stats.waitTime[i] += us;
+	auto max = m_stats.maxWaitTime[i].load();
+	while (us > max && !m_stats.maxWaitTime[i].compare_exchange_weak(max, us)) {}
+}
+
+}
+}
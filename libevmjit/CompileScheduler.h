@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "ExecStats.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+/// Priorities of compile jobs, highest first
+enum class CompilePriority
+{
+	blocking,	///< Executions are waiting for the code
+	tierUp,		///< Hot baseline code recompiled with optimizations
+	prefetch	///< Speculative compilation of code that may be executed soon
+};
+
+/// Schedules compile jobs identified by keys.
+///
+/// Background jobs run in worker threads, the highest priority first and in
+/// submission order within a priority. Blocking jobs run in the threads that
+/// wait for them. Requests for a key already queued or running are coalesced
+/// into one job. Queued jobs are cancelled when their deadline passes.
+class CompileScheduler
+{
+public:
+	using clock = std::chrono::steady_clock;
+	using Task = std::function<void()>;
+
+	explicit CompileScheduler(unsigned _numThreads);
+
+	/// Cancels queued jobs and waits for running jobs
+	~CompileScheduler();
+
+	/// Queues the task for a worker thread. If a job of the key is queued
+	/// already, it gets the higher priority and the later deadline of the two
+	/// requests and the task is dropped. Also dropped if the job is running.
+	void submit(std::string const& _key, CompilePriority _priority, Task _task, clock::time_point _deadline = clock::time_point::max());
+
+	/// Runs the task in the calling thread. A queued job of the key is cancelled,
+	/// a running job of the key is waited for first so that its result can be used.
+	void run(std::string const& _key, Task const& _task);
+
+	/// Cancels the queued job of the key. A running job is not interrupted.
+	/// @returns true if a job has been cancelled
+	bool cancel(std::string const& _key);
+
+	CompileSchedulerStats const& stats() const { return m_stats; }
+
+private:
+	struct Job
+	{
+		std::string key;
+		CompilePriority priority;
+		Task task;
+		clock::time_point deadline;
+		clock::time_point submitTime;
+		uint64_t sequence;	///< Order of submission
+	};
+
+	void work();
+
+	/// @returns the index of the next job to run, removes expired jobs. Requires x_jobs.
+	size_t pickJob(clock::time_point _now);
+
+	void recordWait(CompilePriority _priority, clock::duration _waitTime);
+
+	mutable std::mutex x_jobs;
+	std::condition_variable m_jobQueued;
+	std::condition_variable m_jobDone;
+	std::vector<Job> m_queue;	///< Unordered, scanned when a job is picked: the queue is short
+	std::unordered_set<std::string> m_running;
+	uint64_t m_sequence = 0;
+	bool m_stop = false;
+	std::vector<std::thread> m_workers;
+	CompileSchedulerStats m_stats;
+};
+
+}
+}
@@ -0,0 +1,179 @@
+#include "CompileServer.h"
+
+#include <cstring>
+#include <thread>
+
+#include "support/Socket.h"
+#include "Utils.h"
+#include "BuildInfo.gen.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+#ifndef _WIN32
+
+namespace
+{
+	/// Identifies the protocol and the build. Objects are only valid for the same EVMJIT build.
+	const auto c_magic = uint32_t(0x434a5645);	// "EVJC"
+	const auto c_version = EVMJIT_VERSION " " LLVM_VERSION;
+
+	/// Timeout of connecting and of each send and receive, including the compilation.
+	/// Requests to a wedged server fail, so the client compiles locally.
+	const auto c_timeoutMs = 10000u;
+
+	struct RequestHeader
+	{
+		uint32_t magic;
+		uint32_t versionSize;
+		uint32_t idSize;
+		uint32_t targetSize;
+		uint64_t codeSize;
+		uint8_t haveDelegateCall;
+		uint8_t optimize;
+		uint8_t trace;
+		uint8_t memoryLoops;
+		uint8_t pcMap;
+		uint32_t maxBlocks;
+		uint32_t maxIRSize;
+		uint32_t maxCompileTime;
+	};
+
+	struct ResponseHeader
+	{
+		CompileStatus status;
+		uint64_t objectSize;
+	};
+
+	void serveConnection(int _fd, CompileServer::Handler const& _handler)
+	{
+		RequestHeader header;
+		std::string version;
+		CompileRequest request;
+		std::string object;
+		while (net::read_all(_fd, &header, sizeof(header)) && header.magic == c_magic &&
+			   net::read_string(_fd, version, header.versionSize) &&
+			   net::read_string(_fd, request.moduleIdentifier, header.idSize) &&
+			   net::read_string(_fd, request.target, header.targetSize) &&
+			   net::read_string(_fd, request.code, header.codeSize))
+		{
+			request.haveDelegateCall = header.haveDelegateCall != 0;
+			request.optimize = header.optimize != 0;
+			request.trace = header.trace;
+			request.memoryLoops = header.memoryLoops != 0;
+			request.pcMap = header.pcMap != 0;
+			request.maxBlocks = header.maxBlocks;
+			request.maxIRSize = header.maxIRSize;
+			request.maxCompileTime = header.maxCompileTime;
+
+			object.clear();
+			auto status = version == c_version ? _handler(request, object) : CompileStatus::Error;
+			if (status != CompileStatus::Ok)
+				object.clear();
+			ResponseHeader response{status, object.size()};
+			if (!net::write_all(_fd, &response, sizeof(response)) || !net::write_all(_fd, object.data(), object.size()))
+				break;
+		}
+		net::close(_fd);
+	}
+
+	/// Connection of a client thread to the server
+	struct Connection
+	{
+		int fd = -1;
+
+		~Connection() { reset(); }
+
+		void reset()
+		{
+			if (fd >= 0)
+				net::close(fd);
+			fd = -1;
+		}
+
+		bool connect(std::string const& _socketPath)
+		{
+			if (fd < 0)
+				fd = net::connect(_socketPath, c_timeoutMs);
+			return fd >= 0;
+		}
+	};
+}
+
+bool CompileServer::serve(std::string const& _socketPath, Handler const& _handler)
+{
+	auto fd = net::listen(_socketPath);
+	if (fd < 0)
+		return false;
+
+	while (true)
+	{
+		auto conn = net::accept(fd);
+		if (conn >= 0)
+			std::thread{serveConnection, conn, std::cref(_handler)}.detach();
+	}
+}
+
+CompileStatus CompileServer::request(std::string const& _socketPath, CompileRequest const& _request, std::string& o_object)
+{
+	thread_local Connection t_connection;
+
+	RequestHeader header{};
+	header.magic = c_magic;
+	header.versionSize = static_cast<uint32_t>(std::strlen(c_version));
+	header.idSize = static_cast<uint32_t>(_request.moduleIdentifier.size());
+	header.targetSize = static_cast<uint32_t>(_request.target.size());
+	header.codeSize = _request.code.size();
+	header.haveDelegateCall = _request.haveDelegateCall;
+	header.optimize = _request.optimize;
+	header.trace = _request.trace;
+	header.memoryLoops = _request.memoryLoops;
+	header.pcMap = _request.pcMap;
+	header.maxBlocks = _request.maxBlocks;
+	header.maxIRSize = _request.maxIRSize;
+	header.maxCompileTime = _request.maxCompileTime;
+
+	// The server may have been restarted, reconnect once if a kept connection fails
+	for (auto attempt = 0; attempt < 2; ++attempt)
+	{
+		auto isKept = t_connection.fd >= 0;
+		if (!t_connection.connect(_socketPath))
+			return CompileStatus::Error;
+
+		ResponseHeader response;
+		auto fd = t_connection.fd;
+		if (net::write_all(fd, &header, sizeof(header)) &&
+			net::write_all(fd, c_version, header.versionSize) &&
+			net::write_all(fd, _request.moduleIdentifier.data(), header.idSize) &&
+			net::write_all(fd, _request.target.data(), header.targetSize) &&
+			net::write_all(fd, _request.code.data(), header.codeSize) &&
+			net::read_all(fd, &response, sizeof(response)) &&
+			net::read_string(fd, o_object, response.objectSize))
+			return response.status;
+
+		DLOG(compileserver) << "Connection to " << _socketPath << " failed\n";
+		t_connection.reset();
+		if (!isKept)
+			break;	// e.g. timed out, do not wait again
+	}
+	return CompileStatus::Error;
+}
+
+#else
+
+bool CompileServer::serve(std::string const&, Handler const&)
+{
+	return false;	// Unix domain sockets are not supported
+}
+
+CompileStatus CompileServer::request(std::string const&, CompileRequest const&, std::string&)
+{
+	return CompileStatus::Error;
+}
+
+#endif
+
+}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace dev
+{
+namespace evmjit
+{
+
+/// Request for compilation of EVM code to a relocatable object
+struct CompileRequest
+{
+	std::string moduleIdentifier;	///< Code identifier, also the name of the main function
+	std::string target;				///< Code generation target of the client, see getTargetId()
+	std::string code;				///< EVM code
+	bool haveDelegateCall = true;	///< JITSchedule::haveDelegateCall
+	bool optimize = false;			///< Run IR optimizations and optimizing code generation
+	uint8_t trace = 0;				///< TraceLevel
+	bool memoryLoops = true;		///< Compiler::Options::optimizeMemoryLoops
+	bool pcMap = false;				///< Compiler::Options::emitPCMap
+	uint32_t maxBlocks = 0;			///< Compiler::Options::maxBlocks
+	uint32_t maxIRSize = 0;			///< Compiler::Options::maxIRSize
+	uint32_t maxCompileTime = 0;	///< Compiler::Options::maxCompileTime
+};
+
+enum class CompileStatus : uint32_t
+{
+	Ok,
+	Rejected,	///< Code exceeds compilation limits
+	Error		///< Compilation failed or the server is not available
+};
+
+/// Compilation in a separate process (evmjit-compiled) over a Unix domain socket.
+/// Executor processes do not need to carry LLVM's memory footprint and share
+/// the compile server and its cache. Client and server run on the same host
+/// with the same EVMJIT build, so messages use native byte order.
+/// Compilation options and limits come with each request, the server options only
+/// configure its cache.
+class CompileServer
+{
+public:
+	using Handler = std::function<CompileStatus(CompileRequest const& _request, std::string& o_object)>;
+
+	/// Accepts connections on the socket and serves requests of each connection in a separate thread.
+	/// @returns false if the socket cannot be set up, otherwise does not return
+	static bool serve(std::string const& _socketPath, Handler const& _handler);
+
+	/// Sends the request to the server. Each client thread keeps its own connection.
+	static CompileStatus request(std::string const& _socketPath, CompileRequest const& _request, std::string& o_object);
+};
+
+}
+}
@@ -4,12 +4,15 @@
 #include <fstream>
 #include <chrono>
 #include <sstream>
+#include <unordered_map>
 
 #include "preprocessor/llvm_includes_start.h"
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/IR/CFG.h>
+#include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IntrinsicInst.h>
+#include <llvm/Support/Dwarf.h>
 #include "preprocessor/llvm_includes_end.h"
 
 #include "evmjit/JIT.h"
@@ -32,6 +35,13 @@ namespace jit
 
 static const auto c_destIdxLabel = "destIdx";
 
+/// Type of stencil functions: i32 (Runtime*, StencilFrame*)
+static llvm::FunctionType* getStencilFuncType()
+{
+	llvm::Type* argTypes[] = {Type::RuntimePtr, RuntimeManager::getStencilFrameType()->getPointerTo()};
+	return llvm::FunctionType::get(Type::MainReturn, argTypes, false);
+}
+
 Compiler::Compiler(Options const& _options, JITSchedule const& _schedule):
 	m_options(_options),
 	m_schedule(_schedule),
@@ -148,6 +158,138 @@ void Compiler::resolveJumps()
 	}
 }
 
+void Compiler::compileMemoryLoop(MemoryLoop const& _loop, RuntimeManager& _runtimeManager, Memory& _memory, GasMeter& _gasMeter)
+{
+	// The global stack is up to date at the loop head, so items are accessed directly.
+	// Blocks are inserted before the next code block to keep fallthrough jumps working.
+	auto& ctx = m_builder.getContext();
+	auto headBB = m_builder.GetInsertBlock();
+	auto nextBB = headBB->getNextNode();
+	auto checkBB = llvm::BasicBlock::Create(ctx, headBB->getName() + ".memloop.check", m_mainFunc, nextBB);
+	auto bulkBB = llvm::BasicBlock::Create(ctx, headBB->getName() + ".memloop", m_mainFunc, nextBB);
+	auto loopBB = llvm::BasicBlock::Create(ctx, headBB->getName() + ".loop", m_mainFunc, nextBB);
+
+	auto stackSize = m_builder.CreateLoad(_runtimeManager.getStackSize(), "stack.size");
+	auto depthOk = m_builder.CreateICmpUGE(stackSize, m_builder.getInt64(_loop.stackDepth), "memloop.depthOk");
+	auto growthOk = m_builder.CreateICmpULE(stackSize, m_builder.getInt64(RuntimeManager::stackSizeLimit - _loop.stackGrowth), "memloop.growthOk");
+	m_builder.CreateCondBr(m_builder.CreateAnd(depthOk, growthOk), checkBB, loopBB);
+
+	m_builder.SetInsertPoint(checkBB);
+	auto getItemPtr = [&](int _index)
+	{
+		auto idx = m_builder.CreateSub(stackSize, m_builder.getInt64(_index + 1));
+		return m_builder.CreateGEP(_runtimeManager.getStackBase(), idx);
+	};
+	auto getTerm = [&](MemoryLoop::Term const& _term) -> llvm::Value*
+	{
+		if (_term.index < 0)
+			return Constant::get(_term.offset);
+		auto item = tagAccess(m_builder.CreateAlignedLoad(getItemPtr(_term.index), RuntimeManager::wordAlignment), Type::tbaaStack);
+		return m_builder.CreateAdd(item, Constant::get(_term.offset));
+	};
+
+	// Number of iterations. See findMemoryLoops() for the supported forms of the loop condition:
+	// the counter increases towards the bound or decreases towards it.
+	auto lhs = getTerm(_loop.lhs);
+	auto rhs = getTerm(_loop.rhs);
+	auto isLhsCounter = _loop.lhs.index >= 0 && _loop.step(_loop.lhs.index) != 0;
+	auto step = _loop.step(isLhsCounter ? _loop.lhs.index : _loop.rhs.index);
+	auto absStep = step.isNegative() ? -step : step;
+	auto counter = isLhsCounter ? lhs : rhs;
+	auto bound = isLhsCounter ? rhs : lhs;
+	auto distance = step.isNegative() ? m_builder.CreateSub(counter, bound) : m_builder.CreateSub(bound, counter);
+	llvm::Value* holds = nullptr;
+	llvm::Value* count = nullptr;
+	llvm::Value* noWrap = nullptr;	// the counter does not overflow before the loop ends
+	if (_loop.continueIfLess)
+	{
+		holds = m_builder.CreateICmpULT(lhs, rhs);
+		count = m_builder.CreateAdd(m_builder.CreateUDiv(m_builder.CreateSub(distance, Constant::get(1)), Constant::get(absStep)), Constant::get(1));
+		noWrap = isLhsCounter ? m_builder.CreateICmpULE(bound, Constant::get(-step)) : m_builder.CreateICmpUGE(bound, Constant::get(absStep - 1));
+	}
+	else
+	{
+		holds = m_builder.CreateICmpUGE(lhs, rhs);
+		count = m_builder.CreateAdd(m_builder.CreateUDiv(distance, Constant::get(absStep)), Constant::get(1));
+		noWrap = isLhsCounter ? m_builder.CreateICmpUGE(bound, Constant::get(absStep)) : m_builder.CreateICmpULE(bound, Constant::get(~step));
+	}
+	static const auto c_maxCount = uint64_t(1) << 32; // larger loops run out of gas anyway
+	auto countOk = m_builder.CreateICmpULE(count, Constant::get(c_maxCount));
+	auto ok = m_builder.CreateAnd(m_builder.CreateAnd(holds, noWrap), countOk, "memloop.ok");
+
+	auto size = m_builder.CreateMul(count, Constant::get(32), "memloop.size");
+	auto dst = getTerm(_loop.dst);
+	llvm::Value* src = nullptr;
+	if (_loop.isCopy)
+	{
+		// Word by word copy is equivalent to memmove unless it overwrites the source before reading it
+		src = getTerm(_loop.src);
+		auto noOverlap = m_builder.CreateOr(m_builder.CreateICmpULE(dst, src), m_builder.CreateICmpUGE(dst, m_builder.CreateAdd(src, size)));
+		ok = m_builder.CreateAnd(ok, noOverlap, "memloop.ok");
+	}
+	m_builder.CreateCondBr(ok, bulkBB, loopBB);
+
+	m_builder.SetInsertPoint(bulkBB);
+	_gasMeter.count(m_builder.CreateMul(count, Constant::get(_loop.iterationGas)));
+	if (src)
+		_memory.require(src, size);
+	_memory.require(dst, size);
+	auto size64 = m_builder.CreateTrunc(size, Type::Size);
+	auto dstPtr = _memory.getBytePtr(m_builder.CreateTrunc(dst, Type::Size));
+	if (src)
+		m_builder.CreateMemMove(dstPtr, _memory.getBytePtr(m_builder.CreateTrunc(src, Type::Size)), size64, 1);
+	else
+		m_builder.CreateMemSet(dstPtr, m_builder.getInt8(0), size64, 1);
+	for (auto& s : _loop.steps)
+	{
+		auto itemPtr = getItemPtr(s.first);
+		auto item = tagAccess(m_builder.CreateAlignedLoad(itemPtr, RuntimeManager::wordAlignment), Type::tbaaStack);
+		auto newItem = m_builder.CreateAdd(item, m_builder.CreateMul(count, Constant::get(s.second)));
+		tagAccess(m_builder.CreateAlignedStore(newItem, itemPtr, RuntimeManager::wordAlignment), Type::tbaaStack);
+	}
+	m_builder.CreateBr(loopBB);
+
+	// The loop head code follows. The loop condition fails now if the bulk operation was done.
+	m_builder.SetInsertPoint(loopBB);
+}
+
+void Compiler::insertCancellationChecks(RuntimeManager& _runtimeManager)
+{
+	// Loops in EVM code are possible only with dynamic jumps (through the jump table)
+	// or static jumps to a previous block. Find terminators of such jumps first.
+	std::unordered_map<llvm::BasicBlock const*, size_t> blockIndex;
+	for (auto& bb : *m_mainFunc)
+		blockIndex.emplace(&bb, blockIndex.size());
+
+	std::vector<llvm::TerminatorInst*> backEdges;
+	for (auto& bb : *m_mainFunc)
+	{
+		auto jump = llvm::dyn_cast_or_null<llvm::BranchInst>(bb.getTerminator());
+		if (!jump || !jump->getMetadata(c_destIdxLabel))
+			continue;
+		auto dest = jump->getSuccessor(0);
+		if (dest == m_jumpTableBB || blockIndex[dest] <= blockIndex[&bb])
+			backEdges.push_back(jump);
+	}
+
+	if (backEdges.empty())
+		return;
+
+	auto cancelBB = llvm::BasicBlock::Create(m_mainFunc->getContext(), "Cancelled", m_mainFunc, &m_mainFunc->back()); // Exit block must stay the last one
+	m_builder.SetInsertPoint(cancelBB);
+	_runtimeManager.exit(ReturnCode::Cancelled);
+
+	for (auto jump : backEdges)
+	{
+		auto bb = jump->getParent();
+		auto jumpBB = bb->splitBasicBlock(jump, bb->getName() + ".jump");
+		auto br = bb->getTerminator();
+		m_builder.SetInsertPoint(br);
+		m_builder.CreateCondBr(_runtimeManager.isCancelled(), cancelBB, jumpBB, Type::expectFalse);
+		br->eraseFromParent();
+	}
+}
+
 std::unique_ptr<llvm::Module> Compiler::compile(code_iterator _begin, code_iterator _end, std::string const& _id)
 {
 	auto module = llvm::make_unique<llvm::Module>(_id, m_builder.getContext()); // TODO: Provide native DataLayout
@@ -157,10 +299,44 @@ std::unique_ptr<llvm::Module> Compiler::compile(code_iterator _begin, code_itera
 	m_mainFunc = llvm::Function::Create(mainFuncType, llvm::Function::ExternalLinkage, _id, module.get());
 	m_mainFunc->getArgumentList().front().setName("rt");
 
+	// Create debug info used to map native code to EVM code locations
+	std::unique_ptr<llvm::DIBuilder> diBuilder;
+	if (m_options.emitPCMap)
+	{
+		module->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+		diBuilder.reset(new llvm::DIBuilder{*module});
+		auto fileName = _id + ".evm";
+		diBuilder->createCompileUnit(llvm::dwarf::DW_LANG_C, fileName, ".", "evmjit", false, "", 0);
+		auto file = diBuilder->createFile(fileName, ".");
+		auto funcType = diBuilder->createSubroutineType(file, diBuilder->getOrCreateTypeArray(llvm::None));
+		m_debugScope = diBuilder->createFunction(file, _id, _id, file, 0, funcType, false, true, 0, 0, false, m_mainFunc);
+	}
+
 	// Create entry basic block
 	auto entryBB = llvm::BasicBlock::Create(m_builder.getContext(), "Entry", m_mainFunc);
 
+	// Checked between basic blocks, so pathological code does not reach the optimizer and code generation
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_options.maxCompileTime);
+	auto isOverTime = [&]
+	{
+		if (!m_options.maxCompileTime || std::chrono::steady_clock::now() <= deadline)
+			return false;
+		DLOG(compiler) << _id << ": IR construction takes too long\n";
+		m_exceededLimit = Limit::CompileTime;
+		return true;
+	};
+
 	auto blocks = createBasicBlocks(_begin, _end);
+	if (m_options.maxBlocks && blocks.size() > m_options.maxBlocks)
+	{
+		DLOG(compiler) << _id << ": too many blocks (" << blocks.size() << ")\n";
+		m_exceededLimit = Limit::Blocks;
+		return nullptr;
+	}
+
+	// Tracing requires every iteration to be executed
+	if (m_options.optimizeMemoryLoops && m_options.trace == TraceLevel::None)
+		m_memoryLoops = findMemoryLoops(blocks);
 
  	// Special "Stop" block. Guarantees that there exists a next block after the code blocks (also when there are no code blocks).
 	auto stopBB = llvm::BasicBlock::Create(m_mainFunc->getContext(), "Stop", m_mainFunc);
@@ -181,23 +357,15 @@ std::unique_ptr<llvm::Module> Compiler::compile(code_iterator _begin, code_itera
 	Ext ext(runtimeManager, memory);
 	Arith256 arith(m_builder);
 
-	auto jmpBufWords = m_builder.CreateAlloca(Type::BytePtr, m_builder.getInt64(3), "jmpBuf.words");
-	auto frameaddress = llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::frameaddress);
-	auto fp = m_builder.CreateCall(frameaddress, m_builder.getInt32(0), "fp");
-	m_builder.CreateStore(fp, jmpBufWords);
-	auto stacksave = llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::stacksave);
-	auto sp = m_builder.CreateCall(stacksave, {}, "sp");
-	auto jmpBufSp = m_builder.CreateConstInBoundsGEP1_64(jmpBufWords, 2, "jmpBuf.sp");
-	m_builder.CreateStore(sp, jmpBufSp);
-	auto setjmp = llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::eh_sjlj_setjmp);
-	auto jmpBuf = m_builder.CreateBitCast(jmpBufWords, Type::BytePtr, "jmpBuf");
-	auto r = m_builder.CreateCall(setjmp, jmpBuf);
-	auto normalFlow = m_builder.CreateICmpEQ(r, m_builder.getInt32(0));
-	runtimeManager.setJmpBuf(jmpBuf);
+	auto normalFlow = setupJmpBuf(runtimeManager);
 	m_builder.CreateCondBr(normalFlow, entryBB->getNextNode(), abortBB, Type::expectTrue);
 
 	for (auto& block: blocks)
+	{
+		if (isOverTime())
+			return nullptr;
 		compileBasicBlock(block, runtimeManager, arith, memory, ext, gasMeter);
+	}
 
 	// Code for special blocks:
 	m_builder.SetInsertPoint(stopBB);
@@ -207,21 +375,249 @@ std::unique_ptr<llvm::Module> Compiler::compile(code_iterator _begin, code_itera
 	runtimeManager.exit(ReturnCode::OutOfGas);
 
 	resolveJumps();
+	insertCancellationChecks(runtimeManager);
+	if (isOverTime())
+		return nullptr;
+
+	if (m_options.maxIRSize)
+	{
+		size_t irSize = 0;
+		for (auto& func : *module)
+			for (auto& bb : func)
+				irSize += bb.size();
+		if (irSize > m_options.maxIRSize)
+		{
+			DLOG(compiler) << _id << ": IR too big (" << irSize << ")\n";
+			m_exceededLimit = Limit::IRSize;
+			return nullptr;
+		}
+	}
+
+	if (diBuilder)
+	{
+		// Instructions not belonging to any EVM instruction get line 0
+		auto noLoc = llvm::DebugLoc::get(0, 0, m_debugScope);
+		for (auto& bb : *m_mainFunc)
+			for (auto& inst : bb)
+				if (!inst.getDebugLoc())
+					inst.setDebugLoc(noLoc);
+		diBuilder->finalize();
+		m_debugScope = nullptr;
+	}
 
 	return module;
 }
 
+llvm::Value* Compiler::setupJmpBuf(RuntimeManager& _runtimeManager)
+{
+	auto module = m_mainFunc->getParent();
+	auto jmpBufWords = m_builder.CreateAlloca(Type::BytePtr, m_builder.getInt64(3), "jmpBuf.words");
+	auto frameaddress = llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::frameaddress);
+	auto fp = m_builder.CreateCall(frameaddress, m_builder.getInt32(0), "fp");
+	m_builder.CreateStore(fp, jmpBufWords);
+	auto stacksave = llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::stacksave);
+	auto sp = m_builder.CreateCall(stacksave, {}, "sp");
+	auto jmpBufSp = m_builder.CreateConstInBoundsGEP1_64(jmpBufWords, 2, "jmpBuf.sp");
+	m_builder.CreateStore(sp, jmpBufSp);
+	auto setjmp = llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::eh_sjlj_setjmp);
+	auto jmpBuf = m_builder.CreateBitCast(jmpBufWords, Type::BytePtr, "jmpBuf");
+	auto r = m_builder.CreateCall(setjmp, jmpBuf);
+	_runtimeManager.setJmpBuf(jmpBuf);
+	return m_builder.CreateICmpEQ(r, m_builder.getInt32(0));
+}
+
+std::unique_ptr<llvm::Module> Compiler::compileStencil(Instruction _inst, std::string const& _id)
+{
+	auto module = llvm::make_unique<llvm::Module>(_id, m_builder.getContext());
+	m_mainFunc = llvm::Function::Create(getStencilFuncType(), llvm::Function::ExternalLinkage, _id, module.get());
+	m_mainFunc->getArgumentList().front().setName("rt");
+	auto frame = &m_mainFunc->getArgumentList().back();
+	frame->setName("frame");
+	m_stencil = true;
+
+	// Code of the single instruction. PUSH data and the pc come from holes.
+	byte code[33] = {static_cast<byte>(_inst)};
+	auto codeEnd = code + 1;
+	if (_inst >= Instruction::PUSH1 && _inst <= Instruction::PUSH32)
+		codeEnd += static_cast<size_t>(_inst) - static_cast<size_t>(Instruction::PUSH1) + 1;
+
+	auto entryBB = llvm::BasicBlock::Create(m_builder.getContext(), "Entry", m_mainFunc);
+	BasicBlock block{0, code, codeEnd, m_mainFunc};
+
+	m_builder.SetInsertPoint(entryBB);
+	RuntimeManager runtimeManager(m_builder, frame);
+	GasMeter gasMeter(m_builder, runtimeManager, m_schedule);
+	Memory memory(runtimeManager, gasMeter);
+	Ext ext(runtimeManager, memory);
+	Arith256 arith(m_builder);
+	m_builder.CreateBr(block.llvm());
+
+	compileBasicBlock(block, runtimeManager, arith, memory, ext, gasMeter);
+
+	if (!m_builder.GetInsertBlock()->getTerminator())
+	{
+		if (m_stencilJumpCond)
+		{
+			// New blocks go before the exit block, it must stay the last one
+			auto jumpBB = llvm::BasicBlock::Create(m_builder.getContext(), "JumpI", m_mainFunc, &m_mainFunc->back());
+			auto nextBB = llvm::BasicBlock::Create(m_builder.getContext(), "Next", m_mainFunc, &m_mainFunc->back());
+			m_builder.CreateCondBr(m_stencilJumpCond, jumpBB, nextBB);
+			m_builder.SetInsertPoint(nextBB);
+			createStencilTailCall(getStencilHole(StencilHole::next));
+			m_builder.SetInsertPoint(jumpBB);
+		}
+
+		if (m_stencilJumpDest)
+			compileStencilJump(runtimeManager, m_stencilJumpDest);
+		else
+			createStencilTailCall(getStencilHole(StencilHole::next));
+	}
+	return module;
+}
+
+std::unique_ptr<llvm::Module> Compiler::compileStencilEntry(std::string const& _id)
+{
+	auto module = llvm::make_unique<llvm::Module>(_id, m_builder.getContext());
+	auto mainFuncType = llvm::FunctionType::get(Type::MainReturn, Type::RuntimePtr, false);
+	m_mainFunc = llvm::Function::Create(mainFuncType, llvm::Function::ExternalLinkage, _id, module.get());
+	auto rtPtr = &m_mainFunc->getArgumentList().front();
+	rtPtr->setName("rt");
+
+	auto entryBB = llvm::BasicBlock::Create(m_builder.getContext(), "Entry", m_mainFunc);
+	auto runBB = llvm::BasicBlock::Create(m_builder.getContext(), "Run", m_mainFunc);
+	auto abortBB = llvm::BasicBlock::Create(m_builder.getContext(), "Abort", m_mainFunc);
+
+	m_builder.SetInsertPoint(entryBB);
+	RuntimeManager runtimeManager(m_builder, nullptr, nullptr);
+
+	// Stencils use the stack, gas counter and jump buffer of this function through the frame
+	auto frameType = RuntimeManager::getStencilFrameType();
+	auto frame = m_builder.CreateAlloca(frameType, nullptr, "frame");
+	m_builder.CreateStore(runtimeManager.getStackBase(), m_builder.CreateStructGEP(frameType, frame, 0));
+	m_builder.CreateStore(runtimeManager.getStackSize(), m_builder.CreateStructGEP(frameType, frame, 1));
+	m_builder.CreateStore(runtimeManager.getGasPtr(), m_builder.CreateStructGEP(frameType, frame, 2));
+	auto normalFlow = setupJmpBuf(runtimeManager);
+	m_builder.CreateStore(runtimeManager.getJmpBuf(), m_builder.CreateStructGEP(frameType, frame, 3));
+	m_builder.CreateCondBr(normalFlow, runBB, abortBB, Type::expectTrue);
+
+	m_builder.SetInsertPoint(runBB);
+	auto first = m_builder.CreateIntToPtr(getStencilHole(StencilHole::next), getStencilFuncType()->getPointerTo());
+	auto returnCode = m_builder.CreateCall(first, {rtPtr, frame}, "ret");
+	runtimeManager.exit(returnCode);
+
+	m_builder.SetInsertPoint(abortBB);
+	runtimeManager.exit(ReturnCode::OutOfGas);
+	return module;
+}
+
+llvm::Value* Compiler::getStencilHole(StencilHole _hole)
+{
+	// Weak undefined symbols: the addresses are not assumed to be non-null or aligned
+	// and are loaded as 64-bit immediates with the large code model
+	auto module = m_mainFunc->getParent();
+	auto name = getStencilHoleSymbol(_hole);
+	auto symbol = module->getNamedGlobal(name);
+	if (!symbol)
+	{
+		symbol = new llvm::GlobalVariable(*module, Type::Byte, true, llvm::GlobalValue::ExternalWeakLinkage, nullptr, name);
+		symbol->setAlignment(1);
+	}
+	return m_builder.CreatePtrToInt(symbol, Type::Size, name);
+}
+
+void Compiler::createStencilTailCall(llvm::Value* _target)
+{
+	// Stencils run in the stack frame of the entry stencil, the caller frame is released
+	auto target = m_builder.CreateIntToPtr(_target, getStencilFuncType()->getPointerTo());
+	llvm::Value* args[] = {&m_mainFunc->getArgumentList().front(), &m_mainFunc->getArgumentList().back()};
+	auto call = m_builder.CreateCall(target, args);
+	call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+	m_builder.CreateRet(call);
+}
+
+void Compiler::compileStencilJump(RuntimeManager& _runtimeManager, llvm::Value* _dest)
+{
+	auto& ctx = m_builder.getContext();
+	auto exitBB = &m_mainFunc->back();
+	auto checkBB = llvm::BasicBlock::Create(ctx, "Jump.check", m_mainFunc, exitBB);
+	auto jumpBB = llvm::BasicBlock::Create(ctx, "Jump", m_mainFunc, exitBB);
+	auto badJumpBB = llvm::BasicBlock::Create(ctx, "BadJump", m_mainFunc, exitBB);
+	auto cancelBB = llvm::BasicBlock::Create(ctx, "Cancelled", m_mainFunc, exitBB);
+
+	// Loops in stencil code are made of jumps only, every jump is a possible back-edge
+	m_builder.CreateCondBr(_runtimeManager.isCancelled(), cancelBB, checkBB, Type::expectFalse);
+	m_builder.SetInsertPoint(cancelBB);
+	_runtimeManager.exit(ReturnCode::Cancelled);
+
+	m_builder.SetInsertPoint(checkBB);
+	auto tableSize = m_builder.CreateZExt(getStencilHole(StencilHole::jumpTableSize), Type::Word);
+	auto inRange = m_builder.CreateICmpULT(_dest, tableSize, "jump.inRange");
+	auto idx = m_builder.CreateSelect(inRange, m_builder.CreateTrunc(_dest, Type::Size), m_builder.getInt64(0), "jump.idx");
+	auto table = m_builder.CreateIntToPtr(getStencilHole(StencilHole::jumpTable), m_builder.getInt32Ty()->getPointerTo());
+	auto offset = m_builder.CreateLoad(m_builder.CreateGEP(table, idx), "jump.offset");
+	auto valid = m_builder.CreateAnd(inRange, m_builder.CreateICmpNE(offset, m_builder.getInt32(0)), "jump.valid");
+	m_builder.CreateCondBr(valid, jumpBB, badJumpBB, Type::expectTrue);
+
+	m_builder.SetInsertPoint(badJumpBB);
+	_runtimeManager.exit(ReturnCode::OutOfGas);	// As the jump table default of compiled code
+
+	m_builder.SetInsertPoint(jumpBB);
+	auto target = m_builder.CreateAdd(getStencilHole(StencilHole::codeBase), m_builder.CreateZExt(offset, Type::Size), "jump.target");
+	createStencilTailCall(target);
+}
+
+void Compiler::setCodeLocation(llvm::BasicBlock* _bb, llvm::Instruction* _mark, uint64_t _pc, uint64_t _blockPc)
+{
+	// Line is pc + 1 as line 0 means no location. Column is the offset in the block + 1.
+	auto offset = _pc - _blockPc + 1;
+	auto loc = llvm::DebugLoc::get(static_cast<unsigned>(_pc + 1), offset < (1u << 16) ? static_cast<unsigned>(offset) : 0, m_debugScope);
+	auto endBB = m_builder.GetInsertBlock()->getNextNode();	// blocks of an instruction are inserted in order
+	for (auto bb = _bb; bb != endBB; bb = bb->getNextNode())
+	{
+		auto it = (bb == _bb && _mark) ? std::next(llvm::BasicBlock::iterator{_mark}) : bb->begin();
+		for (; it != bb->end(); ++it)
+			if (!it->getDebugLoc())
+				it->setDebugLoc(loc);
+	}
+}
+
 
 void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runtimeManager,
 								 Arith256& _arith, Memory& _memory, Ext& _ext, GasMeter& _gasMeter)
 {
 	m_builder.SetInsertPoint(_basicBlock.llvm());
-	LocalStack stack{m_builder, _runtimeManager};
+
+	auto memoryLoop = m_memoryLoops.find(_basicBlock.firstInstrIdx());
+	if (memoryLoop != m_memoryLoops.end())
+		compileMemoryLoop(memoryLoop->second, _runtimeManager, _memory, _gasMeter);
+
+	// Created after the trace call: stack.prepare already applies the stack size change of the segment
+	std::unique_ptr<LocalStack> localStack;
 
 	for (auto it = _basicBlock.begin(); it != _basicBlock.end(); ++it)
 	{
 		auto inst = Instruction(*it);
 
+		if (isTraced(inst, it == _basicBlock.begin()))
+		{
+			if (localStack)
+			{
+				// Flush the local stack and gas so the tracer sees the exact state
+				_gasMeter.commitCostBlock();
+				localStack->finalize();
+				localStack.reset();
+			}
+			_runtimeManager.trace(it - _basicBlock.begin() + _basicBlock.firstInstrIdx(), inst);
+		}
+
+		if (!localStack)
+			localStack.reset(new LocalStack{m_builder, _runtimeManager});
+		auto& stack = *localStack;
+
+		auto pc = static_cast<uint64_t>(it - _basicBlock.begin()) + _basicBlock.firstInstrIdx();
+		auto currBB = m_builder.GetInsertBlock();
+		auto mark = (m_debugScope && !currBB->empty()) ? &currBB->back() : nullptr;
+
 		_gasMeter.count(inst);
 
 		switch (inst)
@@ -515,7 +911,20 @@ void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runti
 		case Instruction::ANY_PUSH:
 		{
 			auto value = readPushData(it, _basicBlock.end());
-			stack.push(Constant::get(value));
+			if (m_stencil)
+			{
+				// PUSH data is patched into copies of the stencil
+				llvm::Value* word = Constant::get(0);
+				StencilHole const parts[] = {StencilHole::imm0, StencilHole::imm1, StencilHole::imm2, StencilHole::imm3};
+				for (int64_t i = 0; i < 4; ++i)
+				{
+					auto part = m_builder.CreateZExt(getStencilHole(parts[i]), Type::Word);
+					word = m_builder.CreateOr(word, m_builder.CreateShl(part, Constant::get(64 * i)));
+				}
+				stack.push(word);
+			}
+			else
+				stack.push(Constant::get(value));
 			break;
 		}
 
@@ -584,6 +993,15 @@ void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runti
 		case Instruction::JUMP:
 		case Instruction::JUMPI:
 		{
+			if (m_stencil)
+			{
+				// Jumps are compiled after the instruction, see compileStencil()
+				m_stencilJumpDest = stack.pop();
+				if (inst == Instruction::JUMPI)
+					m_stencilJumpCond = m_builder.CreateICmpNE(stack.pop(), Constant::get(0), "jump.check");
+				break;
+			}
+
 			auto destIdx = llvm::MDNode::get(m_builder.getContext(), llvm::ValueAsMetadata::get(stack.pop()));
 
 			// Create branch instruction, initially to jump table.
@@ -601,6 +1019,9 @@ void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runti
 		{
 			// Add the basic block to the jump table.
 			assert(it == _basicBlock.begin() && "JUMPDEST must be the first instruction of a basic block");
+			if (m_stencil)
+				break;	// Copies of the stencil are added to the jump table of the code
+
 			auto jumpTable = llvm::cast<llvm::SwitchInst>(m_jumpTableBB->getTerminator());
 			jumpTable->addCase(Constant::get(_basicBlock.firstInstrIdx()), _basicBlock.llvm());
 			break;
@@ -608,6 +1029,11 @@ void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runti
 
 		case Instruction::PC:
 		{
+			if (m_stencil)
+			{
+				stack.push(m_builder.CreateZExt(getStencilHole(StencilHole::pc), Type::Word));
+				break;
+			}
 			auto value = Constant::get(it - _basicBlock.begin() + _basicBlock.firstInstrIdx());
 			stack.push(value);
 			break;
@@ -773,6 +1199,15 @@ void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runti
 
 			auto ret = _ext.call(callGas, senderAddress, receiveAddress, codeAddress, valueTransfer, apparentValue, inOff, inSize, outOff, outSize);
 			_gasMeter.count(m_builder.getInt64(0), _runtimeManager.getJmpBuf(), _runtimeManager.getGasPtr());
+
+			// A cancelled callee fails the call. End the caller too, it shares the cancel flag.
+			auto callBB = m_builder.GetInsertBlock();
+			auto retBB = llvm::BasicBlock::Create(m_builder.getContext(), callBB->getName() + ".callret", m_mainFunc, callBB->getNextNode());
+			auto cancelBB = llvm::BasicBlock::Create(m_builder.getContext(), callBB->getName() + ".cancelled", m_mainFunc, retBB);
+			m_builder.CreateCondBr(_runtimeManager.isCancelled(), cancelBB, retBB, Type::expectFalse);
+			m_builder.SetInsertPoint(cancelBB);
+			_runtimeManager.exit(ReturnCode::Cancelled);
+			m_builder.SetInsertPoint(retBB);
 			stack.push(ret);
 			break;
 		}
@@ -828,11 +1263,31 @@ void Compiler::compileBasicBlock(BasicBlock& _basicBlock, RuntimeManager& _runti
 			_runtimeManager.exit(ReturnCode::OutOfGas);
 			it = _basicBlock.end() - 1; // finish block compilation
 		}
+
+		if (m_debugScope)
+			setCodeLocation(currBB, mark, pc, _basicBlock.firstInstrIdx());
 	}
 
 	_gasMeter.commitCostBlock();
 
-	stack.finalize();
+	if (!localStack)	// Empty block
+		localStack.reset(new LocalStack{m_builder, _runtimeManager});
+	localStack->finalize();
+}
+
+bool Compiler::isTraced(Instruction _inst, bool _isBlockBegin) const
+{
+	switch (m_options.trace)
+	{
+	case TraceLevel::Instruction:
+		return true;
+	case TraceLevel::Block:
+		return _isBlockBegin;
+	case TraceLevel::Call:
+		return _inst == Instruction::CALL || _inst == Instruction::CALLCODE || _inst == Instruction::DELEGATECALL || _inst == Instruction::CREATE;
+	default:
+		return false;
+	}
 }
 
 
@@ -1,13 +1,13 @@
 #pragma once
 
+#include "evmjit/JIT.h"
 #include "BasicBlock.h"
+#include "Instruction.h"
+#include "MemoryLoop.h"
+#include "StencilCompiler.h"
 
 namespace dev
 {
-namespace evmjit
-{
-struct JITSchedule;
-}
 namespace eth
 {
 namespace jit
@@ -24,12 +24,51 @@ public:
 
 		/// Dump CFG as a .dot file for graphviz
 		bool dumpCFG = false;
+
+		/// Emit calls to the execution tracer with given granularity
+		TraceLevel trace = TraceLevel::None;
+
+		/// Emit line tables mapping native code to EVM code locations
+		bool emitPCMap = false;
+
+		/// Maximum number of basic blocks. 0 means no limit.
+		size_t maxBlocks = 0;
+
+		/// Maximum number of IR instructions. 0 means no limit.
+		size_t maxIRSize = 0;
+
+		/// Maximum time of IR construction [ms]. 0 means no limit.
+		unsigned maxCompileTime = 0;
+
+		/// Replace memory copy and zero-fill loops with bulk operations
+		bool optimizeMemoryLoops = true;
+	};
+
+	/// Compilation limit that caused the compilation to be rejected
+	enum class Limit
+	{
+		None,
+		Blocks,
+		IRSize,
+		CompileTime
 	};
 
 	Compiler(Options const& _options, JITSchedule const& _schedule);
 
+	/// Compiles EVM code to LLVM IR module.
+	/// @returns null if the code exceeds compilation limits, see exceededLimit()
 	std::unique_ptr<llvm::Module> compile(code_iterator _begin, code_iterator _end, std::string const& _id);
 
+	Limit exceededLimit() const { return m_exceededLimit; }
+
+	/// Compiles the stencil of a single instruction for StencilCompiler. The stencil function
+	/// takes the Runtime and the StencilFrame of the entry stencil and continues with a tail call
+	/// of the next stencil or of the jump destination, see StencilHole.
+	std::unique_ptr<llvm::Module> compileStencil(Instruction _inst, std::string const& _id);
+
+	/// Compiles the entry stencil: allocates the EVM stack, sets up the abort target and calls the first stencil
+	std::unique_ptr<llvm::Module> compileStencilEntry(std::string const& _id);
+
 private:
 
 	std::vector<BasicBlock> createBasicBlocks(code_iterator _begin, code_iterator _end);
@@ -38,6 +77,33 @@ private:
 
 	void resolveJumps();
 
+	/// Executes all iterations of a memory loop at once at the loop head.
+	/// The loop is still compiled and handles the cases not covered here.
+	void compileMemoryLoop(MemoryLoop const& _loop, class RuntimeManager& _runtimeManager, class Memory& _memory, class GasMeter& _gasMeter);
+
+	/// Inserts checks of the cancellation flag at loop back-edges
+	void insertCancellationChecks(class RuntimeManager& _runtimeManager);
+
+	/// Checks if the tracer is called before the instruction
+	bool isTraced(Instruction _inst, bool _isBlockBegin) const;
+
+	/// Attaches EVM code location to instructions emitted after _mark in _bb (from its beginning if null)
+	/// and in the following blocks up to the current block
+	void setCodeLocation(llvm::BasicBlock* _bb, llvm::Instruction* _mark, uint64_t _pc, uint64_t _blockPc);
+
+	/// Sets up the jump buffer of aborts in the entry of main function.
+	/// @returns true in normal flow, false after an abort
+	llvm::Value* setupJmpBuf(class RuntimeManager& _runtimeManager);
+
+	/// Value of the stencil hole, see StencilHole
+	llvm::Value* getStencilHole(StencilHole _hole);
+
+	/// Ends the stencil with a tail call of the stencil at given address
+	void createStencilTailCall(llvm::Value* _target);
+
+	/// Ends the stencil with a tail call of the copy of the JUMPDEST stencil at _dest
+	void compileStencilJump(class RuntimeManager& _runtimeManager, llvm::Value* _dest);
+
 	/// Compiler options
 	Options const& m_options;
 
@@ -51,6 +117,21 @@ private:
 
 	/// Main program function
 	llvm::Function* m_mainFunc = nullptr;
+
+	Limit m_exceededLimit = Limit::None;
+
+	/// Memory loops indexed by the first instruction of the loop head
+	std::unordered_map<instr_idx, MemoryLoop> m_memoryLoops;
+
+	/// Debug info scope of main function. Set only if PC map is emitted.
+	llvm::MDNode* m_debugScope = nullptr;
+
+	/// Compiling a stencil, see compileStencil()
+	bool m_stencil = false;
+
+	/// Destination and condition of JUMP or JUMPI of a stencil, the jump is compiled after the stack update
+	llvm::Value* m_stencilJumpDest = nullptr;
+	llvm::Value* m_stencilJumpCond = nullptr;
 };
 
 }
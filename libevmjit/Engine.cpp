@@ -0,0 +1,322 @@
+#include "Engine.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/LambdaResolver.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/IR/Mangler.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include "preprocessor/llvm_includes_end.h"
+
+#include "PCMap.h"
+#include "Utils.h"
+
+namespace dev
+{
+namespace evmjit
+{
+using namespace eth::jit;
+
+namespace
+{
+
+llvm::Triple getTargetTriple()
+{
+	// FIXME: LLVM 3.7: test on Windows
+	auto triple = llvm::Triple(llvm::sys::getProcessTriple());
+	if (triple.getOS() == llvm::Triple::OSType::Win32)
+		triple.setObjectFormat(llvm::Triple::ObjectFormatType::ELF);  // MCJIT does not support COFF format
+	return triple;
+}
+
+/// Features of the host CPU in a stable order
+std::vector<std::string> getHostCPUAttrs()
+{
+	std::vector<std::string> attrs;
+	llvm::StringMap<bool> features;
+	if (llvm::sys::getHostCPUFeatures(features))
+	{
+		for (auto& feature : features)
+			attrs.push_back((feature.second ? "+" : "-") + feature.first().str());
+		std::sort(attrs.begin(), attrs.end());	// StringMap iteration order is unspecified
+	}
+	return attrs;
+}
+
+void configure(llvm::EngineBuilder& _builder, Engine::Options const& _options)
+{
+	_builder.setOptLevel(_options.optimize ? llvm::CodeGenOpt::Default : llvm::CodeGenOpt::None);
+	if (_options.stencils)
+	{
+		_builder.setRelocationModel(llvm::Reloc::Static);
+		_builder.setCodeModel(llvm::CodeModel::Large);
+	}
+	else if (_options.pic)
+	{
+		_builder.setRelocationModel(llvm::Reloc::PIC_);
+		_builder.setCodeModel(llvm::CodeModel::Small);
+	}
+	if (_options.hostCPU)
+	{
+		// Allows 256-bit vector moves of stack items and memory words
+		_builder.setMCPU(llvm::sys::getHostCPUName());
+		auto attrs = getHostCPUAttrs();
+		if (!attrs.empty())
+			_builder.setMAttrs(attrs);
+	}
+}
+
+llvm::TargetMachine* createTargetMachine(llvm::Triple const& _triple, Engine::Options const& _options)
+{
+	auto module = llvm::make_unique<llvm::Module>(llvm::StringRef{}, llvm::getGlobalContext());
+	module->setTargetTriple(_triple.str());
+	llvm::EngineBuilder builder(std::move(module));	// the module only provides the triple
+	configure(builder, _options);
+	return builder.selectTarget();
+}
+
+class SymbolResolver : public llvm::SectionMemoryManager
+{
+public:
+	explicit SymbolResolver(bool _keccakCache): m_keccakCache(_keccakCache) {}
+
+	llvm::RuntimeDyld::SymbolInfo findSymbol(std::string const& _name) override
+	{
+		if (_name == "env_sha3")
+			return {getHostSymbolAddress(_name, m_keccakCache), llvm::JITSymbolFlags::Exported};
+		return llvm::SectionMemoryManager::findSymbol(_name);
+	}
+
+private:
+	bool m_keccakCache;
+};
+
+
+class MCJITEngine : public Engine
+{
+public:
+	explicit MCJITEngine(Options const& _options)
+	{
+		auto module = llvm::make_unique<llvm::Module>(llvm::StringRef{}, llvm::getGlobalContext());
+		module->setTargetTriple(getTargetTriple().str());
+
+		llvm::EngineBuilder builder(std::move(module));
+		builder.setEngineKind(llvm::EngineKind::JIT);
+		builder.setMCJITMemoryManager(llvm::make_unique<SymbolResolver>(_options.keccakCache));
+		configure(builder, _options);
+		m_engine.reset(builder.create());
+
+		// TODO: Update cache listener
+		m_engine->setObjectCache(_options.objectCache);
+
+		if (_options.pcMap)
+			m_engine->RegisterJITEventListener(&PCMap::instance());
+	}
+
+	uint64_t addModule(std::unique_ptr<llvm::Module> _module, std::string const& _funcName) override
+	{
+		std::lock_guard<std::mutex> lock{x_engine};
+		auto module = _module.get();
+		m_engine->addModule(std::move(_module));
+		auto addr = m_engine->getFunctionAddress(_funcName);
+
+		// The machine code stays loaded and its symbols stay visible to the engine,
+		// the IR is not needed anymore
+		if (m_engine->removeModule(module))
+			delete module;
+		return addr;
+	}
+
+	bool removeModule(std::string const&) override
+	{
+		return false;	// MCJIT does not free machine code of removed modules
+	}
+
+private:
+	std::mutex x_engine;
+	std::unique_ptr<llvm::ExecutionEngine> m_engine;
+};
+
+
+/// Registers loaded objects in PCMap
+struct PCMapNotifier
+{
+	explicit PCMapNotifier(bool _enabled = false): enabled(_enabled) {}
+
+	bool enabled;
+
+	template<typename _HandleT, typename _ObjSetT, typename _InfoListT>
+	void operator()(_HandleT, _ObjSetT const& _objects, _InfoListT const& _infos) const
+	{
+		if (!enabled)
+			return;
+		for (size_t i = 0; i < _objects.size(); ++i)
+			PCMap::instance().NotifyObjectEmitted(*_objects[i], *_infos[i]);
+	}
+};
+
+class OrcEngine : public Engine
+{
+	using ObjectLayer = llvm::orc::ObjectLinkingLayer<PCMapNotifier>;
+	using CompileLayer = llvm::orc::IRCompileLayer<ObjectLayer>;
+	using ModuleHandle = CompileLayer::ModuleSetHandleT;
+
+public:
+	explicit OrcEngine(Options const& _options):
+		m_triple(getTargetTriple()),
+		m_targetMachine(createTargetMachine(m_triple, _options)),
+		m_dataLayout(*m_targetMachine->getDataLayout()),
+		m_objectLayer(PCMapNotifier{_options.pcMap}),
+		m_compileLayer(m_objectLayer, llvm::orc::SimpleCompiler(*m_targetMachine)),
+		m_keccakCache(_options.keccakCache)
+	{
+		llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);	// Allows resolving ext_* and env_* symbols in the process
+		m_compileLayer.setObjectCache(_options.objectCache);
+	}
+
+	uint64_t addModule(std::unique_ptr<llvm::Module> _module, std::string const& _funcName) override
+	{
+		_module->setTargetTriple(m_triple.str());
+		_module->setDataLayout(m_dataLayout);
+		auto id = _module->getModuleIdentifier();
+
+		// Compiled modules are self-contained, all external symbols come from the host
+		auto keccakCache = m_keccakCache;
+		auto resolver = llvm::orc::createLambdaResolver(
+			[](std::string const&) { return llvm::RuntimeDyld::SymbolInfo{nullptr}; },
+			[keccakCache](std::string const& _name) -> llvm::RuntimeDyld::SymbolInfo
+			{
+				if (auto addr = getHostSymbolAddress(_name, keccakCache))
+					return {addr, llvm::JITSymbolFlags::Exported};
+				return nullptr;
+			});
+
+		// The compile layer releases the IR modules after emitting objects
+		std::vector<std::unique_ptr<llvm::Module>> modules;
+		modules.push_back(std::move(_module));
+
+		std::lock_guard<std::mutex> lock{x_layers};	// ORC layers are not thread-safe
+		auto handle = m_compileLayer.addModuleSet(std::move(modules), llvm::make_unique<llvm::SectionMemoryManager>(), std::move(resolver));
+		auto symbol = m_compileLayer.findSymbolIn(handle, mangle(_funcName), false);
+		auto addr = symbol ? symbol.getAddress() : 0;
+		if (!addr)
+		{
+			m_compileLayer.removeModuleSet(handle);
+			return 0;
+		}
+
+		// A copy compiled concurrently is already in use, the new one is freed
+		auto it = m_modules.find(id);
+		if (it != m_modules.end())
+		{
+			PCMap::instance().remove(addr);
+			m_compileLayer.removeModuleSet(handle);
+			return it->second.funcAddr;
+		}
+		m_modules.emplace(id, LoadedModule{handle, addr});
+		return addr;
+	}
+
+	bool removeModule(std::string const& _moduleIdentifier) override
+	{
+		std::lock_guard<std::mutex> lock{x_layers};
+		auto it = m_modules.find(_moduleIdentifier);
+		if (it == m_modules.end())
+			return false;
+		PCMap::instance().remove(it->second.funcAddr);
+		m_compileLayer.removeModuleSet(it->second.handle);
+		m_modules.erase(it);
+		return true;
+	}
+
+private:
+	std::string mangle(std::string const& _name) const
+	{
+		std::string mangledName;
+		llvm::raw_string_ostream stream{mangledName};
+		llvm::Mangler::getNameWithPrefix(stream, _name, m_dataLayout);
+		return stream.str();
+	}
+
+	llvm::Triple m_triple;
+	std::unique_ptr<llvm::TargetMachine> m_targetMachine;
+	llvm::DataLayout m_dataLayout;
+	ObjectLayer m_objectLayer;
+	CompileLayer m_compileLayer;
+	bool m_keccakCache;
+
+	struct LoadedModule
+	{
+		ModuleHandle handle;
+		uint64_t funcAddr;
+	};
+
+	std::mutex x_layers;
+	std::unordered_map<std::string, LoadedModule> m_modules;
+};
+
+}
+
+uint64_t getHostSymbolAddress(std::string const& _name, bool _keccakCache)
+{
+	if (_name == "env_sha3")
+	{
+		auto func = _keccakCache ? &keccakCached : &keccak;
+		return reinterpret_cast<uint64_t>(func);
+	}
+	return llvm::RTDyldMemoryManager::getSymbolAddressInProcess(_name);
+}
+
+std::string getTargetId(Engine::Options const& _options)
+{
+	auto id = getTargetTriple().str();
+	if (_options.pic)
+		id += " pic";
+	if (_options.hostCPU)
+	{
+		id += " " + llvm::sys::getHostCPUName().str();
+		for (auto& attr : getHostCPUAttrs())
+			id += " " + attr;
+	}
+	return id;
+}
+
+ObjectEmitter::ObjectEmitter(Engine::Options const& _options):
+	m_targetMachine(createTargetMachine(getTargetTriple(), _options))
+{}
+
+ObjectEmitter::~ObjectEmitter() = default;
+
+std::string ObjectEmitter::emit(llvm::Module& _module)
+{
+	_module.setTargetTriple(m_targetMachine->getTargetTriple().str());
+	_module.setDataLayout(*m_targetMachine->getDataLayout());
+	auto object = llvm::orc::SimpleCompiler{*m_targetMachine}(_module);
+	if (!object.getBinary())
+		return {};
+	return object.getBinary()->getData().str();
+}
+
+std::unique_ptr<Engine> Engine::create(EngineKind _kind, Options const& _options)
+{
+	if (_kind == EngineKind::orc)
+		return std::unique_ptr<Engine>{new OrcEngine{_options}};
+	return std::unique_ptr<Engine>{new MCJITEngine{_options}};
+}
+
+}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+namespace llvm
+{
+	class Module;
+	class ObjectCache;
+	class TargetMachine;
+}
+
+namespace dev
+{
+namespace evmjit
+{
+
+enum class EngineKind
+{
+	mcjit,	///< Single MCJIT execution engine. Machine code is kept for the engine lifetime.
+	orc		///< ORC layers. Machine code of a module can be removed, see JIT::evictCode(). Compilation is serialized as with mcjit.
+};
+
+/// Backend generating machine code of compiled modules and linking it into the process
+class Engine
+{
+public:
+	struct Options
+	{
+		/// Use the default code generation optimization level, otherwise none
+		bool optimize = false;
+
+		/// Generate code for the host CPU features
+		bool hostCPU = true;
+
+		/// Link env_sha3 to the memoizing Keccak implementation
+		bool keccakCache = false;
+
+		/// Register emitted objects in PCMap
+		bool pcMap = false;
+
+		/// Generate position independent code with small code model, required by cache images
+		bool pic = false;
+
+		/// Generate code for instruction stencils: static relocation model and large code model,
+		/// so every reference to a symbol is a 64-bit absolute address that can be patched in copies
+		bool stencils = false;
+
+		llvm::ObjectCache* objectCache = nullptr;
+	};
+
+	static std::unique_ptr<Engine> create(EngineKind _kind, Options const& _options);
+
+	virtual ~Engine() = default;
+
+	/// Generates and links machine code of the module. Safe to call from multiple threads,
+	/// but code generation and linking are serialized by each backend.
+	/// The IR module is released when its machine code is emitted.
+	/// A module with the identifier of a loaded module is dropped and the loaded function is returned.
+	/// @returns the address of the function of given name, 0 if not found
+	virtual uint64_t addModule(std::unique_ptr<llvm::Module> _module, std::string const& _funcName) = 0;
+
+	/// Frees machine code of the module with given identifier.
+	/// Functions of the module must not be executing.
+	/// @returns false if the module is unknown or the backend cannot remove code
+	virtual bool removeModule(std::string const& _moduleIdentifier) = 0;
+};
+
+/// Address of the host implementation of a symbol used by compiled code
+uint64_t getHostSymbolAddress(std::string const& _name, bool _keccakCache);
+
+/// Identifier of the code generation target: the triple, position independence and
+/// with Options::hostCPU the host CPU name and features.
+/// Machine code compiled for one target may not run on another.
+std::string getTargetId(Engine::Options const& _options);
+
+/// Generates relocatable objects of modules without loading them, e.g. for other processes.
+/// The objects are compatible with engines created with the same options.
+class ObjectEmitter
+{
+public:
+	explicit ObjectEmitter(Engine::Options const& _options);
+	~ObjectEmitter();
+
+	/// @returns the content of the object file, empty on failure
+	std::string emit(llvm::Module& _module);
+
+private:
+	std::unique_ptr<llvm::TargetMachine> m_targetMachine;
+};
+
+}
+}
@@ -75,6 +75,30 @@ char const* getExecStateName(ExecState _state)
 }
 }
 
+void CompileLimitStats::output(std::ostream& _os) const
+{
+	_os << "Compilation limits:\n"
+		<< "  rejected (blocks)   " << rejectedBlocks << "\n"
+		<< "  rejected (IR size)  " << rejectedIRSize << "\n"
+		<< "  rejected (time)     " << rejectedCompileTime << "\n";
+}
+
+void CompileSchedulerStats::output(std::ostream& _os) const
+{
+	static const char* const c_names[numPriorities] = {"blocking", "tier-up ", "prefetch"};
+	_os << "Compile scheduler:            jobs  avg wait [us]  max wait [us]\n";
+	for (size_t i = 0; i < numPriorities; ++i)
+	{
+		auto n = jobs[i].load();
+		_os << "  " << c_names[i] << "   " << std::setw(16) << n
+			<< std::setw(15) << (n ? waitTime[i] / n : 0)
+			<< std::setw(15) << maxWaitTime[i] << "\n";
+	}
+	_os << "  coalesced           " << coalesced << "\n"
+		<< "  cancelled           " << cancelled << "\n"
+		<< "  max queue depth     " << maxQueueDepth << "\n";
+}
+
 StatsCollector::~StatsCollector()
 {
 	if (stats.empty())
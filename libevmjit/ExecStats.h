@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <string>
@@ -56,6 +57,32 @@ private:
 };
 
 
+/// Counters of compilations affected by compilation limits
+struct CompileLimitStats
+{
+	std::atomic<uint64_t> rejectedBlocks{0};	///< Rejected because of number of basic blocks
+	std::atomic<uint64_t> rejectedIRSize{0};	///< Rejected because of IR size
+	std::atomic<uint64_t> rejectedCompileTime{0};	///< Rejected because of IR construction time
+
+	void output(std::ostream& _os) const;
+};
+
+/// Counters of the compile scheduler, indexed by CompilePriority. Times in microseconds.
+struct CompileSchedulerStats
+{
+	static const size_t numPriorities = 3;
+
+	std::atomic<uint64_t> jobs[numPriorities] = {};			///< Jobs run
+	std::atomic<uint64_t> waitTime[numPriorities] = {};		///< Total time from request to start of jobs
+	std::atomic<uint64_t> maxWaitTime[numPriorities] = {};
+	std::atomic<uint64_t> coalesced{0};		///< Requests merged into a queued or running job
+	std::atomic<uint64_t> cancelled{0};		///< Queued jobs cancelled explicitly or by deadline
+	std::atomic<uint64_t> maxQueueDepth{0};
+
+	void output(std::ostream& _os) const;
+};
+
+
 class StatsCollector
 {
 public:
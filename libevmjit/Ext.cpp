@@ -46,6 +46,8 @@ std::array<FuncDesc, sizeOf<EnvFunc>::value> const& getEnvFuncDescs()
 		FuncDesc{"env_log", getFunctionType(Type::Void, {Type::EnvPtr, Type::BytePtr, Type::Size, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr})},
 		FuncDesc{"env_blockhash", getFunctionType(Type::Void, {Type::EnvPtr, Type::WordPtr, Type::WordPtr})},
 		FuncDesc{"env_extcode", getFunctionType(Type::BytePtr, {Type::EnvPtr, Type::WordPtr, Type::Size->getPointerTo()})},
+		FuncDesc{"ext_log", getFunctionType(Type::Void, {Type::BytePtr, Type::BytePtr, Type::Size, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr})},
+		FuncDesc{"ext_call", getFunctionType(Type::MainReturn, {Type::RuntimePtr, Type::GasPtr, Type::Gas, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::BytePtr, Type::Size, Type::BytePtr, Type::Size})},
 	}};
 
 	return descs;
@@ -80,12 +82,17 @@ llvm::Value* Ext::byPtr(llvm::Value* _value)
 	return a;
 }
 
-llvm::CallInst* Ext::createCall(EnvFunc _funcId, std::initializer_list<llvm::Value*> const& _args)
+llvm::Function* Ext::getFunc(EnvFunc _funcId)
 {
 	auto& func = m_funcs[static_cast<size_t>(_funcId)];
 	if (!func)
 		func = createFunc(_funcId, getModule());
+	return func;
+}
 
+llvm::CallInst* Ext::createCall(EnvFunc _funcId, std::initializer_list<llvm::Value*> const& _args)
+{
+	auto func = getFunc(_funcId);
 	m_argCounter = 0;
 	return m_builder.CreateCall(func, {_args.begin(), _args.size()});
 }
@@ -169,14 +176,16 @@ llvm::Value* Ext::balance(llvm::Value* _address)
 	return createCABICall(func, {getRuntimeManager().getEnvPtr(), address});
 }
 
-llvm::Value* Ext::blockHash(llvm::Value* _number)
+namespace
+{
+llvm::Function* getEnvBlockHashFunc(llvm::Module* _module)
 {
 	static const auto funcName = "env_blockhash";
-	auto func = getModule()->getFunction(funcName);
+	auto func = _module->getFunction(funcName);
 	if (!func)
 	{
 		auto fty = llvm::FunctionType::get(Type::Void, {Type::WordPtr, Type::EnvPtr, Type::WordPtr}, false);
-		func = llvm::Function::Create(fty, llvm::Function::ExternalLinkage, funcName, getModule());
+		func = llvm::Function::Create(fty, llvm::Function::ExternalLinkage, funcName, _module);
 		func->addAttribute(1, llvm::Attribute::StructRet);
 		func->addAttribute(1, llvm::Attribute::NoAlias);
 		func->addAttribute(1, llvm::Attribute::NoCapture);
@@ -185,9 +194,85 @@ llvm::Value* Ext::blockHash(llvm::Value* _number)
 		func->addAttribute(3, llvm::Attribute::NoAlias);
 		func->addAttribute(3, llvm::Attribute::NoCapture);
 	}
+	return func;
+}
+}
+
+llvm::Function* Ext::getBlockHashFunc()
+{
+	auto& func = m_blockHash;
+	if (!func)
+	{
+		llvm::Type* argTypes[] = {Type::EnvPtr, Type::WordPtr, Type::Size, Type::Size, Type::Word};
+		func = llvm::Function::Create(llvm::FunctionType::get(Type::Word, argTypes, false), llvm::Function::PrivateLinkage, "blockhash", getModule());
+		func->setDoesNotThrow();
+		func->setDoesNotCapture(2);
+
+		auto iter = func->arg_begin();
+		llvm::Argument* env = &(*iter++);
+		env->setName("env");
+		llvm::Argument* table = &(*iter++);
+		table->setName("table");
+		llvm::Argument* base = &(*iter++);
+		base->setName("base");
+		llvm::Argument* currNumber = &(*iter++);
+		currNumber->setName("currNumber");
+		llvm::Argument* number = &(*iter);
+		number->setName("number");
+
+		auto entryBB = llvm::BasicBlock::Create(func->getContext(), "Entry", func);
+		auto tableBB = llvm::BasicBlock::Create(func->getContext(), "Table", func);
+		auto loadBB = llvm::BasicBlock::Create(func->getContext(), "Load", func);
+		auto callbackBB = llvm::BasicBlock::Create(func->getContext(), "Callback", func);
+		auto returnBB = llvm::BasicBlock::Create(func->getContext(), "Return", func);
+
+		InsertPointGuard guard{m_builder}; // Restores insert point at function exit
+
+		// BB "Entry": Use the table if provided by the host
+		m_builder.SetInsertPoint(entryBB);
+		auto hashPtr = m_builder.CreateAlloca(Type::Word, nullptr, "hash.ptr");
+		auto numberPtr = m_builder.CreateAlloca(Type::Word, nullptr, "number.ptr");
+		auto hasTable = m_builder.CreateICmpNE(table, llvm::ConstantPointerNull::get(Type::WordPtr), "hasTable");
+		m_builder.CreateCondBr(hasTable, tableBB, callbackBB, Type::expectTrue);
+
+		// BB "Table": Only hashes of blocks in range [base, min(base + 256, currNumber)) are available
+		m_builder.SetInsertPoint(tableBB);
+		auto beforeCurr = m_builder.CreateICmpULT(number, m_builder.CreateZExt(currNumber, Type::Word), "beforeCurr");
+		auto number64 = m_builder.CreateTrunc(number, Type::Size);
+		auto aboveBase = m_builder.CreateICmpUGE(number64, base, "aboveBase");
+		auto idx = m_builder.CreateSub(number64, base, "idx");
+		auto idxOk = m_builder.CreateICmpULT(idx, m_builder.getInt64(RuntimeData::blockHashTableSize), "idxOk");
+		auto inRange = m_builder.CreateAnd(m_builder.CreateAnd(beforeCurr, aboveBase), idxOk, "inRange");
+		m_builder.CreateCondBr(inRange, loadBB, returnBB);
+
+		// BB "Load"
+		m_builder.SetInsertPoint(loadBB);
+		auto entryPtr = m_builder.CreateGEP(table, idx, "entryPtr");
+		auto entry = Endianness::toNative(m_builder, m_builder.CreateAlignedLoad(entryPtr, 8, "entry")); // Alignment of h256
+		m_builder.CreateBr(returnBB);
+
+		// BB "Callback"
+		m_builder.SetInsertPoint(callbackBB);
+		m_builder.CreateStore(number, numberPtr);
+		m_builder.CreateCall(getEnvBlockHashFunc(getModule()), {hashPtr, env, numberPtr});
+		auto hash = Endianness::toNative(m_builder, m_builder.CreateLoad(hashPtr));
+		m_builder.CreateBr(returnBB);
+
+		// BB "Return"
+		m_builder.SetInsertPoint(returnBB);
+		auto ret = m_builder.CreatePHI(Type::Word, 3, "ret");
+		ret->addIncoming(Constant::get(0), tableBB);
+		ret->addIncoming(entry, loadBB);
+		ret->addIncoming(hash, callbackBB);
+		m_builder.CreateRet(ret);
+	}
+	return func;
+}
 
-	auto hash = createCABICall(func, {getRuntimeManager().getEnvPtr(), _number});
-	return Endianness::toNative(m_builder, hash);
+llvm::Value* Ext::blockHash(llvm::Value* _number)
+{
+	auto& rtm = getRuntimeManager();
+	return m_builder.CreateCall(getBlockHashFunc(), {rtm.getEnvPtr(), rtm.get(RuntimeData::BlockHashes), rtm.get(RuntimeData::BlockHashesBase), rtm.get(RuntimeData::Number), _number});
 }
 
 llvm::Value* Ext::create(llvm::Value* _endowment, llvm::Value* _initOff, llvm::Value* _initSize)
@@ -214,10 +299,65 @@ llvm::Value* Ext::call(llvm::Value* _callGas, llvm::Value* _senderAddress, llvm:
 			m_builder.CreateICmpULE(_callGas, m_builder.CreateZExt(Constant::gasMax, Type::Word)),
 			m_builder.CreateTrunc(_callGas, Type::Gas),
 			Constant::gasMax);
-	auto ret = createCall(EnvFunc::call, {getRuntimeManager().getEnvPtr(), getRuntimeManager().getGasPtr(), callGas, byPtr(senderAddress), byPtr(receiveAddress), byPtr(codeAddress), byPtr(_valueTransfer), byPtr(_apparentValue), inBeg, inSize, outBeg, outSize});
+	auto& rtm = getRuntimeManager();
+	llvm::Value* args[] = {rtm.getRuntimePtr(), rtm.getEnvPtr(), rtm.getCallHooksPtr(), rtm.getGasPtr(), callGas, byPtr(senderAddress), byPtr(receiveAddress), byPtr(codeAddress), byPtr(_valueTransfer), byPtr(_apparentValue), inBeg, inSize, outBeg, outSize};
+	m_argCounter = 0;
+	auto ret = m_builder.CreateCall(getCallFunc(), args);
 	return m_builder.CreateZExt(ret, Type::Word, "ret");
 }
 
+llvm::Function* Ext::getCallFunc()
+{
+	auto& func = m_call;
+	if (!func)
+	{
+		llvm::Type* argTypes[] = {Type::RuntimePtr, Type::EnvPtr, Type::BytePtr, Type::GasPtr, Type::Gas, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::BytePtr, Type::Size, Type::BytePtr, Type::Size};
+		func = llvm::Function::Create(llvm::FunctionType::get(Type::Bool, argTypes, false), llvm::Function::PrivateLinkage, "call", getModule());
+
+		auto iter = func->arg_begin();
+		llvm::Argument* rt = &(*iter++);
+		rt->setName("rt");
+		llvm::Argument* env = &(*iter++);
+		env->setName("env");
+		llvm::Argument* hooks = &(*iter++);
+		hooks->setName("hooks");
+		llvm::SmallVector<llvm::Value*, 11> callArgs; // Arguments common for env_call and ext_call
+		for (; iter != func->arg_end(); ++iter)
+			callArgs.push_back(&(*iter));
+
+		auto entryBB = llvm::BasicBlock::Create(func->getContext(), "Entry", func);
+		auto directBB = llvm::BasicBlock::Create(func->getContext(), "Direct", func);
+		auto directRetBB = llvm::BasicBlock::Create(func->getContext(), "DirectRet", func);
+		auto envBB = llvm::BasicBlock::Create(func->getContext(), "Env", func);
+
+		InsertPointGuard guard{m_builder}; // Restores insert point at function exit
+
+		// BB "Entry": Check if the host provided hooks for direct calls
+		m_builder.SetInsertPoint(entryBB);
+		auto isDirect = m_builder.CreateICmpNE(hooks, llvm::ConstantPointerNull::get(Type::BytePtr), "isDirect");
+		m_builder.CreateCondBr(isDirect, directBB, envBB);
+
+		// BB "Direct": Execute the callee without the host round trip
+		m_builder.SetInsertPoint(directBB);
+		callArgs.insert(callArgs.begin(), rt);
+		auto r = m_builder.CreateCall(getFunc(EnvFunc::directCall), callArgs, "r");
+		callArgs.erase(callArgs.begin());
+		auto handled = m_builder.CreateICmpSGE(r, m_builder.getInt32(0), "handled");
+		m_builder.CreateCondBr(handled, directRetBB, envBB, Type::expectTrue);
+
+		// BB "DirectRet"
+		m_builder.SetInsertPoint(directRetBB);
+		m_builder.CreateRet(m_builder.CreateTrunc(r, Type::Bool));
+
+		// BB "Env": Call through the host (also a fallback if the host rejected the direct call)
+		m_builder.SetInsertPoint(envBB);
+		callArgs.insert(callArgs.begin(), env);
+		auto ret = m_builder.CreateCall(getFunc(EnvFunc::call), callArgs, "ret");
+		m_builder.CreateRet(ret);
+	}
+	return func;
+}
+
 llvm::Value* Ext::sha3(llvm::Value* _inOff, llvm::Value* _inSize)
 {
 	auto begin = m_memoryMan.getBytePtr(_inOff);
@@ -238,13 +378,62 @@ MemoryRef Ext::extcode(llvm::Value* _addr)
 	return {code, codeSize256};
 }
 
+llvm::Function* Ext::getLogFunc()
+{
+	auto& func = m_log;
+	if (!func)
+	{
+		llvm::Type* argTypes[] = {Type::EnvPtr, Type::BytePtr, Type::BytePtr, Type::Size, Type::WordPtr, Type::WordPtr, Type::WordPtr, Type::WordPtr};
+		func = llvm::Function::Create(llvm::FunctionType::get(Type::Void, argTypes, false), llvm::Function::PrivateLinkage, "log", getModule());
+		func->setDoesNotThrow();
+
+		auto iter = func->arg_begin();
+		llvm::Argument* env = &(*iter++);
+		env->setName("env");
+		llvm::Argument* logBuffer = &(*iter++);
+		logBuffer->setName("logBuffer");
+		llvm::Argument* data = &(*iter++);
+		data->setName("data");
+		llvm::Argument* size = &(*iter++);
+		size->setName("size");
+		llvm::Value* topics[4];
+		for (auto& topic : topics)
+		{
+			topic = &(*iter++);
+			topic->setName("topic");
+		}
+
+		auto entryBB = llvm::BasicBlock::Create(func->getContext(), "Entry", func);
+		auto bufferBB = llvm::BasicBlock::Create(func->getContext(), "Buffer", func);
+		auto envBB = llvm::BasicBlock::Create(func->getContext(), "Env", func);
+
+		InsertPointGuard guard{m_builder}; // Restores insert point at function exit
+
+		// BB "Entry": Check if buffered logs mode is enabled
+		m_builder.SetInsertPoint(entryBB);
+		auto isBuffered = m_builder.CreateICmpNE(logBuffer, llvm::ConstantPointerNull::get(Type::BytePtr), "isBuffered");
+		m_builder.CreateCondBr(isBuffered, bufferBB, envBB);
+
+		// BB "Buffer": Append to the log buffer. Logs are handed to the host after successful execution.
+		m_builder.SetInsertPoint(bufferBB);
+		m_builder.CreateCall(getFunc(EnvFunc::bufferedLog), {logBuffer, data, size, topics[0], topics[1], topics[2], topics[3]});
+		m_builder.CreateRetVoid();
+
+		// BB "Env": Pass the log to the host immediately
+		m_builder.SetInsertPoint(envBB);
+		m_builder.CreateCall(getFunc(EnvFunc::log), {env, data, size, topics[0], topics[1], topics[2], topics[3]});
+		m_builder.CreateRetVoid();
+	}
+	return func;
+}
+
 void Ext::log(llvm::Value* _memIdx, llvm::Value* _numBytes, std::array<llvm::Value*,4> const& _topics)
 {
 	auto begin = m_memoryMan.getBytePtr(_memIdx);
 	auto size = m_builder.CreateTrunc(_numBytes, Type::Size, "size");
-	llvm::Value* args[] = {getRuntimeManager().getEnvPtr(), begin, size, getArgAlloca(), getArgAlloca(), getArgAlloca(), getArgAlloca()};
+	llvm::Value* args[] = {getRuntimeManager().getEnvPtr(), getRuntimeManager().getLogBufferPtr(), begin, size, getArgAlloca(), getArgAlloca(), getArgAlloca(), getArgAlloca()};
 
-	auto topicArgPtr = &args[3];
+	auto topicArgPtr = &args[4];
 	for (auto&& topic : _topics)
 	{
 		if (topic)
@@ -254,7 +443,8 @@ void Ext::log(llvm::Value* _memIdx, llvm::Value* _numBytes, std::array<llvm::Val
 		++topicArgPtr;
 	}
 
-	createCall(EnvFunc::log, {args[0], args[1], args[2], args[3], args[4], args[5], args[6]});  // TODO: use std::initializer_list<>
+	m_argCounter = 0;
+	m_builder.CreateCall(getLogFunc(), args);
 }
 
 }
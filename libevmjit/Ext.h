@@ -35,6 +35,8 @@ enum class EnvFunc
 	log,
 	blockhash,
 	extcode,
+	bufferedLog,
+	directCall,
 
 	_size
 };
@@ -72,6 +74,15 @@ private:
 	llvm::Value* byPtr(llvm::Value* _value);
 
 	llvm::Value* createCABICall(llvm::Function* _func, std::initializer_list<llvm::Value*> const& _args);
+
+	llvm::Function* getFunc(EnvFunc _funcId);
+	llvm::Function* getBlockHashFunc();
+	llvm::Function* getLogFunc();
+	llvm::Function* getCallFunc();
+
+	llvm::Function* m_blockHash = nullptr;
+	llvm::Function* m_log = nullptr;
+	llvm::Function* m_call = nullptr;
 };
 
 
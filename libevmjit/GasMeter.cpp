@@ -162,7 +162,7 @@ void GasMeter::countCopy(llvm::Value* _copyWords)
 	count(m_builder.CreateNUWMul(_copyWords, m_builder.getInt64(JITSchedule::copyGas::value)));
 }
 
-int64_t GasMeter::getStepCost(Instruction inst) const
+int64_t GasMeter::getStepCost(Instruction inst)
 {
 	switch (inst)
 	{
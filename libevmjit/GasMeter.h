@@ -51,8 +51,10 @@ public:
 	/// Count addional gas cost for memory copy
 	void countCopy(llvm::Value* _copyWords);
 
+	/// Static gas cost of instruction
+	static int64_t getStepCost(Instruction inst);
+
 private:
-	int64_t getStepCost(Instruction inst) const;
 
 	/// Cumulative gas cost of a block of instructions
 	/// @TODO Handle overflow
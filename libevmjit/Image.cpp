@@ -0,0 +1,451 @@
+#include "Image.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/ADT/Triple.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Support/ELF.h>
+#include <llvm/Support/MathExtras.h>
+#include "preprocessor/llvm_includes_end.h"
+
+#include "Utils.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+namespace
+{
+	const auto c_magic = uint32_t(0x494a5645);	// "EVJI"
+	const auto c_version = uint32_t(2);
+	const auto c_noImport = uint32_t(-1);
+	const auto c_thunkSize = uint64_t(8);
+	const auto c_slotSize = uint64_t(8);
+
+	/// Trailer of the image file. The image starts at file offset 0,
+	/// the imports and fixups follow it and precede the header.
+	struct ImageHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t pageSize;		///< Page size of the host that created the image, the image is aligned to it
+		uint64_t codeSize;		///< Size of code pages, mapped read-execute
+		uint64_t dataSize;		///< Size of data pages, mapped read-write
+		uint64_t entry;			///< Image offset of the entry function
+		uint64_t slots;			///< Image offset of the import table
+		uint32_t numImports;
+		uint32_t numFixups;
+	};
+
+	uint64_t getPageSize()
+	{
+#ifndef _WIN32
+		return static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+#else
+		return 0x1000;
+#endif
+	}
+
+	/// Absolute address in data pages: image base or an import plus addend
+	struct Fixup
+	{
+		uint64_t offset;
+		int64_t addend;
+		uint32_t import;
+		uint32_t padding;
+	};
+
+	/// Object linked at base address 0
+	class Linker
+	{
+	public:
+		explicit Linker(llvm::object::ObjectFile const& _obj): m_obj(_obj), m_pageSize(getPageSize()) {}
+
+		bool link(std::string const& _entryName, std::string& o_image);
+
+	private:
+		struct Target
+		{
+			bool isImport;
+			uint64_t value;	///< Import index or image offset
+		};
+
+		void layout();
+		bool resolve(llvm::object::symbol_iterator _symbol, Target& o_target);
+		bool relocate(llvm::object::RelocationRef const& _reloc, uint64_t _sectionOffset);
+		uint32_t getImport(llvm::StringRef _name);
+		uint64_t getSlot(Target const& _target);
+
+		llvm::object::ObjectFile const& m_obj;
+		uint64_t m_pageSize;
+		std::vector<llvm::object::SectionRef> m_sections;	///< Sections included in the image
+		std::vector<uint64_t> m_offsets;					///< Image offsets of the sections
+		std::vector<std::string> m_imports;
+		std::map<std::string, uint32_t> m_importIndex;
+		std::map<uint64_t, uint64_t> m_internalSlots;		///< Import table slots of internal targets by target offset
+		std::vector<Fixup> m_fixups;
+		std::string m_image;
+		uint64_t m_codeSize = 0;
+		uint64_t m_thunks = 0;
+		uint64_t m_slots = 0;
+	};
+
+	bool isIncluded(llvm::object::SectionRef const& _section)
+	{
+		llvm::StringRef name;
+		if (_section.getName(name) || name == ".eh_frame")	// Unwind info is not registered
+			return false;
+		return _section.isText() || _section.isData() || _section.isBSS();
+	}
+
+	void Linker::layout()
+	{
+		for (auto&& section : m_obj.sections())
+			if (isIncluded(section))
+				m_sections.push_back(section);
+
+		// Code, thunks of imports and padding to the page boundary, then data and the import table
+		auto offset = uint64_t(0);
+		m_offsets.resize(m_sections.size());
+		for (auto text : {true, false})
+		{
+			for (size_t i = 0; i < m_sections.size(); ++i)
+			{
+				if (m_sections[i].isText() != text)
+					continue;
+				offset = llvm::RoundUpToAlignment(offset, std::max<uint64_t>(m_sections[i].getAlignment(), 1));
+				m_offsets[i] = offset;
+				offset += m_sections[i].getSize();
+			}
+			if (text)
+			{
+				m_thunks = llvm::RoundUpToAlignment(offset, c_thunkSize);
+				m_codeSize = llvm::RoundUpToAlignment(m_thunks + m_imports.size() * c_thunkSize, m_pageSize);
+				offset = m_codeSize;
+			}
+		}
+		m_slots = llvm::RoundUpToAlignment(offset, c_slotSize);
+		m_image.assign(m_slots, '\0');
+
+		for (size_t i = 0; i < m_sections.size(); ++i)
+		{
+			llvm::StringRef contents;
+			if (!m_sections[i].isBSS() && !m_sections[i].getContents(contents))
+				std::memcpy(&m_image[m_offsets[i]], contents.data(), contents.size());
+		}
+	}
+
+	uint32_t Linker::getImport(llvm::StringRef _name)
+	{
+		auto it = m_importIndex.emplace(_name.str(), static_cast<uint32_t>(m_imports.size()));
+		if (it.second)
+			m_imports.push_back(_name.str());
+		return it.first->second;
+	}
+
+	uint64_t Linker::getSlot(Target const& _target)
+	{
+		if (_target.isImport)
+			return m_slots + _target.value * c_slotSize;
+		auto it = m_internalSlots.find(_target.value);
+		assert(it != m_internalSlots.end());
+		return m_slots + (m_imports.size() + it->second) * c_slotSize;
+	}
+
+	bool Linker::resolve(llvm::object::symbol_iterator _symbol, Target& o_target)
+	{
+		if (_symbol == m_obj.symbol_end())
+			return false;
+
+		if (_symbol->getFlags() & llvm::object::SymbolRef::SF_Undefined)
+		{
+			auto name = _symbol->getName();
+			if (!name)
+				return false;
+			o_target = {true, getImport(*name)};
+			return true;
+		}
+
+		auto section = m_obj.section_end();
+		auto address = _symbol->getAddress();
+		if (_symbol->getSection(section) || section == m_obj.section_end() || !address)
+			return false;
+		for (size_t i = 0; i < m_sections.size(); ++i)
+		{
+			if (m_sections[i] == *section)
+			{
+				o_target = {false, m_offsets[i] + *address - section->getAddress()};
+				return true;
+			}
+		}
+		return false;	// Reference to an excluded section
+	}
+
+	bool Linker::relocate(llvm::object::RelocationRef const& _reloc, uint64_t _sectionOffset)
+	{
+		Target target;
+		auto addend = llvm::object::ELFRelocationRef{_reloc}.getAddend();
+		if (!addend || !resolve(_reloc.getSymbol(), target))
+			return false;
+
+		auto place = _sectionOffset + _reloc.getOffset();
+		auto pcRelative = [&](uint64_t _target)
+		{
+			auto value = static_cast<int64_t>(_target) + *addend - static_cast<int64_t>(place);
+			if (!llvm::isInt<32>(value))
+				return false;
+			auto value32 = static_cast<int32_t>(value);
+			std::memcpy(&m_image[place], &value32, sizeof(value32));
+			return true;
+		};
+
+		switch (_reloc.getType())
+		{
+		case llvm::ELF::R_X86_64_PC32:
+		case llvm::ELF::R_X86_64_PLT32:
+			return pcRelative(target.isImport ? m_thunks + target.value * c_thunkSize : target.value);
+
+		case llvm::ELF::R_X86_64_GOTPCREL:
+			return pcRelative(getSlot(target));
+
+		case llvm::ELF::R_X86_64_64:
+			if (place < m_codeSize)
+				return false;	// Code pages are not patched
+			m_fixups.push_back({place, target.isImport ? *addend : static_cast<int64_t>(target.value) + *addend, target.isImport ? static_cast<uint32_t>(target.value) : c_noImport, 0});
+			return true;
+
+		default:
+			return false;	// Requires non-PIC code or a code model other than small
+		}
+	}
+
+	bool Linker::link(std::string const& _entryName, std::string& o_image)
+	{
+		// Collect imports first, they determine the layout
+		std::vector<std::pair<llvm::object::SectionRef, llvm::object::SectionRef>> relocSections;
+		for (auto&& section : m_obj.sections())
+		{
+			auto target = section.getRelocatedSection();
+			if (target != m_obj.section_end() && isIncluded(*target))
+				relocSections.emplace_back(section, *target);
+		}
+		for (auto&& p : relocSections)
+		{
+			for (auto&& reloc : p.first.relocations())
+			{
+				auto symbol = reloc.getSymbol();
+				if (symbol == m_obj.symbol_end())
+					return false;
+				if (symbol->getFlags() & llvm::object::SymbolRef::SF_Undefined)
+				{
+					auto name = symbol->getName();
+					if (!name)
+						return false;
+					getImport(*name);
+				}
+			}
+		}
+
+		layout();
+
+		// Internal GOT entries need known section offsets, the import table is extended after the layout
+		for (auto&& p : relocSections)
+		{
+			for (auto&& reloc : p.first.relocations())
+			{
+				Target target;
+				if (reloc.getType() == llvm::ELF::R_X86_64_GOTPCREL && resolve(reloc.getSymbol(), target) && !target.isImport)
+					m_internalSlots.emplace(target.value, m_internalSlots.size());
+			}
+		}
+		auto size = m_slots + (m_imports.size() + m_internalSlots.size()) * c_slotSize;
+		m_image.resize(llvm::RoundUpToAlignment(size, m_pageSize), '\0');
+
+		for (auto&& p : relocSections)
+		{
+			auto it = std::find(m_sections.begin(), m_sections.end(), p.second);
+			auto sectionOffset = m_offsets[static_cast<size_t>(it - m_sections.begin())];
+			for (auto&& reloc : p.first.relocations())
+				if (!relocate(reloc, sectionOffset))
+					return false;
+		}
+
+		for (auto&& p : m_internalSlots)
+			m_fixups.push_back({m_slots + (m_imports.size() + p.second) * c_slotSize, static_cast<int64_t>(p.first), c_noImport, 0});
+
+		// Thunks: jmp *slot(%rip)
+		for (size_t i = 0; i < m_imports.size(); ++i)
+		{
+			auto thunk = m_thunks + i * c_thunkSize;
+			auto rel = static_cast<int32_t>(m_slots + i * c_slotSize - (thunk + 6));
+			char code[c_thunkSize] = {'\xff', '\x25', 0, 0, 0, 0, '\xcc', '\xcc'};
+			std::memcpy(code + 2, &rel, sizeof(rel));
+			std::memcpy(&m_image[thunk], code, sizeof(code));
+		}
+
+		Target entry;
+		auto entrySymbol = m_obj.symbol_end();
+		for (auto it = m_obj.symbol_begin(); it != m_obj.symbol_end(); ++it)
+		{
+			auto name = it->getName();
+			if (name && *name == _entryName)
+				entrySymbol = it;
+		}
+		if (!resolve(entrySymbol, entry) || entry.isImport)
+			return false;
+
+		ImageHeader header{};
+		header.magic = c_magic;
+		header.version = c_version;
+		header.pageSize = m_pageSize;
+		header.codeSize = m_codeSize;
+		header.dataSize = m_image.size() - m_codeSize;
+		header.entry = entry.value;
+		header.slots = m_slots;
+		header.numImports = static_cast<uint32_t>(m_imports.size());
+		header.numFixups = static_cast<uint32_t>(m_fixups.size());
+
+		std::string meta;
+		for (auto&& import : m_imports)
+		{
+			auto size = static_cast<uint32_t>(import.size());
+			meta.append(reinterpret_cast<char const*>(&size), sizeof(size));
+			meta.append(import);
+		}
+		meta.append(reinterpret_cast<char const*>(m_fixups.data()), m_fixups.size() * sizeof(Fixup));
+
+		// Metadata is not mapped, it is not padded to the page size
+		o_image = std::move(m_image);
+		o_image.append(meta);
+		o_image.append(reinterpret_cast<char const*>(&header), sizeof(header));
+		return true;
+	}
+}
+
+std::string Image::create(llvm::MemoryBufferRef _object, std::string const& _entryName)
+{
+	auto obj = llvm::object::ObjectFile::createObjectFile(_object);
+	if (!obj || !obj.get()->isELF() || obj.get()->getArch() != llvm::Triple::x86_64)
+		return {};
+
+	std::string image;
+	if (!Linker{*obj.get()}.link(_entryName, image))
+	{
+		DLOG(cache) << _entryName << ": object cannot be linked into image\n";
+		return {};
+	}
+	return image;
+}
+
+#ifndef _WIN32
+
+namespace
+{
+	bool readAt(int _fd, void* _data, size_t _size, uint64_t _offset)
+	{
+		return ::pread(_fd, _data, _size, static_cast<off_t>(_offset)) == static_cast<ssize_t>(_size);
+	}
+
+	uint64_t loadImage(int _fd, Image::SymbolResolver const& _resolver)
+	{
+		ImageHeader header;
+		struct stat st;
+		if (::fstat(_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(header))
+			return 0;
+		auto fileSize = static_cast<uint64_t>(st.st_size);
+		if (!readAt(_fd, &header, sizeof(header), fileSize - sizeof(header)) || header.magic != c_magic || header.version != c_version ||
+			header.pageSize == 0 || header.pageSize % getPageSize() != 0 ||	// Protections are changed per page of the image
+			header.codeSize % header.pageSize != 0 || header.dataSize % header.pageSize != 0)
+			return 0;
+
+		auto size = header.codeSize + header.dataSize;
+		if (size > fileSize - sizeof(header) || header.entry >= header.codeSize || header.slots + header.numImports * c_slotSize > size)
+			return 0;
+
+		std::string meta(fileSize - sizeof(header) - size, '\0');
+		if (!meta.empty() && !readAt(_fd, &meta[0], meta.size(), size))
+			return 0;
+
+		std::vector<uint64_t> imports;
+		size_t pos = 0;
+		for (uint32_t i = 0; i < header.numImports; ++i)
+		{
+			uint32_t size;
+			if (pos + sizeof(size) > meta.size())
+				return 0;
+			std::memcpy(&size, &meta[pos], sizeof(size));
+			pos += sizeof(size);
+			if (pos + size > meta.size())
+				return 0;
+			auto addr = _resolver(meta.substr(pos, size));
+			if (!addr)
+				return 0;
+			imports.push_back(addr);
+			pos += size;
+		}
+		std::vector<Fixup> fixups(header.numFixups);
+		if (pos + fixups.size() * sizeof(Fixup) > meta.size())
+			return 0;
+		std::memcpy(fixups.data(), &meta[pos], fixups.size() * sizeof(Fixup));
+
+		auto mem = ::mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE, _fd, 0);
+		if (mem == MAP_FAILED)
+			return 0;
+		auto base = static_cast<char*>(mem);
+		auto data = base + header.codeSize;
+		if (header.dataSize && ::mprotect(data, header.dataSize, PROT_READ | PROT_WRITE) != 0)
+		{
+			::munmap(mem, size);
+			return 0;
+		}
+
+		for (size_t i = 0; i < imports.size(); ++i)
+			std::memcpy(base + header.slots + i * c_slotSize, &imports[i], sizeof(imports[i]));
+		for (auto&& fixup : fixups)
+		{
+			if (fixup.offset < header.codeSize || fixup.offset + sizeof(uint64_t) > size ||
+				(fixup.import != c_noImport && fixup.import >= imports.size()))
+			{
+				::munmap(mem, size);
+				return 0;
+			}
+			auto value = (fixup.import == c_noImport ? reinterpret_cast<uint64_t>(base) : imports[fixup.import]) + static_cast<uint64_t>(fixup.addend);
+			std::memcpy(base + fixup.offset, &value, sizeof(value));
+		}
+		return reinterpret_cast<uint64_t>(base + header.entry);
+	}
+}
+
+uint64_t Image::load(std::string const& _path, SymbolResolver const& _resolver)
+{
+	auto fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	auto addr = loadImage(fd, _resolver);
+	::close(fd);
+	return addr;
+}
+
+#else
+
+uint64_t Image::load(std::string const&, SymbolResolver const&)
+{
+	return 0;	// Images are not supported
+}
+
+#endif
+
+}
+}
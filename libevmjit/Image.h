@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace llvm
+{
+	class MemoryBufferRef;
+}
+
+namespace dev
+{
+namespace evmjit
+{
+
+/// Pre-linked executable image of a compiled object.
+///
+/// The image contains the sections of a position independent object linked
+/// at base address 0: code pages followed by data pages. References between
+/// sections are resolved when the image is created. Runtime symbols (env_*,
+/// ext_*, memset, ...) are referenced through an import table in the data
+/// pages, calls go through jump thunks placed after the code. Loading an image
+/// maps its pages from the file and patches the import table and the few
+/// absolute addresses in data, RuntimeDyld is not involved. The pages are
+/// aligned to the page size of the creating host and start at file offset 0,
+/// the unmapped import list and header follow them.
+///
+/// Only x86-64 ELF objects compiled with PIC relocation model and small code
+/// model are supported.
+class Image
+{
+public:
+	using SymbolResolver = std::function<uint64_t(std::string const&)>;
+
+	/// Links the object into an image with the function of given name as the entry.
+	/// @returns the content of the image file, empty if the object is not supported
+	static std::string create(llvm::MemoryBufferRef _object, std::string const& _entryName);
+
+	/// Maps the image file into memory and resolves its imports.
+	/// The image stays mapped for the process lifetime.
+	/// @returns the address of the entry function, 0 on failure
+	static uint64_t load(std::string const& _path, SymbolResolver const& _resolver);
+};
+
+}
+}
@@ -26,6 +26,37 @@ void evmjit_destroy(evmjit_context* _context)
 	delete context;
 }
 
+void ext_free(void* _data) noexcept;
+
+char const* evmjit_take_output(evmjit_context* _context, uint64_t* o_size, void** o_memory)
+{
+	auto context = reinterpret_cast<ExecutionContext*>(_context);
+	auto returnData = context->takeReturnData();
+	*o_size = returnData.size();
+	auto data = reinterpret_cast<char const*>(returnData.data());
+	*o_memory = returnData.release();
+	return data;
+}
+
+void evmjit_free_output(void* _memory)
+{
+	ext_free(_memory);
+}
+
+void evmjit_enable_buffered_logs(evmjit_context* _context)
+{
+	auto context = reinterpret_cast<ExecutionContext*>(_context);
+	context->enableBufferedLogs();
+}
+
+evmjit_log const* evmjit_get_logs(evmjit_context* _context, uint64_t* o_numLogs)
+{
+	auto context = reinterpret_cast<ExecutionContext*>(_context);
+	auto logs = context->getLogs();
+	*o_numLogs = std::get<1>(logs);
+	return reinterpret_cast<evmjit_log const*>(std::get<0>(logs));
+}
+
 evmjit_return_code evmjit_exec(evmjit_context* _context, void* _schedule)
 {
 	auto context = reinterpret_cast<ExecutionContext*>(_context);
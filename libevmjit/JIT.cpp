@@ -1,15 +1,16 @@
 #include "evmjit/JIT.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
 
 #include "preprocessor/llvm_includes_start.h"
 #include <llvm/IR/Module.h>
-#include <llvm/ADT/Triple.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
-#include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/Support/TargetSelect.h>
-#include <llvm/Support/Host.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/ManagedStatic.h>
 #include "preprocessor/llvm_includes_end.h"
@@ -17,7 +18,13 @@
 #include "Compiler.h"
 #include "Optimizer.h"
 #include "Cache.h"
+#include "CompileScheduler.h"
+#include "CompileServer.h"
+#include "Engine.h"
+#include "RemoteStorage.h"
+#include "StencilCompiler.h"
 #include "ExecStats.h"
+#include "PCMap.h"
 #include "Utils.h"
 #include "BuildInfo.gen.h"
 
@@ -67,11 +74,31 @@ cl::opt<CacheMode> g_cache{"cache", cl::desc{"Cache compiled EVM code on disk"},
 		clEnumValN(CacheMode::off,   "0", "Disabled"),
 		clEnumValN(CacheMode::read,  "r", "Read only. No new objects are added to cache."),
 		clEnumValN(CacheMode::write, "w", "Write only. No objects are loaded from cache."),
-		clEnumValN(CacheMode::clear, "c", "Clear the cache storage. Cache is disabled."),
+		clEnumValN(CacheMode::clear, "c", "Clear cache entries of this build and target. Cache is disabled."),
 		clEnumValN(CacheMode::preload, "p", "Preload all cached objects."),
 		clEnumValEnd)};
 cl::opt<bool> g_stats{"st", cl::desc{"Statistics"}};
 cl::opt<bool> g_dump{"dump", cl::desc{"Dump LLVM IR module"}};
+cl::opt<unsigned> g_maxBlocks{"max-blocks", cl::desc{"Reject code with more basic blocks (0 - no limit)"}, cl::init(0)};
+cl::opt<unsigned> g_maxIRSize{"max-ir-size", cl::desc{"Reject code with more IR instructions (0 - no limit)"}, cl::init(0)};
+cl::opt<unsigned> g_maxCompileTime{"max-compile-time", cl::desc{"Reject code if IR construction takes longer [ms] (0 - no limit)"}, cl::init(0)};
+cl::opt<unsigned> g_keccakCache{"sha3-cache", cl::desc{"Number of entries of per-thread SHA3 memoization cache for inputs up to 64 bytes (0 - disabled)"}, cl::init(0)};
+cl::opt<bool> g_hostCPU{"host-cpu", cl::desc{"Generate code for the host CPU features (e.g. AVX2)"}, cl::init(true)};
+cl::opt<bool> g_memoryLoops{"memory-loops", cl::desc{"Replace memory copy and zero-fill loops with bulk operations"}, cl::init(true)};
+cl::opt<unsigned> g_tierUp{"tier-up", cl::desc{"Compile code quickly by copying instruction stencils first and recompile it with LLVM after given number of executions (0 - disabled)"}, cl::init(0)};
+cl::opt<EngineKind> g_engine{"engine", cl::desc{"Machine code generation backend"},
+	cl::values(
+		clEnumValN(EngineKind::mcjit, "mcjit", "MCJIT execution engine"),
+		clEnumValN(EngineKind::orc,   "orc",   "ORC layers, machine code of evicted code is freed (compilation is not concurrent)"),
+		clEnumValEnd),
+	cl::init(EngineKind::mcjit)};
+cl::opt<bool> g_cacheCompress{"cache-compress", cl::desc{"Compress cached objects on disk"}};
+cl::opt<unsigned> g_cacheMemory{"cache-memory", cl::desc{"Size limit in MB of in-memory cache of recently used objects, for evicted code and compile server requests (0 - disabled)"}, cl::init(0)};
+cl::opt<std::string> g_cacheStorage{"cache-storage", cl::desc{"Cache storage: file:<dir>, shm:<name> or remote:<host>:<port> (default: user cache directory)"}};
+cl::opt<bool> g_cacheImages{"cache-images", cl::desc{"Also cache pre-linked images of compiled code, loaded by mapping them into memory"}};
+cl::opt<unsigned> g_compileThreads{"compile-threads", cl::desc{"Number of threads compiling hot code and prefetched code in background (at least 1). LLVM compilations run one at a time, more threads overlap only compile server requests and stencil copying"}, cl::init(1)};
+cl::opt<std::string> g_compileServer{"compile-server", cl::desc{"Compile code in the evmjit-compiled server listening on given Unix socket"}};
+cl::opt<bool> g_pcMap{"pcmap", cl::desc{"Emit tables mapping native code addresses to EVM code locations"}};
 
 void parseOptions()
 {
@@ -80,11 +107,53 @@ void parseOptions()
 	cl::ParseEnvironmentOptions("evmjit", "EVMJIT", "Ethereum EVM JIT Compiler");
 }
 
+/// Suffix of identifiers of code compiled with debug info for PCMap
+static const auto c_pcMapSuffix = "-p";
+
+/// Suffix of scheduler keys of optimizing recompilation jobs
+static const auto c_tierUpJobSuffix = "-O";
+
+/// Executions of stencil code left before it is recompiled with LLVM
+struct TierUp
+{
+	std::atomic<unsigned> countdown;
+	std::atomic<bool> done{false};	///< Replaced by LLVM compiled code or kept for good
+
+	explicit TierUp(unsigned _countdown): countdown(_countdown) {}
+
+	/// Counts an execution.
+	/// @returns true if the code should be recompiled now (once)
+	bool count()
+	{
+		auto n = countdown.load(std::memory_order_relaxed);
+		while (n != 0)	// 0: recompilation in progress
+		{
+			if (countdown.compare_exchange_weak(n, n - 1, std::memory_order_relaxed))
+				return n == 1;
+		}
+		return false;
+	}
+};
+
 class JITImpl
 {
-	std::unique_ptr<llvm::ExecutionEngine> m_engine;
-	mutable std::mutex x_codeMap;
+	std::unique_ptr<Engine> m_engine;
+	std::unique_ptr<StencilCompiler> m_stencilCompiler;	///< Baseline tier. Null if tiering is disabled.
+	std::unique_ptr<ObjectEmitter> m_stencilEmitter;
+	std::string m_targetId;	///< Code generation target, see getTargetId()
+	mutable std::mutex x_codeMap;	///< No other lock is taken while holding it
 	std::unordered_map<std::string, ExecFunc> m_codeMap;
+	std::unordered_set<std::string> m_rejected;	///< Codes exceeding compilation limits
+	std::unordered_map<std::string, std::shared_ptr<TierUp>> m_tierUps;	///< Stencil code to be recompiled with LLVM
+	std::atomic<uint64_t> m_evictions{0};	///< Number of evicted codes, code handles compare it to drop freed code
+	CompileLimitStats m_limitStats;	///< Updated by compilations in any thread
+	/// Serializes IR construction, which uses the global LLVMContext and Type statics, code generation
+	/// of the modules in that context and the object cache handoff to the engines. So at most one LLVM
+	/// compilation runs at a time, also with more compile threads: a running background job delays
+	/// executions waiting for other code. Stencil compilation and compile server requests do not take it.
+	std::mutex x_compile;
+	std::unique_ptr<ObjectEmitter> m_objectEmitters[2];	///< Object emitters of the compile server: unoptimized and optimized
+	std::unique_ptr<CompileScheduler> m_scheduler;	///< Destroyed first: background jobs use the members above
 
 public:
 	static JITImpl& instance()
@@ -96,26 +165,91 @@ public:
 	}
 
 	JITImpl();
+	~JITImpl();
+
+	Engine& engine() { return *m_engine; }
 
-	llvm::ExecutionEngine& engine() { return *m_engine; }
+	bool isRejected(std::string const& _codeIdentifier) const;
 
-	ExecFunc getExecFunc(std::string const& _codeIdentifier) const;
+	/// @param o_tierUp set to the tier-up counter if the code is stencil code
+	ExecFunc getExecFunc(std::string const& _codeIdentifier, std::shared_ptr<TierUp>* o_tierUp = nullptr) const;
 	void mapExecFunc(std::string const& _codeIdentifier, ExecFunc _funcAddr);
 
-	ExecFunc compile(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule);
+	/// Compiles the code with stencils if tiering is enabled, unless _optimized is set.
+	/// Code that cannot be compiled with stencils is compiled with LLVM.
+	ExecFunc compile(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options = {}, bool _optimized = false);
+
+	/// Generates IR module of the code ready for code generation. Null if the code exceeds compilation limits.
+	/// Requires x_compile to be held.
+	std::unique_ptr<llvm::Module> buildModule(byte const* _code, uint64_t _codeSize, std::string const& _moduleIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options, bool _optimize);
+
+	/// Compiles the code to a relocatable object for a client of the compile server
+	CompileStatus compileObject(CompileRequest const& _request, std::string& o_object);
+
+	bool isTieringEnabled() const { return m_stencilCompiler != nullptr; }
+
+	/// Frees machine code of the code, see JIT::evictCode()
+	bool evict(std::string const& _codeIdentifier);
+
+	uint64_t evictions() const { return m_evictions.load(std::memory_order_acquire); }
+
+	/// Replaces stencil code with LLVM compiled code. If _funcAddr is null the stencil code is kept for good.
+	void mapOptimizedExecFunc(std::string const& _codeIdentifier, ExecFunc _funcAddr);
+
+	/// Compiles and maps the code in the calling thread unless it is compiled already.
+	/// Takes over or waits for scheduled compilation of the same code.
+	/// @returns the exec function, null if compilation failed
+	ExecFunc compileBlocking(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options = {});
+
+	/// Schedules compilation of the code in background with the lowest priority.
+	/// The request is dropped if it is not started before the deadline.
+	void prefetch(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, CompileScheduler::clock::time_point _deadline);
+
+	/// Schedules recompilation of hot stencil code with LLVM. The stencil code is used until it finishes.
+	void scheduleTierUp(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options);
+
+private:
+	ExecFunc compileAndMap(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options);
+
+	/// Compiles the stencil of given index to an object, see StencilCompiler::ObjectGenerator
+	std::string generateStencil(unsigned _index);
 };
 
 
-class SymbolResolver : public llvm::SectionMemoryManager
+Engine::Options getEngineOptions(bool _optimize)
 {
-	llvm::RuntimeDyld::SymbolInfo findSymbol(std::string const& _name) override
-	{
-		if (_name == "env_sha3")
-			return {reinterpret_cast<uint64_t>(&keccak), llvm::JITSymbolFlags::Exported};
-		return llvm::SectionMemoryManager::findSymbol(_name);
-	}
-};
+	Engine::Options options;
+	options.optimize = _optimize;
+	options.hostCPU = g_hostCPU;
+	options.keccakCache = g_keccakCache != 0;
+	options.pcMap = g_pcMap;
+	options.pic = g_cacheImages;
+	CacheOptions cacheOptions;
+	cacheOptions.images = g_cacheImages;
+	cacheOptions.compress = g_cacheCompress;
+	cacheOptions.memoryLimit = size_t(g_cacheMemory) * 1024 * 1024;
+	cacheOptions.storage = g_cacheStorage;
+	cacheOptions.target = getTargetId(options);
+	options.objectCache = Cache::init(g_cache, nullptr, cacheOptions);
+	return options;
+}
 
+/// Compiler options of code compiled in this process
+Compiler::Options getCompilerOptions(Compiler::Options const& _options)
+{
+	auto options = _options;
+	options.emitPCMap = g_pcMap;
+	options.maxBlocks = g_maxBlocks;
+	options.maxIRSize = g_maxIRSize;
+	options.maxCompileTime = g_maxCompileTime;
+	options.optimizeMemoryLoops = g_memoryLoops;
+	return options;
+}
+
+uint64_t resolveHostSymbol(std::string const& _name)
+{
+	return getHostSymbolAddress(_name, g_keccakCache != 0);
+}
 
 JITImpl::JITImpl()
 {
@@ -125,39 +259,66 @@ JITImpl::JITImpl()
 	if (preloadCache)
 		g_cache = CacheMode::on;
 
+	setKeccakCacheSize(g_keccakCache);
+
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
 
-	auto module = llvm::make_unique<llvm::Module>(llvm::StringRef{}, llvm::getGlobalContext());
+	auto engineOptions = getEngineOptions(g_optimize);
+	m_engine = Engine::create(g_engine, engineOptions);
+	m_targetId = getTargetId(engineOptions);
 
-	// FIXME: LLVM 3.7: test on Windows
-	auto triple = llvm::Triple(llvm::sys::getProcessTriple());
-	if (triple.getOS() == llvm::Triple::OSType::Win32)
-		triple.setObjectFormat(llvm::Triple::ObjectFormatType::ELF);  // MCJIT does not support COFF format
-	module->setTargetTriple(triple.str());
+	// Baseline tier: copies of instruction stencils compiled by LLVM once
+	if (g_tierUp)
+		m_stencilCompiler.reset(new StencilCompiler{[this](unsigned _index){ return generateStencil(_index); }, resolveHostSymbol});
 
-	llvm::EngineBuilder builder(std::move(module));
-	builder.setEngineKind(llvm::EngineKind::JIT);
-	builder.setMCJITMemoryManager(llvm::make_unique<SymbolResolver>());
-	builder.setOptLevel(g_optimize ? llvm::CodeGenOpt::Default : llvm::CodeGenOpt::None);
+	m_scheduler.reset(new CompileScheduler{std::max(g_compileThreads.getValue(), 1u)});
 
-	m_engine.reset(builder.create());
-
-	// TODO: Update cache listener
-	m_engine->setObjectCache(Cache::init(g_cache, nullptr));
+	// Stencils are generated in background, code is compiled with LLVM until they are ready
+	if (m_stencilCompiler)
+		m_scheduler->submit("stencils", CompilePriority::tierUp, [this]{ m_stencilCompiler->generate(); });
 
 	// FIXME: Disabled during API changes
 	//if (preloadCache)
 	//	Cache::preload(*m_engine, funcCache);
 }
 
-ExecFunc JITImpl::getExecFunc(std::string const& _codeIdentifier) const
+JITImpl::~JITImpl()
+{
+	if (g_stats)
+	{
+		m_limitStats.output(std::cout);
+		m_scheduler->stats().output(std::cout);
+		if (g_keccakCache)
+		{
+			auto keccakStats = getKeccakCacheStats();
+			auto total = keccakStats.hits + keccakStats.misses;
+			std::cout << "SHA3 cache: " << keccakStats.hits << " hits, " << keccakStats.misses << " misses";
+			if (total)
+				std::cout << " (" << (keccakStats.hits * 100 / total) << "% hit rate)";
+			std::cout << "\n";
+		}
+	}
+}
+
+bool JITImpl::isRejected(std::string const& _codeIdentifier) const
+{
+	std::lock_guard<std::mutex> lock{x_codeMap};
+	return m_rejected.count(_codeIdentifier) != 0;
+}
+
+ExecFunc JITImpl::getExecFunc(std::string const& _codeIdentifier, std::shared_ptr<TierUp>* o_tierUp) const
 {
 	std::lock_guard<std::mutex> lock{x_codeMap};
 	auto it = m_codeMap.find(_codeIdentifier);
-	if (it != m_codeMap.end())
-		return it->second;
-	return nullptr;
+	if (it == m_codeMap.end())
+		return nullptr;
+	if (o_tierUp)
+	{
+		auto tierUpIt = m_tierUps.find(_codeIdentifier);
+		*o_tierUp = tierUpIt != m_tierUps.end() ? tierUpIt->second : nullptr;
+	}
+	return it->second;
 }
 
 void JITImpl::mapExecFunc(std::string const& _codeIdentifier, ExecFunc _funcAddr)
@@ -166,34 +327,467 @@ void JITImpl::mapExecFunc(std::string const& _codeIdentifier, ExecFunc _funcAddr
 	m_codeMap.emplace(_codeIdentifier, _funcAddr);
 }
 
-ExecFunc JITImpl::compile(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule)
+bool JITImpl::evict(std::string const& _codeIdentifier)
+{
+	ExecFunc funcAddr = nullptr;
+	auto isStencilCode = false;
+	{
+		// The code is freed after the lock is released: freeing takes the locks of
+		// the stencil compiler or the engine, which are held while compiling.
+		std::lock_guard<std::mutex> lock{x_codeMap};
+		auto it = m_codeMap.find(_codeIdentifier);
+		if (it == m_codeMap.end())
+			return false;
+		funcAddr = it->second;
+		auto tierUpIt = m_tierUps.find(_codeIdentifier);
+		isStencilCode = tierUpIt != m_tierUps.end();
+		if (!isStencilCode && g_engine == EngineKind::mcjit)
+			return false;
+		if (isStencilCode)
+		{
+			tierUpIt->second->done.store(true, std::memory_order_release);
+			m_tierUps.erase(tierUpIt);
+		}
+		m_codeMap.erase(it);
+		m_evictions.fetch_add(1, std::memory_order_acq_rel);
+	}
+
+	// Recompiling evicted code is wasted work. A running job maps the code again.
+	if (isStencilCode)
+		m_scheduler->cancel(_codeIdentifier + c_tierUpJobSuffix);
+
+	auto moduleIdentifier = _codeIdentifier;
+	if (g_pcMap)
+		moduleIdentifier += c_pcMapSuffix;
+	auto freed = isStencilCode ?
+		m_stencilCompiler->release(reinterpret_cast<uint64_t>(funcAddr)) :
+		m_engine->removeModule(moduleIdentifier);	// Also unregisters the code in PCMap
+	if (!freed)
+	{
+		// Loaded from a cache image: map it again, unless compiled again in the meantime
+		std::lock_guard<std::mutex> lock{x_codeMap};
+		m_codeMap.emplace(_codeIdentifier, funcAddr);
+	}
+	return freed;
+}
+
+void JITImpl::mapOptimizedExecFunc(std::string const& _codeIdentifier, ExecFunc _funcAddr)
+{
+	std::lock_guard<std::mutex> lock{x_codeMap};
+	if (_funcAddr)
+		m_codeMap[_codeIdentifier] = _funcAddr;
+	auto it = m_tierUps.find(_codeIdentifier);
+	if (it != m_tierUps.end())
+	{
+		it->second->done.store(true, std::memory_order_release);
+		m_tierUps.erase(it);
+	}
+}
+
+ExecFunc JITImpl::compile(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options, bool _optimized)
+{
+	// Stencils have no tracing variant, traced code is compiled with LLVM right away.
+	// So is code compiled before the stencils are generated.
+	if (isTieringEnabled() && !_optimized && _options.trace == TraceLevel::None)
+	{
+		if (auto stencilFunc = (ExecFunc)m_stencilCompiler->compile(_code, _codeSize, _schedule.haveDelegateCall))
+		{
+			std::lock_guard<std::mutex> lock{x_codeMap};
+			m_tierUps[_codeIdentifier] = std::make_shared<TierUp>(g_tierUp);
+			return stencilFunc;
+		}
+	}
+
+	auto moduleIdentifier = _codeIdentifier;
+	if (g_pcMap)
+		moduleIdentifier += c_pcMapSuffix;	// Cached objects without debug info produce no PCMap entries
+	auto& engine = *m_engine;
+
+	// Cache::getObject() and Cache::addObject() hand the object to the engine through
+	// the cache, it must be consumed by addModule() before another lookup
+	std::unique_lock<std::mutex> lock{x_compile};
+
+	// A pre-linked image skips code generation and linking
+	auto execFunc = g_cacheImages ? (ExecFunc)Cache::loadImage(moduleIdentifier, resolveHostSymbol) : nullptr;
+	if (!execFunc)
+	{
+		auto module = Cache::getObject(moduleIdentifier);
+		if (!module && !g_compileServer.empty())
+		{
+			lock.unlock();	// No object is pending, other compilations go on during the round trip
+
+			CompileRequest request;
+			request.moduleIdentifier = moduleIdentifier;
+			request.target = m_targetId;
+			request.code.assign(reinterpret_cast<char const*>(_code), _codeSize);
+			request.haveDelegateCall = _schedule.haveDelegateCall;
+			request.optimize = g_optimize;
+			request.trace = static_cast<uint8_t>(_options.trace);
+			request.memoryLoops = g_memoryLoops;
+			request.pcMap = g_pcMap;
+			request.maxBlocks = g_maxBlocks;
+			request.maxIRSize = g_maxIRSize;
+			request.maxCompileTime = g_maxCompileTime;
+			std::string object;
+			auto status = CompileServer::request(g_compileServer, request, object);
+			if (status == CompileStatus::Rejected)
+			{
+				std::lock_guard<std::mutex> codeMapLock{x_codeMap};
+				m_rejected.insert(_codeIdentifier);
+				return nullptr;
+			}
+			lock.lock();
+			if (status == CompileStatus::Ok)
+				module = Cache::addObject(moduleIdentifier, llvm::MemoryBuffer::getMemBufferCopy(object));
+			// Otherwise compile locally
+		}
+		if (!module)
+		{
+			module = buildModule(_code, _codeSize, moduleIdentifier, _schedule, getCompilerOptions(_options), g_optimize);
+			if (!module)
+			{
+				lock.unlock();	// x_codeMap is not taken while holding x_compile
+				std::lock_guard<std::mutex> codeMapLock{x_codeMap};
+				m_rejected.insert(_codeIdentifier);
+				return nullptr;
+			}
+		}
+		if (g_dump)
+			module->dump();
+
+		//listener->stateChanged(ExecState::CodeGen);
+		execFunc = (ExecFunc)engine.addModule(std::move(module), moduleIdentifier);
+	}
+	return execFunc;
+}
+
+std::string JITImpl::generateStencil(unsigned _index)
 {
-	auto module = Cache::getObject(_codeIdentifier);
+	auto name = StencilCompiler::getStencilName(_index);
+	if (auto object = Cache::loadObject(name))
+		return object->getBuffer().str();
+
+	std::lock_guard<std::mutex> lock{x_compile};
+
+	Compiler::Options options;
+	JITSchedule schedule;	// DELEGATECALL is replaced with an invalid instruction when not available
+	Compiler compiler{options, schedule};
+	auto module = _index == StencilCompiler::entryIndex ?
+		compiler.compileStencilEntry(name) :
+		compiler.compileStencil(Instruction(_index), name);
 	if (!module)
+		return {};
+
+	// The entry keeps its Exit block and allocas in place for the other stencils
+	if (_index != StencilCompiler::entryIndex)
+		optimize(*module);
+	prepare(*module);
+
+	if (!m_stencilEmitter)
+	{
+		Engine::Options emitterOptions;
+		emitterOptions.optimize = true;
+		emitterOptions.hostCPU = g_hostCPU;
+		emitterOptions.stencils = true;
+		m_stencilEmitter.reset(new ObjectEmitter{emitterOptions});
+	}
+	auto object = m_stencilEmitter->emit(*module);
+	if (!object.empty())
+		Cache::storeObject(name, object);
+	return object;
+}
+
+ExecFunc JITImpl::compileAndMap(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options)
+{
+	auto func = getExecFunc(_codeIdentifier);
+	if (!func && !isRejected(_codeIdentifier))
 	{
-		// TODO: Listener support must be redesigned. These should be a feature of JITImpl
-		//listener->stateChanged(ExecState::Compilation);
-		assert(_code || !_codeSize);
-		module = Compiler({}, _schedule).compile(_code, _code + _codeSize, _codeIdentifier);
+		func = compile(_code, _codeSize, _codeIdentifier, _schedule, _options);
+		if (func)
+			mapExecFunc(_codeIdentifier, func);
+	}
+	return func;
+}
+
+ExecFunc JITImpl::compileBlocking(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options)
+{
+	ExecFunc func = nullptr;
+	m_scheduler->run(_codeIdentifier, [&]
+	{
+		func = compileAndMap(_code, _codeSize, _codeIdentifier, _schedule, _options);
+	});
+	return func;
+}
+
+void JITImpl::prefetch(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, CompileScheduler::clock::time_point _deadline)
+{
+	if (getExecFunc(_codeIdentifier) || isRejected(_codeIdentifier))
+		return;
 
-		if (g_optimize)
+	auto code = std::vector<byte>(_code, _code + _codeSize);
+	auto codeIdentifier = _codeIdentifier;
+	auto schedule = _schedule;
+	m_scheduler->submit(_codeIdentifier, CompilePriority::prefetch, [this, code, codeIdentifier, schedule]
+	{
+		compileAndMap(code.data(), code.size(), codeIdentifier, schedule, {});
+	}, _deadline);
+}
+
+void JITImpl::scheduleTierUp(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options)
+{
+	auto code = std::vector<byte>(_code, _code + _codeSize);
+	auto codeIdentifier = _codeIdentifier;
+	auto schedule = _schedule;
+	auto options = _options;
+	m_scheduler->submit(_codeIdentifier + c_tierUpJobSuffix, CompilePriority::tierUp, [this, code, codeIdentifier, schedule, options]
+	{
+		auto optimizedFunc = compile(code.data(), code.size(), codeIdentifier, schedule, options, true);
+		mapOptimizedExecFunc(codeIdentifier, optimizedFunc);
+	});
+}
+
+std::unique_ptr<llvm::Module> JITImpl::buildModule(byte const* _code, uint64_t _codeSize, std::string const& _moduleIdentifier, JITSchedule const& _schedule, Compiler::Options const& _options, bool _optimize)
+{
+	// TODO: Listener support must be redesigned. These should be a feature of JITImpl
+	//listener->stateChanged(ExecState::Compilation);
+	assert(_code || !_codeSize);
+	Compiler compiler{_options, _schedule};
+	auto module = compiler.compile(_code, _code + _codeSize, _moduleIdentifier);
+	if (!module)
+	{
+		switch (compiler.exceededLimit())
 		{
-			//listener->stateChanged(ExecState::Optimization);
-			optimize(*module);
+		case Compiler::Limit::Blocks:		m_limitStats.rejectedBlocks.fetch_add(1, std::memory_order_relaxed); break;
+		case Compiler::Limit::IRSize:		m_limitStats.rejectedIRSize.fetch_add(1, std::memory_order_relaxed); break;
+		case Compiler::Limit::CompileTime:	m_limitStats.rejectedCompileTime.fetch_add(1, std::memory_order_relaxed); break;
+		case Compiler::Limit::None:			break;
 		}
+		return nullptr;
+	}
 
-		prepare(*module);
+	if (_optimize)
+	{
+		//listener->stateChanged(ExecState::Optimization);
+		optimize(*module);
 	}
-	if (g_dump)
-		module->dump();
 
-	m_engine->addModule(std::move(module));
-	//listener->stateChanged(ExecState::CodeGen);
-	return (ExecFunc)m_engine->getFunctionAddress(_codeIdentifier);
+	prepare(*module);
+	return module;
+}
+
+CompileStatus JITImpl::compileObject(CompileRequest const& _request, std::string& o_object)
+{
+	// Objects for another CPU could crash the client, it compiles locally instead
+	if (_request.target != m_targetId)
+	{
+		DLOG(compileserver) << _request.moduleIdentifier << ": target mismatch\n";
+		return CompileStatus::Error;
+	}
+
+	// Clients with different options get different objects of the same code
+	auto objectId = _request.moduleIdentifier;
+	if (_request.optimize)
+		objectId += "-O";
+	if (!_request.memoryLoops)
+		objectId += "-nml";
+
+	// Cache hits are served concurrently
+	if (auto object = Cache::loadObject(objectId))
+	{
+		o_object = object->getBuffer().str();
+		return CompileStatus::Ok;
+	}
+
+	// Requests are compiled one at a time: IR construction uses the global LLVMContext
+	// and the Type statics, and the object emitters are not thread-safe
+	std::lock_guard<std::mutex> lock{x_compile};
+
+	// Compiled by another connection in the meantime
+	if (auto object = Cache::loadObject(objectId))
+	{
+		o_object = object->getBuffer().str();
+		return CompileStatus::Ok;
+	}
+
+	JITSchedule schedule;
+	schedule.haveDelegateCall = _request.haveDelegateCall;
+	Compiler::Options options;
+	options.trace = static_cast<TraceLevel>(_request.trace);
+	options.emitPCMap = _request.pcMap;
+	options.maxBlocks = _request.maxBlocks;
+	options.maxIRSize = _request.maxIRSize;
+	options.maxCompileTime = _request.maxCompileTime;
+	options.optimizeMemoryLoops = _request.memoryLoops;
+	auto code = reinterpret_cast<byte const*>(_request.code.data());
+	auto module = buildModule(code, _request.code.size(), _request.moduleIdentifier, schedule, options, _request.optimize);
+	if (!module)
+		return CompileStatus::Rejected;
+
+	auto& emitter = m_objectEmitters[_request.optimize];
+	if (!emitter)
+		emitter.reset(new ObjectEmitter{getEngineOptions(_request.optimize)});
+	o_object = emitter->emit(*module);
+	if (o_object.empty())
+		return CompileStatus::Error;
+	Cache::storeObject(objectId, o_object);
+	return CompileStatus::Ok;
+}
+
+/// Looks up the code and compiles it if needed. Executions of stencil code are counted for tier-up if _countExec is set.
+/// Executions with a tracer use the tracing variant of the code, which is cached separately.
+/// @returns the exec function, null if the code cannot be executed (o_returnCode tells why)
+ExecFunc resolveExecFunc(byte const* _code, uint64_t _codeSize, std::string _codeIdentifier, JITSchedule const& _schedule, Tracer const* _tracer, bool _countExec, ReturnCode& o_returnCode)
+{
+	auto& jit = JITImpl::instance();
+	Compiler::Options options;
+	if (_tracer)
+	{
+		options.trace = _tracer->level;
+		if (options.trace != TraceLevel::None)
+			_codeIdentifier += "-t" + std::to_string(static_cast<int>(options.trace));
+	}
+	std::shared_ptr<TierUp> tierUp;
+	auto execFunc = jit.getExecFunc(_codeIdentifier, jit.isTieringEnabled() ? &tierUp : nullptr);
+	if (!execFunc)
+	{
+		if (jit.isRejected(_codeIdentifier))
+		{
+			o_returnCode = ReturnCode::CompilationRejected;
+			return nullptr;
+		}
+		execFunc = jit.compileBlocking(_code, _codeSize, _codeIdentifier, _schedule, options);
+		if (!execFunc)
+			o_returnCode = jit.isRejected(_codeIdentifier) ? ReturnCode::CompilationRejected : ReturnCode::LLVMError;
+	}
+	else if (_countExec && tierUp && tierUp->count())
+	{
+		// Hot code: recompile with LLVM in background
+		jit.scheduleTierUp(_code, _codeSize, _codeIdentifier, _schedule, options);
+	}
+	return execFunc;
+}
+
+ReturnCode execCode(ExecFunc _execFunc, ExecutionContext& _context)
+{
+	_context.clearLogs();
+
+	//listener->stateChanged(ExecState::Execution);
+	auto returnCode = _execFunc(&_context);
+	//listener->stateChanged(ExecState::Return);
+
+	if (returnCode == ReturnCode::Return)
+		_context.returnData = _context.getReturnData(); // Save reference to return data
+	else
+		_context.returnData = {};	// callData does not point to return data
+
+	if (static_cast<int>(returnCode) < 0)
+		_context.clearLogs(); // Logs of failed execution are discarded
+
+	return returnCode;
 }
 
 } // anonymous namespace
 
+/// Registered code. Once compiled the exec function is read without locking.
+struct CodeHandle::State
+{
+	std::atomic<ExecFunc> execFunc{nullptr};
+	std::atomic<bool> rejected{false};
+	std::atomic<bool> isFinal{true};	///< The code will not be replaced by LLVM compiled code
+	std::shared_ptr<TierUp> tierUp;	///< Set with stencil code, before isFinal is cleared
+	std::atomic<uint64_t> evictions{0};	///< JITImpl::evictions() when execFunc was set
+	std::mutex x_compile;		///< Serializes compilation of the code
+	std::vector<byte> code;
+	std::string codeIdentifier;
+	JITSchedule schedule;
+
+	/// @returns the exec function, compiles the code if needed. Null if compilation failed.
+	ExecFunc compile()
+	{
+		std::lock_guard<std::mutex> lock{x_compile};
+		auto& jit = JITImpl::instance();
+		auto func = execFunc.load(std::memory_order_relaxed);
+		if (func && evictions.load(std::memory_order_relaxed) != jit.evictions())
+		{
+			// Some code has been evicted, this one may have been freed
+			func = nullptr;
+			execFunc.store(nullptr, std::memory_order_relaxed);
+			tierUp.reset();
+			isFinal = !jit.isTieringEnabled();
+		}
+		if (func || rejected)
+			return func;
+
+		// Before the lookup, so a later eviction is noticed. Readers load it before execFunc.
+		evictions.store(jit.evictions(), std::memory_order_release);
+		func = jit.compileBlocking(code.data(), code.size(), codeIdentifier, schedule);	// could have been compiled by exec() with a context
+		if (!func)
+			rejected = jit.isRejected(codeIdentifier);
+		else
+			func = setTierUp(jit, func);
+		execFunc.store(func, std::memory_order_release);
+		return func;
+	}
+
+	/// Looks up the tier-up counter of the mapped code.
+	/// @returns the mapped exec function, _func if the code is not mapped
+	ExecFunc setTierUp(JITImpl& _jit, ExecFunc _func)
+	{
+		if (isFinal.load(std::memory_order_relaxed))
+			return _func;
+		auto func = _jit.getExecFunc(codeIdentifier, &tierUp);
+		if (!tierUp)
+			isFinal.store(true, std::memory_order_release);
+		return func ? func : _func;
+	}
+
+	/// Compiles the code if needed, see resolveExecFunc().
+	/// @returns the exec function, null if the code cannot be executed (o_returnCode tells why)
+	ExecFunc resolve(Tracer const* _tracer, bool _countExec, ReturnCode& o_returnCode)
+	{
+		if (_tracer && _tracer->level != TraceLevel::None)
+			return resolveExecFunc(code.data(), code.size(), codeIdentifier, schedule, _tracer, _countExec, o_returnCode);
+
+		auto& jit = JITImpl::instance();
+		auto evictions = this->evictions.load(std::memory_order_acquire);
+		auto func = execFunc.load(std::memory_order_acquire);
+		if (!func || evictions != jit.evictions())
+		{
+			func = compile();
+			if (!func)
+				o_returnCode = rejected ? ReturnCode::CompilationRejected : ReturnCode::LLVMError;
+		}
+		else if (_countExec && !isFinal.load(std::memory_order_acquire))
+			func = countExec(func);
+		return func;
+	}
+
+	/// Counts an execution of stencil code and schedules recompilation with LLVM when it gets hot.
+	/// Does not lock unless the code has been replaced.
+	/// @returns the exec function to be used
+	ExecFunc countExec(ExecFunc _func)
+	{
+		auto& jit = JITImpl::instance();
+		if (!tierUp->done.load(std::memory_order_acquire))
+		{
+			if (tierUp->count())
+				jit.scheduleTierUp(code.data(), code.size(), codeIdentifier, schedule, {});
+			return _func;
+		}
+
+		// Recompiled in background
+		auto func = jit.getExecFunc(codeIdentifier);
+		execFunc.store(func, std::memory_order_release);
+		isFinal.store(true, std::memory_order_release);
+		return func;
+	}
+};
+
+bool CodeHandle::isReady() const
+{
+	return m_state && m_state->execFunc.load(std::memory_order_acquire) != nullptr;
+}
+
 bool JIT::isCodeReady(std::string const& _codeIdentifier)
 {
 	return JITImpl::instance().getExecFunc(_codeIdentifier) != nullptr;
@@ -201,10 +795,14 @@ bool JIT::isCodeReady(std::string const& _codeIdentifier)
 
 void JIT::compile(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule)
 {
-	auto& jit = JITImpl::instance();
-	auto execFunc = jit.compile(_code, _codeSize, _codeIdentifier, _schedule);
-	if (execFunc) // FIXME: What with error?
-		jit.mapExecFunc(_codeIdentifier, execFunc);
+	JITImpl::instance().compileBlocking(_code, _codeSize, _codeIdentifier, _schedule); // FIXME: What with error?
+}
+
+void JIT::prefetch(byte const* _code, uint64_t _codeSize, std::string const& _codeIdentifier, JITSchedule const& _schedule, unsigned _deadlineMs)
+{
+	using clock = CompileScheduler::clock;
+	auto deadline = _deadlineMs ? clock::now() + std::chrono::milliseconds(_deadlineMs) : clock::time_point::max();
+	JITImpl::instance().prefetch(_code, _codeSize, _codeIdentifier, _schedule, deadline);
 }
 
 ReturnCode JIT::exec(ExecutionContext& _context, JITSchedule const& _schedule)
@@ -213,23 +811,13 @@ ReturnCode JIT::exec(ExecutionContext& _context, JITSchedule const& _schedule)
 	//listener->stateChanged(ExecState::Started);
 	//static StatsCollector statsCollector;
 
-	auto& jit = JITImpl::instance();
+	ReturnCode returnCode;
 	auto codeIdentifier = _schedule.codeIdentifier(_context.codeHash());
-	auto execFunc = jit.getExecFunc(codeIdentifier);
+	auto execFunc = resolveExecFunc(_context.code(), _context.codeSize(), std::move(codeIdentifier), _schedule, _context.tracer(), true, returnCode);
 	if (!execFunc)
-	{
-		execFunc = jit.compile(_context.code(), _context.codeSize(), codeIdentifier, _schedule);
-		if (!execFunc)
-			return ReturnCode::LLVMError;
-		jit.mapExecFunc(codeIdentifier, execFunc);
-	}
-
-	//listener->stateChanged(ExecState::Execution);
-	auto returnCode = execFunc(&_context);
-	//listener->stateChanged(ExecState::Return);
+		return returnCode;
 
-	if (returnCode == ReturnCode::Return)
-		_context.returnData = _context.getReturnData(); // Save reference to return data
+	returnCode = execCode(execFunc, _context);
 
 	//listener->stateChanged(ExecState::Finished);
 	// if (g_stats)
@@ -238,13 +826,248 @@ ReturnCode JIT::exec(ExecutionContext& _context, JITSchedule const& _schedule)
 	return returnCode;
 }
 
+CodeHandle JIT::registerCode(byte const* _code, uint64_t _codeSize, h256 const& _codeHash, JITSchedule const& _schedule)
+{
+	CodeHandle handle;
+	handle.m_state = std::make_shared<CodeHandle::State>();
+	auto& state = *handle.m_state;
+	state.code.assign(_code, _code + _codeSize);
+	state.codeIdentifier = _schedule.codeIdentifier(_codeHash);
+	state.schedule = _schedule;
+	auto& jit = JITImpl::instance();
+	state.isFinal = !jit.isTieringEnabled();
+	state.evictions = jit.evictions();
+	state.execFunc = jit.getExecFunc(state.codeIdentifier);
+	if (state.execFunc)
+		state.execFunc = state.setTierUp(jit, state.execFunc);
+	return handle;
+}
+
+void JIT::compile(CodeHandle const& _code)
+{
+	assert(_code);
+	_code.m_state->compile();
+}
+
+void JIT::prefetch(CodeHandle const& _code, unsigned _deadlineMs)
+{
+	assert(_code);
+	auto& state = *_code.m_state;
+	if (!state.execFunc.load(std::memory_order_acquire))
+		prefetch(state.code.data(), state.code.size(), state.codeIdentifier, state.schedule, _deadlineMs);
+}
+
+ReturnCode JIT::prepare(CodeHandle const& _code, Tracer const* _tracer)
+{
+	assert(_code);
+	auto returnCode = ReturnCode::Stop;
+	_code.m_state->resolve(_tracer, false, returnCode);
+	return returnCode;
+}
+
+ReturnCode JIT::exec(ExecutionContext& _context, CodeHandle const& _code)
+{
+	assert(_code);
+	ReturnCode returnCode;
+	auto execFunc = _code.m_state->resolve(_context.tracer(), true, returnCode);
+	if (!execFunc)
+		return returnCode;
+	return execCode(execFunc, _context);
+}
+
+
+/// Bump allocated storage for logs created in buffered logs mode.
+class LogBuffer
+{
+public:
+	void append(byte const* _data, uint64_t _dataSize, h256 const* const* _topics)
+	{
+		uint64_t numTopics = 0;
+		while (numTopics < 4 && _topics[numTopics])
+			++numTopics;
+
+		auto topics = reinterpret_cast<h256*>(allocate(numTopics * sizeof(h256)));
+		for (uint64_t i = 0; i < numTopics; ++i)
+			topics[i] = *_topics[i];
+
+		auto data = allocate(_dataSize);
+		if (_dataSize)
+			std::memcpy(data, _data, _dataSize);
+
+		m_entries.push_back({data, _dataSize, topics, numTopics});
+	}
+
+	/// Copies entries of another buffer, e.g. of a nested call
+	void append(LogBuffer const& _other)
+	{
+		for (auto&& entry : _other.m_entries)
+		{
+			h256 const* topics[4] = {};
+			for (uint64_t i = 0; i < entry.numTopics; ++i)
+				topics[i] = &entry.topics[i];
+			append(entry.data, entry.dataSize, topics);
+		}
+	}
+
+	logs_ref get() const { return logs_ref{m_entries.data(), m_entries.size()}; }
+
+	void clear()
+	{
+		m_entries.clear();
+		m_chunkIdx = 0;
+		m_chunkOffset = 0;
+	}
+
+private:
+	static const size_t c_chunkSize = 4096;
+
+	struct Chunk
+	{
+		std::unique_ptr<byte[]> data;
+		size_t size;
+	};
+
+	byte* allocate(size_t _size)
+	{
+		_size = (_size + 7) & ~size_t(7); // Keep 8-byte alignment for topics
+		while (m_chunkIdx < m_chunks.size())
+		{
+			auto& chunk = m_chunks[m_chunkIdx];
+			if (m_chunkOffset + _size <= chunk.size)
+			{
+				auto p = chunk.data.get() + m_chunkOffset;
+				m_chunkOffset += _size;
+				return p;
+			}
+			++m_chunkIdx;
+			m_chunkOffset = 0;
+		}
+
+		auto chunkSize = std::max(c_chunkSize, _size);
+		m_chunks.push_back({std::unique_ptr<byte[]>{new byte[chunkSize]}, chunkSize});
+		m_chunkIdx = m_chunks.size() - 1;
+		m_chunkOffset = _size;
+		return m_chunks.back().data.get();
+	}
+
+	std::vector<LogEntry> m_entries;
+	std::vector<Chunk> m_chunks;
+	size_t m_chunkIdx = 0;
+	size_t m_chunkOffset = 0;
+};
+
+bool JIT::runCompileServer(std::string const& _socketPath)
+{
+	auto& jit = JITImpl::instance();
+	return CompileServer::serve(_socketPath, [&jit](CompileRequest const& _request, std::string& o_object)
+	{
+		return jit.compileObject(_request, o_object);
+	});
+}
+
+bool JIT::runCacheServer(std::string const& _address)
+{
+	return RemoteStorage::serve(_address);
+}
+
+bool JIT::evictCode(std::string const& _codeIdentifier)
+{
+	return JITImpl::instance().evict(_codeIdentifier);
+}
+
+bool JIT::findCodeLocation(void const* _addr, CodeLocation& o_location)
+{
+	return PCMap::instance().find(reinterpret_cast<uint64_t>(_addr), o_location);
+}
 
 extern "C" void ext_free(void* _data) noexcept;
 
+extern "C" EVMJIT_API void ext_log(LogBuffer* _logBuffer, byte const* _data, uint64_t _dataSize, h256 const* _topic1, h256 const* _topic2, h256 const* _topic3, h256 const* _topic4) noexcept
+{
+	h256 const* topics[] = {_topic1, _topic2, _topic3, _topic4};
+	_logBuffer->append(_data, _dataSize, topics);
+}
+
+/// Executes a nested call directly using host's CallHooks.
+/// The callee's code is compiled before the host changes any state, so code that
+/// cannot be compiled is executed through env_call (e.g. by an interpreter).
+/// A cancelled callee ends with a failed call, the caller checks the cancel flag after the call.
+/// @returns 1 if the call succeeded, 0 if it failed and -1 if the call must be done with env_call.
+extern "C" EVMJIT_API int32_t ext_call(ExecutionContext* _context, int64_t* io_gas, int64_t _callGas, h256 const* _senderAddress, h256 const* _receiveAddress, h256 const* _codeAddress, i256 const* _valueTransfer, i256 const* _apparentValue, byte const* _inData, uint64_t _inSize, byte* _outData, uint64_t _outSize) noexcept
+{
+	auto hooks = _context->callHooks();
+	assert(hooks && hooks->code);
+
+	auto code = hooks->code(_context->env(), _codeAddress);
+	if (!code || !*code || JIT::prepare(*code, _context->tracer()) != ReturnCode::Stop)
+		return -1;
+
+	CallParams params{_callGas, _senderAddress, _receiveAddress, _codeAddress, _valueTransfer, _apparentValue, _inData, _inSize};
+	RuntimeData calleeData;
+	Env* calleeEnv = nullptr;
+	if (!hooks->enter(_context->env(), io_gas, params, calleeData, calleeEnv))
+		return -1;
+
+	ExecutionContext callee{calleeData, calleeEnv};
+	callee.setCallHooks(hooks);
+	callee.setTracer(_context->tracer());
+	callee.setCancelFlag(_context->cancelFlag());
+	if (_context->hasBufferedLogs())
+		callee.enableBufferedLogs();
+
+	auto returnCode = JIT::exec(callee, *code);
+	if (returnCode == ReturnCode::Return)
+	{
+		auto size = std::min<uint64_t>(std::get<1>(callee.returnData), _outSize);
+		if (size)
+			std::memcpy(_outData, std::get<0>(callee.returnData), size);
+	}
+	if (static_cast<int>(returnCode) >= 0)
+		_context->appendLogs(callee);	// Logs of a failed call are already discarded
+
+	hooks->leave(_context->env(), io_gas, callee, calleeEnv, returnCode);
+	return static_cast<int>(returnCode) >= 0 ? 1 : 0;
+}
+
+static_assert(sizeof(std::atomic<bool>) == 1, "Compiled code expects cancel flag to be a single byte");
+
+extern "C" EVMJIT_API void ext_trace(ExecutionContext* _context, uint64_t _pc, byte _opcode, int64_t _gas, i256 const* _stack, uint64_t _stackSize) noexcept
+{
+	auto tracer = _context->tracer();
+	assert(tracer && tracer->step);
+	tracer->step(_context->env(), _pc, _opcode, _gas, _stack, _stackSize);
+}
+
 ExecutionContext::~ExecutionContext() noexcept
 {
 	if (m_memData)
 		ext_free(m_memData); // Use helper free to check memory leaks
+	delete m_logBuffer;
+}
+
+void ExecutionContext::enableBufferedLogs()
+{
+	if (!m_logBuffer)
+		m_logBuffer = new LogBuffer;
+}
+
+logs_ref ExecutionContext::getLogs() const
+{
+	if (!m_logBuffer)
+		return {};
+	return m_logBuffer->get();
+}
+
+void ExecutionContext::clearLogs()
+{
+	if (m_logBuffer)
+		m_logBuffer->clear();
+}
+
+void ExecutionContext::appendLogs(ExecutionContext const& _nested)
+{
+	if (m_logBuffer && _nested.m_logBuffer)
+		m_logBuffer->append(*_nested.m_logBuffer);
 }
 
 bytes_ref ExecutionContext::getReturnData() const
@@ -262,6 +1085,41 @@ bytes_ref ExecutionContext::getReturnData() const
 	return bytes_ref{data, size};
 }
 
+ReturnData ExecutionContext::takeReturnData()
+{
+	if (!std::get<0>(returnData))
+		return {};	// Not ended with RETURN or nothing returned
+
+	ReturnData ret{m_memData, std::get<0>(returnData), std::get<1>(returnData)};
+	m_memData = nullptr;
+	m_memSize = 0;
+	m_memCap = 0;
+	returnData = {};
+	return ret;
+}
+
+ReturnData& ReturnData::operator=(ReturnData&& _other) noexcept
+{
+	if (this != &_other)
+	{
+		if (m_memory)
+			ext_free(m_memory);
+		m_memory = _other.m_memory;
+		m_data = _other.m_data;
+		m_size = _other.m_size;
+		_other.m_memory = nullptr;
+		_other.m_data = nullptr;
+		_other.m_size = 0;
+	}
+	return *this;
+}
+
+ReturnData::~ReturnData() noexcept
+{
+	if (m_memory)
+		ext_free(m_memory);
+}
+
 int64_t JITSchedule::id() const
 {
 	int64_t hash = 0;
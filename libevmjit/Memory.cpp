@@ -69,9 +69,47 @@ llvm::Function* Memory::getRequireFunc()
 
 		m_builder.CreateCondBr(sizeOk, returnBB, resizeBB, Type::expectTrue);
 
-		// BB "Resize"
+		// BB "Resize": out of line, only the size check is inlined into the callers
 		m_builder.SetInsertPoint(resizeBB);
+		auto costOk = m_builder.CreateAnd(blkOffsetOk, blkSizeOk, "costOk");
+		m_builder.CreateCall(getResizeFunc(), {mem, sizeReq, costOk, jmpBuf, gas});
+		m_builder.CreateBr(returnBB);
+
+		// BB "Return"
+		m_builder.SetInsertPoint(returnBB);
+		m_builder.CreateRetVoid();
+	}
+	return func;
+}
+
+llvm::Function* Memory::getResizeFunc()
+{
+	auto& func = m_resize;
+	if (!func)
+	{
+		llvm::Type* argTypes[] = {Array::getType()->getPointerTo(), Type::Size, Type::Bool, Type::BytePtr, Type::GasPtr};
+		func = llvm::Function::Create(llvm::FunctionType::get(Type::Void, argTypes, false), llvm::Function::PrivateLinkage, "mem.resize", getModule());
+		func->setDoesNotThrow();
+		func->addFnAttr(llvm::Attribute::Cold);
+		func->addFnAttr(llvm::Attribute::NoInline);
+
+		auto iter = func->arg_begin();
+		llvm::Argument* mem = &(*iter++);
+		mem->setName("mem");
+		llvm::Argument* sizeReq = &(*iter++);
+		sizeReq->setName("sizeReq");
+		llvm::Argument* costOk = &(*iter++);
+		costOk->setName("costOk");
+		llvm::Argument* jmpBuf = &(*iter++);
+		jmpBuf->setName("jmpBuf");
+		llvm::Argument* gas = &(*iter);
+		gas->setName("gas");
+
+		InsertPointGuard guard(m_builder); // Restores insert point at function exit
+
+		m_builder.SetInsertPoint(llvm::BasicBlock::Create(func->getContext(), {}, func));
 		// Check gas first
+		auto sizeCur = m_memory.size(mem);
 		auto w1 = m_builder.CreateLShr(sizeReq, 5);
 		auto w1s = m_builder.CreateNUWMul(w1, w1);
 		auto c1 = m_builder.CreateAdd(m_builder.CreateNUWMul(w1, m_builder.getInt64(3)), m_builder.CreateLShr(w1s, 9));
@@ -79,15 +117,10 @@ llvm::Function* Memory::getRequireFunc()
 		auto w0s = m_builder.CreateNUWMul(w0, w0);
 		auto c0 = m_builder.CreateAdd(m_builder.CreateNUWMul(w0, m_builder.getInt64(3)), m_builder.CreateLShr(w0s, 9));
 		auto cc = m_builder.CreateNUWSub(c1, c0);
-		auto costOk = m_builder.CreateAnd(blkOffsetOk, blkSizeOk, "costOk");
 		auto c = m_builder.CreateSelect(costOk, cc, m_builder.getInt64(std::numeric_limits<int64_t>::max()), "c");
 		m_gasMeter.count(c, jmpBuf, gas);
 		// Resize
 		m_memory.extend(mem, sizeReq);
-		m_builder.CreateBr(returnBB);
-
-		// BB "Return"
-		m_builder.SetInsertPoint(returnBB);
 		m_builder.CreateRetVoid();
 	}
 	return func;
@@ -120,13 +153,13 @@ llvm::Function* Memory::createFunc(bool _isStore, llvm::Type* _valueType)
 		auto value = isWord ? Endianness::toBE(m_builder, valueArg) : valueArg;
 		auto memPtr = m_memory.getPtr(mem, m_builder.CreateTrunc(index, Type::Size));
 		auto valuePtr = m_builder.CreateBitCast(memPtr, _valueType->getPointerTo(), "valuePtr");
-		m_builder.CreateStore(value, valuePtr);
+		tagAccess(m_builder.CreateStore(value, valuePtr), Type::tbaaMemory);
 		m_builder.CreateRetVoid();
 	}
 	else
 	{
 		auto memPtr = m_memory.getPtr(mem, m_builder.CreateTrunc(index, Type::Size));
-		llvm::Value* ret = m_builder.CreateLoad(memPtr);
+		llvm::Value* ret = tagAccess(m_builder.CreateLoad(memPtr), Type::tbaaMemory);
 		ret = Endianness::toNative(m_builder, ret);
 		m_builder.CreateRet(ret);
 	}
@@ -181,7 +214,7 @@ void Memory::storeByte(llvm::Value* _addr, llvm::Value* _word)
 llvm::Value* Memory::getData()
 {
 	auto memPtr = m_builder.CreateBitCast(getRuntimeManager().getMem(), Type::BytePtr->getPointerTo());
-	auto data = m_builder.CreateLoad(memPtr, "data");
+	auto data = tagAccess(m_builder.CreateLoad(memPtr, "data"), Type::tbaaRuntime);
 	assert(data->getType() == Type::BytePtr);
 	return data;
 }
@@ -35,11 +35,13 @@ private:
 	llvm::Function* createFunc(bool _isStore, llvm::Type* _type);
 
 	llvm::Function* getRequireFunc();
+	llvm::Function* getResizeFunc();
 	llvm::Function* getLoadWordFunc();
 	llvm::Function* getStoreWordFunc();
 	llvm::Function* getStoreByteFunc();
 
 	llvm::Function* m_require = nullptr;
+	llvm::Function* m_resize = nullptr;
 	llvm::Function* m_loadWord = nullptr;
 	llvm::Function* m_storeWord = nullptr;
 	llvm::Function* m_storeByte = nullptr;
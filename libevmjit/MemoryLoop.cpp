@@ -0,0 +1,321 @@
+#include "MemoryLoop.h"
+
+#include <algorithm>
+
+#include "GasMeter.h"
+#include "Instruction.h"
+
+namespace dev
+{
+namespace eth
+{
+namespace jit
+{
+
+llvm::APInt MemoryLoop::step(int _index) const
+{
+	auto it = steps.find(_index);
+	return it != steps.end() ? it->second : llvm::APInt{256, 0};
+}
+
+namespace
+{
+
+/// Symbolic value of a stack item in a loop iteration
+struct Value
+{
+	enum class Kind
+	{
+		Term,	///< Stack item at the loop head plus constant
+		Loaded,	///< Word loaded from memory at address `term`
+		Less	///< Result of comparison term < rhs (negated if `negated`)
+	};
+
+	Kind kind = Kind::Term;
+	MemoryLoop::Term term;
+	MemoryLoop::Term rhs;
+	bool negated = false;
+
+	bool isConstant() const { return kind == Kind::Term && term.index < 0; }
+};
+
+/// Symbolically executes one iteration of a loop starting at the head block.
+/// The iteration continues in the block following the exit condition JUMPI
+/// if _continueOnJump is false, otherwise in the JUMPI destination.
+bool analyzeIteration(std::vector<BasicBlock> const& _blocks, std::unordered_map<instr_idx, size_t> const& _blockIndex,
+					  size_t _head, bool _continueOnJump, MemoryLoop& o_loop)
+{
+	static const size_t c_maxBlocks = 4;
+	static const size_t c_inputItems = 64;
+
+	std::vector<Value> stack(c_inputItems);
+	for (size_t i = 0; i < c_inputItems; ++i)
+		stack[i].term.index = static_cast<int>(c_inputItems - 1 - i);
+	auto minSize = stack.size();
+	auto maxSize = stack.size();
+
+	auto pop = [&](Value& o_value)
+	{
+		if (stack.empty())
+			return false;
+		o_value = stack.back();
+		stack.pop_back();
+		minSize = std::min(minSize, stack.size());
+		return true;
+	};
+
+	auto push = [&](Value const& _value)
+	{
+		stack.push_back(_value);
+		maxSize = std::max(maxSize, stack.size());
+	};
+
+	auto findBlock = [&](Value const& _dest, size_t& o_idx)
+	{
+		if (!_dest.isConstant() || _dest.term.offset.getActiveBits() > 64)
+			return false;
+		auto it = _blockIndex.find(_dest.term.offset.getZExtValue());
+		if (it == _blockIndex.end())
+			return false;
+		auto& block = _blocks[it->second];
+		if (block.begin() == block.end() || Instruction(*block.begin()) != Instruction::JUMPDEST)
+			return false;	// invalid jump destination
+		o_idx = it->second;
+		return true;
+	};
+
+	bool hasExit = false;
+	bool hasLoad = false;
+	bool hasStore = false;
+	o_loop = {};
+
+	auto idx = _head;
+	do
+	{
+		if (o_loop.blocks.size() == c_maxBlocks || std::find(o_loop.blocks.begin(), o_loop.blocks.end(), idx) != o_loop.blocks.end())
+			return false;
+		o_loop.blocks.push_back(idx);
+
+		auto& block = _blocks[idx];
+		auto isFallthroughValid = idx + 1 < _blocks.size() && _blocks[idx + 1].begin() == block.end();
+		auto next = idx + 1;
+		auto isJump = false;
+
+		for (auto it = block.begin(); it != block.end(); ++it)
+		{
+			auto inst = Instruction(*it);
+			o_loop.iterationGas += GasMeter::getStepCost(inst);
+			Value a, b;
+
+			switch (inst)
+			{
+			case Instruction::JUMPDEST:
+				break;
+
+			case Instruction::ANY_PUSH:
+			{
+				Value value;
+				value.term.offset = readPushData(it, block.end());
+				push(value);
+				break;
+			}
+
+			case Instruction::ANY_DUP:
+			{
+				auto n = static_cast<size_t>(inst) - static_cast<size_t>(Instruction::DUP1) + 1;
+				if (stack.size() < n)
+					return false;
+				minSize = std::min(minSize, stack.size() - n);
+				push(stack[stack.size() - n]);
+				break;
+			}
+
+			case Instruction::ANY_SWAP:
+			{
+				auto n = static_cast<size_t>(inst) - static_cast<size_t>(Instruction::SWAP1) + 1;
+				if (stack.size() < n + 1)
+					return false;
+				minSize = std::min(minSize, stack.size() - n - 1);
+				std::swap(stack.back(), stack[stack.size() - n - 1]);
+				break;
+			}
+
+			case Instruction::POP:
+				if (!pop(a))
+					return false;
+				break;
+
+			case Instruction::ADD:
+				if (!pop(a) || !pop(b) || a.kind != Value::Kind::Term || b.kind != Value::Kind::Term)
+					return false;
+				if (a.term.index >= 0 && b.term.index >= 0)
+					return false;	// not affine
+				a.term.index = std::max(a.term.index, b.term.index);
+				a.term.offset += b.term.offset;
+				push(a);
+				break;
+
+			case Instruction::SUB:
+				if (!pop(a) || !pop(b) || a.kind != Value::Kind::Term || !b.isConstant())
+					return false;
+				a.term.offset -= b.term.offset;
+				push(a);
+				break;
+
+			case Instruction::NOT:
+				if (!pop(a) || !a.isConstant())
+					return false;
+				a.term.offset.flipAllBits();
+				push(a);
+				break;
+
+			case Instruction::LT:
+			case Instruction::GT:
+			{
+				if (!pop(a) || !pop(b) || a.kind != Value::Kind::Term || b.kind != Value::Kind::Term)
+					return false;
+				if (inst == Instruction::GT)
+					std::swap(a, b);
+				Value res;
+				res.kind = Value::Kind::Less;
+				res.term = a.term;
+				res.rhs = b.term;
+				push(res);
+				break;
+			}
+
+			case Instruction::ISZERO:
+				if (!pop(a))
+					return false;
+				if (a.kind == Value::Kind::Less)
+					a.negated = !a.negated;
+				else if (a.isConstant())
+					a.term.offset = llvm::APInt{256, a.term.offset == 0 ? 1u : 0u};
+				else
+					return false;
+				push(a);
+				break;
+
+			case Instruction::MLOAD:
+				if (hasLoad || !pop(a) || a.kind != Value::Kind::Term || a.term.index < 0)
+					return false;
+				hasLoad = true;
+				a.kind = Value::Kind::Loaded;
+				push(a);
+				break;
+
+			case Instruction::MSTORE:
+				if (hasStore || !pop(a) || !pop(b) || a.kind != Value::Kind::Term || a.term.index < 0)
+					return false;
+				hasStore = true;
+				o_loop.dst = a.term;
+				if (b.kind == Value::Kind::Loaded)
+				{
+					o_loop.isCopy = true;
+					o_loop.src = b.term;
+				}
+				else if (!b.isConstant() || b.term.offset != 0)
+					return false;
+				break;
+
+			case Instruction::JUMP:
+				if (!pop(a) || !findBlock(a, next))
+					return false;
+				isJump = true;
+				break;
+
+			case Instruction::JUMPI:
+			{
+				// The exit condition must be checked in the head block before any memory access
+				if (idx != _head || hasExit || hasLoad || hasStore)
+					return false;
+				size_t dest = 0;
+				if (!pop(a) || !findBlock(a, dest) || !pop(b) || b.kind != Value::Kind::Less || !isFallthroughValid)
+					return false;
+				hasExit = true;
+				o_loop.lhs = b.term;
+				o_loop.rhs = b.rhs;
+				// Jump is taken if lhs < rhs (xor negated)
+				o_loop.continueIfLess = b.negated != _continueOnJump;
+				if (_continueOnJump)
+				{
+					next = dest;
+					isJump = true;
+				}
+				break;
+			}
+
+			default:
+				return false;
+			}
+		}
+
+		if (!isJump && !isFallthroughValid)
+			return false;
+		idx = next;
+	}
+	while (idx != _head);
+
+	if (!hasExit || !hasStore || stack.size() != c_inputItems)
+		return false;
+
+	// A loaded value must be the stored one. A discarded load still expands
+	// memory, which the zero-fill replacement would not do.
+	if (hasLoad && !o_loop.isCopy)
+		return false;
+
+	// Each stack item must be loop invariant or an induction variable
+	for (auto i = minSize; i < stack.size(); ++i)
+	{
+		auto& value = stack[i];
+		auto index = static_cast<int>(c_inputItems - 1 - i);
+		if (value.kind != Value::Kind::Term || value.term.index != index)
+			return false;
+		if (value.term.offset != 0)
+			o_loop.steps.emplace(index, value.term.offset);
+	}
+
+	auto const wordSize = llvm::APInt{256, 32};
+	if (o_loop.step(o_loop.dst.index) != wordSize || (o_loop.isCopy && o_loop.step(o_loop.src.index) != wordSize))
+		return false;
+
+	// Exactly one side of the condition changes, in the direction that ends the loop
+	auto lhsStep = o_loop.lhs.index >= 0 ? o_loop.step(o_loop.lhs.index) : llvm::APInt{256, 0};
+	auto rhsStep = o_loop.rhs.index >= 0 ? o_loop.step(o_loop.rhs.index) : llvm::APInt{256, 0};
+	if ((lhsStep == 0) == (rhsStep == 0))
+		return false;
+	auto isLhsCounter = lhsStep != 0;
+	auto isIncreasing = !(isLhsCounter ? lhsStep : rhsStep).isNegative();
+	if (isIncreasing != (isLhsCounter == o_loop.continueIfLess))
+		return false;
+
+	o_loop.stackDepth = c_inputItems - minSize;
+	o_loop.stackGrowth = maxSize - c_inputItems;
+	return true;
+}
+
+}
+
+std::unordered_map<instr_idx, MemoryLoop> findMemoryLoops(std::vector<BasicBlock> const& _blocks)
+{
+	std::unordered_map<instr_idx, size_t> blockIndex;
+	for (size_t i = 0; i < _blocks.size(); ++i)
+		blockIndex.emplace(_blocks[i].firstInstrIdx(), i);
+
+	std::unordered_map<instr_idx, MemoryLoop> loops;
+	for (size_t i = 0; i < _blocks.size(); ++i)
+	{
+		auto& block = _blocks[i];
+		if (block.begin() == block.end() || Instruction(*block.begin()) != Instruction::JUMPDEST)
+			continue;
+
+		MemoryLoop loop;
+		if (analyzeIteration(_blocks, blockIndex, i, false, loop) || analyzeIteration(_blocks, blockIndex, i, true, loop))
+			loops.emplace(block.firstInstrIdx(), std::move(loop));
+	}
+	return loops;
+}
+
+}
+}
+}
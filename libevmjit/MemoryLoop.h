@@ -0,0 +1,55 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/ADT/APInt.h>
+#include "preprocessor/llvm_includes_end.h"
+
+#include "BasicBlock.h"
+
+namespace dev
+{
+namespace eth
+{
+namespace jit
+{
+
+/// Loop in EVM code that copies memory or fills it with zeros word by word, e.g.
+///   for (; len >= 32; len -= 32, dst += 32, src += 32) mstore(dst, mload(src))
+/// Values are expressed in terms of stack items at the loop head (index 0 is the stack top).
+struct MemoryLoop
+{
+	/// Stack item plus constant offset. Index -1 means the offset alone.
+	struct Term
+	{
+		int index = -1;
+		llvm::APInt offset{256, 0};
+	};
+
+	bool isCopy = false;	///< Copy loop, otherwise zero-fill loop
+	Term dst;				///< Destination address in the first iteration
+	Term src;				///< Source address in the first iteration (copy loop only)
+
+	/// Loop continues while lhs < rhs (or lhs >= rhs if false). One side is the loop counter.
+	Term lhs;
+	Term rhs;
+	bool continueIfLess = false;
+
+	std::unordered_map<int, llvm::APInt> steps;	///< Changes of stack items per iteration
+	int64_t iterationGas = 0;					///< Static gas cost of an iteration
+	size_t stackDepth = 0;						///< Number of stack items accessed by the loop
+	size_t stackGrowth = 0;						///< Maximum stack growth within an iteration
+	std::vector<size_t> blocks;					///< Basic blocks of an iteration, the first one is the loop head
+
+	llvm::APInt step(int _index) const;
+};
+
+/// Finds memory copy and zero-fill loops.
+/// @returns loops indexed by the first instruction index of the loop head block
+std::unordered_map<instr_idx, MemoryLoop> findMemoryLoops(std::vector<BasicBlock> const& _blocks);
+
+}
+}
+}
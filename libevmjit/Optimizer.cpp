@@ -1,10 +1,18 @@
 #include "Optimizer.h"
 
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "preprocessor/llvm_includes_start.h"
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Analysis/Passes.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
@@ -69,17 +77,197 @@ bool LongJmpEliminationPass::runOnFunction(llvm::Function& _func)
 	return modified;
 }
 
+/// Cancels byte swaps of words passed through EVM memory:
+/// store(bswap(x), p) ... bswap(load(p)) -> x.
+/// EVM memory is big-endian, so a word stored by MSTORE and loaded back
+/// by MLOAD is byte-swapped twice.
+class BSwapPairEliminationPass: public llvm::FunctionPass
+{
+	static char ID;
+
+public:
+	BSwapPairEliminationPass():
+		llvm::FunctionPass(ID)
+	{}
+
+	virtual bool runOnFunction(llvm::Function& _func) override;
+};
+
+char BSwapPairEliminationPass::ID = 0;
+
+/// Straight-line sequence of instructions preceding an instruction.
+/// Follows single predecessors, so every instruction in the window dominates the starting one.
+class InstWindow
+{
+public:
+	static const size_t maxSize = 256;
+
+	explicit InstWindow(llvm::Instruction* _start)
+	{
+		std::unordered_set<llvm::BasicBlock*> visited;
+		auto bb = _start->getParent();
+		auto inst = _start->getPrevNode();
+		visited.insert(bb);
+		while (m_insts.size() < maxSize)
+		{
+			if (!inst)
+			{
+				bb = bb->getSinglePredecessor();
+				if (!bb || !visited.insert(bb).second)
+					break;
+				inst = bb->getTerminator();
+			}
+			m_pos[inst] = m_insts.size();
+			m_insts.push_back(inst);
+			if (inst->mayWriteToMemory())
+				m_writes.push_back(inst);
+			inst = inst->getPrevNode();
+		}
+	}
+
+	/// Instructions in reverse order: the first one is the nearest to the starting instruction
+	std::vector<llvm::Instruction*> const& insts() const { return m_insts; }
+
+	/// Checks if values are known to be equal at the starting instruction
+	bool isEquivalent(llvm::Value* _a, llvm::Value* _b, unsigned _depth = 0) const
+	{
+		_a = _a->stripPointerCasts();
+		_b = _b->stripPointerCasts();
+		if (_a == _b)
+			return true;
+
+		auto a = llvm::dyn_cast<llvm::Instruction>(_a);
+		auto b = llvm::dyn_cast<llvm::Instruction>(_b);
+		if (!a || !b || _depth >= c_maxDepth || !a->isSameOperationAs(b))
+			return false;
+
+		if (auto loadA = llvm::dyn_cast<llvm::LoadInst>(a))
+		{
+			if (loadA->isVolatile() || !isStableBetween(loadA, llvm::cast<llvm::LoadInst>(b)))
+				return false;
+		}
+		else if (a->mayReadOrWriteMemory() || llvm::isa<llvm::PHINode>(a) || llvm::isa<llvm::TerminatorInst>(a))
+			return false;
+
+		for (unsigned i = 0; i < a->getNumOperands(); ++i)
+			if (!isEquivalent(a->getOperand(i), b->getOperand(i), _depth + 1))
+				return false;
+		return true;
+	}
+
+private:
+	static const unsigned c_maxDepth = 8;
+
+	/// Checks if memory cannot change between two loads in the window.
+	/// Word stores only write to EVM memory and stack, so they do not affect loads of other types.
+	bool isStableBetween(llvm::LoadInst* _a, llvm::LoadInst* _b) const
+	{
+		auto itA = m_pos.find(_a);
+		auto itB = m_pos.find(_b);
+		if (itA == m_pos.end() || itB == m_pos.end())
+			return false;
+
+		auto begin = std::min(itA->second, itB->second);
+		auto end = std::max(itA->second, itB->second);
+		auto isWordLoad = _a->getType() == Type::Word;
+		for (auto write : m_writes)
+		{
+			auto pos = m_pos.find(write)->second;
+			if (pos <= begin || pos >= end)
+				continue;
+			auto store = llvm::dyn_cast<llvm::StoreInst>(write);
+			if (isWordLoad || !store || store->getValueOperand()->getType() != Type::Word)
+				return false;
+		}
+		return true;
+	}
+
+	std::vector<llvm::Instruction*> m_insts;
+	std::vector<llvm::Instruction*> m_writes;
+	std::unordered_map<llvm::Instruction*, size_t> m_pos;
+};
+
+llvm::Value* getBSwapArg(llvm::Value* _value)
+{
+	if (auto intrinsic = llvm::dyn_cast<llvm::IntrinsicInst>(_value))
+		if (intrinsic->getIntrinsicID() == llvm::Intrinsic::bswap && intrinsic->getType() == Type::Word)
+			return intrinsic->getArgOperand(0);
+	return nullptr;
+}
+
+/// Finds the value stored to the address of _load by a store preceding it without any clobbering writes
+llvm::Value* findStoredValue(llvm::LoadInst* _load)
+{
+	InstWindow window{_load};
+	for (auto inst : window.insts())
+	{
+		if (auto store = llvm::dyn_cast<llvm::StoreInst>(inst))
+		{
+			if (!store->isVolatile() && store->getValueOperand()->getType() == _load->getType() &&
+				window.isEquivalent(store->getPointerOperand(), _load->getPointerOperand()))
+				return store->getValueOperand();
+			return nullptr;	// may alias
+		}
+		if (inst->mayWriteToMemory())
+			return nullptr;
+	}
+	return nullptr;
+}
+
+bool BSwapPairEliminationPass::runOnFunction(llvm::Function& _func)
+{
+	std::unordered_map<llvm::Value*, llvm::Value*> replacements;
+	for (auto& bb : _func)
+	{
+		for (auto& inst : bb)
+		{
+			auto load = llvm::dyn_cast_or_null<llvm::LoadInst>(getBSwapArg(&inst));
+			if (!load || load->isVolatile())
+				continue;
+
+			auto stored = findStoredValue(load);
+			if (!stored)
+				continue;
+
+			if (auto constant = llvm::dyn_cast<llvm::ConstantInt>(stored))
+				replacements[&inst] = llvm::ConstantInt::get(_func.getContext(), constant->getValue().byteSwap());
+			else if (auto original = getBSwapArg(stored))
+				replacements[&inst] = original;
+		}
+	}
+
+	for (auto& r : replacements)
+	{
+		// Replacement can be a swap that is also being replaced
+		auto value = r.second;
+		for (auto it = replacements.find(value); it != replacements.end(); it = replacements.find(value))
+			value = it->second;
+		r.first->replaceAllUsesWith(value);	// dead swaps are removed by DCE
+	}
+	return !replacements.empty();
+}
+
 }
 
 bool optimize(llvm::Module& _module)
 {
 	auto pm = llvm::legacy::PassManager{};
+	pm.add(llvm::createBasicAliasAnalysisPass());		// Default is no alias analysis at all
+	pm.add(llvm::createTypeBasedAliasAnalysisPass());	// EVM stack, memory and runtime structures are disjoint
 	pm.add(llvm::createFunctionInliningPass(2, 2));
 	pm.add(new LongJmpEliminationPass{}); 				// TODO: Takes a lot of time with little effect
 	pm.add(llvm::createCFGSimplificationPass());
+	pm.add(llvm::createSROAPass());						// Promotes gas and stack size counters to registers
+	pm.add(llvm::createEarlyCSEPass());					// Cheap: merges runtime data and memory pointer loads within blocks
 	pm.add(llvm::createInstructionCombiningPass());
+	pm.add(new BSwapPairEliminationPass{});
+	pm.add(llvm::createGVNPass());						// Forwards stack items and memory words across blocks
+	pm.add(llvm::createDeadStoreEliminationPass());		// Removes stack item stores overwritten in the next block
+	pm.add(llvm::createCFGSimplificationPass());
 	pm.add(llvm::createAggressiveDCEPass());
 	pm.add(llvm::createLowerSwitchPass());
+	// Loop passes (LICM, loop rotation) are not used: EVM loops go through the jump table,
+	// so there are hardly any natural loops to optimize.
 	return pm.run(_module);
 }
 
@@ -166,6 +354,118 @@ bool LowerEVMPass::doFinalization(llvm::Module&)
 	return false;
 }
 
+/// Moves blocks of error paths (out of gas, out of stack, bad jump destination, cancellation)
+/// and memory resizing after the hot code, so the fast paths are packed densely in instruction cache.
+class ColdBlockLayoutPass: public llvm::FunctionPass
+{
+	static char ID;
+
+public:
+	ColdBlockLayoutPass():
+		llvm::FunctionPass(ID)
+	{}
+
+	virtual bool runOnFunction(llvm::Function& _func) override;
+};
+
+char ColdBlockLayoutPass::ID = 0;
+
+/// Checks if the edge has zero branch weight, see Type::expectTrue
+bool isUnlikelyEdge(llvm::TerminatorInst const* _term, unsigned _succIdx)
+{
+	auto weights = _term->getMetadata(llvm::LLVMContext::MD_prof);
+	if (!weights || weights->getNumOperands() != _term->getNumSuccessors() + 1)
+		return false;
+	auto weight = llvm::mdconst::dyn_extract<llvm::ConstantInt>(weights->getOperand(_succIdx + 1));
+	return weight && weight->isZero();
+}
+
+/// Checks if the block is known to be rarely executed: it aborts (possibly already
+/// converted to a branch to the exit block), exits with an error code or calls a cold function
+bool isRarelyExecuted(llvm::BasicBlock const& _bb)
+{
+	auto term = _bb.getTerminator();
+	if (llvm::isa<llvm::UnreachableInst>(term))
+		return true;
+
+	for (auto& inst : _bb)
+		if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+			if (auto func = call->getCalledFunction())
+				if (func->hasFnAttribute(llvm::Attribute::Cold))
+					return true;
+
+	auto br = llvm::dyn_cast<llvm::BranchInst>(term);
+	if (!br || br->isConditional())
+		return false;
+	auto phi = llvm::dyn_cast<llvm::PHINode>(&br->getSuccessor(0)->front());
+	if (!phi || phi->getBasicBlockIndex(&_bb) < 0)
+		return false;
+	auto code = llvm::dyn_cast<llvm::ConstantInt>(phi->getIncomingValueForBlock(&_bb));
+	return code && code->getType() == Type::MainReturn && code->isNegative();
+}
+
+bool ColdBlockLayoutPass::runOnFunction(llvm::Function& _func)
+{
+	if (_func.empty())
+		return false;
+
+	// A block is cold if it ends with an error, all its successors are cold
+	// or it can only be reached by unlikely edges and from cold blocks
+	std::unordered_set<llvm::BasicBlock const*> cold;
+	for (auto& bb : _func)
+		if (&bb != &_func.getEntryBlock() && isRarelyExecuted(bb))
+			cold.insert(&bb);
+
+	for (auto changed = !cold.empty(); changed;)
+	{
+		changed = false;
+		for (auto& bb : _func)
+		{
+			if (&bb == &_func.getEntryBlock() || cold.count(&bb))
+				continue;
+
+			auto term = bb.getTerminator();
+			auto allSuccsCold = term->getNumSuccessors() > 0;
+			for (unsigned i = 0; i < term->getNumSuccessors() && allSuccsCold; ++i)
+				allSuccsCold = cold.count(term->getSuccessor(i)) != 0;
+
+			auto allPredsCold = llvm::pred_begin(&bb) != llvm::pred_end(&bb);
+			for (auto it = llvm::pred_begin(&bb); it != llvm::pred_end(&bb) && allPredsCold; ++it)
+			{
+				auto predTerm = (*it)->getTerminator();
+				if (cold.count(*it))
+					continue;
+				for (unsigned i = 0; i < predTerm->getNumSuccessors() && allPredsCold; ++i)
+					if (predTerm->getSuccessor(i) == &bb && !isUnlikelyEdge(predTerm, i))
+						allPredsCold = false;
+			}
+
+			if (allSuccsCold || allPredsCold)
+			{
+				cold.insert(&bb);
+				changed = true;
+			}
+		}
+	}
+
+	// Move cold blocks to the end keeping their order. The last block (the exit block of main function) stays last.
+	std::vector<llvm::BasicBlock*> coldBlocks;
+	for (auto& bb : _func)
+		if (cold.count(&bb) && &bb != &_func.back())
+			coldBlocks.push_back(&bb);
+
+	auto modified = false;
+	for (auto bb : coldBlocks)
+	{
+		auto last = &_func.back();
+		if (bb->getNextNode() == last && cold.count(last) == 0)
+			continue;
+		bb->moveBefore(last);
+		modified = true;
+	}
+	return modified;
+}
+
 }
 
 bool prepare(llvm::Module& _module)
@@ -174,6 +474,7 @@ bool prepare(llvm::Module& _module)
 	pm.add(llvm::createCFGSimplificationPass());
 	pm.add(llvm::createDeadCodeEliminationPass());
 	pm.add(new LowerEVMPass{});
+	pm.add(new ColdBlockLayoutPass{});
 	return pm.run(_module);
 }
 
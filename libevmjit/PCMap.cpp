@@ -0,0 +1,93 @@
+#include "PCMap.h"
+
+#include <algorithm>
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/DebugInfo/DWARF/DWARFContext.h>
+#include <llvm/Object/SymbolSize.h>
+#include "preprocessor/llvm_includes_end.h"
+
+#include "evmjit/JIT.h"
+#include "Utils.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+PCMap& PCMap::instance()
+{
+	static PCMap s_instance;
+	return s_instance;
+}
+
+void PCMap::NotifyObjectEmitted(llvm::object::ObjectFile const& _obj, llvm::RuntimeDyld::LoadedObjectInfo const& _info)
+{
+	auto debugObjOwner = _info.getObjectForDebug(_obj);
+	auto& debugObj = *debugObjOwner.getBinary();
+	llvm::DWARFContextInMemory context{debugObj};
+
+	for (auto&& p : llvm::object::computeSymbolSizes(debugObj))
+	{
+		auto sym = p.first;
+		if (sym.getType() != llvm::object::SymbolRef::ST_Function)
+			continue;
+
+		auto name = sym.getName();
+		auto addr = sym.getAddress();
+		if (!name || !addr)
+			continue;
+
+		Function func;
+		func.id = name->str();
+		func.end = *addr + p.second;
+		for (auto&& line : context.getLineInfoForAddressRange(*addr, p.second))
+		{
+			if (line.second.Line == 0)	// Not an EVM instruction
+				continue;
+			auto pc = uint64_t{line.second.Line} - 1;
+			auto blockPc = line.second.Column != 0 ? pc - (line.second.Column - 1) : pc;
+			if (func.ranges.empty() || func.ranges.back().pc != pc)
+				func.ranges.push_back({line.first, pc, blockPc});
+		}
+
+		if (func.ranges.empty())
+			continue;
+
+		DLOG(pcmap) << func.id << ": " << func.ranges.size() << " ranges\n";
+		std::lock_guard<std::mutex> lock{x_map};
+		m_funcs[*addr] = std::move(func);
+	}
+}
+
+bool PCMap::find(uint64_t _addr, CodeLocation& o_location) const
+{
+	std::lock_guard<std::mutex> lock{x_map};
+
+	auto funcIt = m_funcs.upper_bound(_addr);
+	if (funcIt == m_funcs.begin())
+		return false;
+	auto& func = (--funcIt)->second;
+	if (_addr >= func.end)
+		return false;
+
+	auto it = std::upper_bound(func.ranges.begin(), func.ranges.end(), _addr,
+							   [](uint64_t _a, Range const& _r) { return _a < _r.begin; });
+	if (it == func.ranges.begin())
+		return false;
+	--it;
+
+	o_location.codeIdentifier = &func.id;
+	o_location.pc = it->pc;
+	o_location.blockPc = it->blockPc;
+	return true;
+}
+
+void PCMap::remove(uint64_t _funcAddr)
+{
+	std::lock_guard<std::mutex> lock{x_map};
+	m_funcs.erase(_funcAddr);
+}
+
+}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include "preprocessor/llvm_includes_end.h"
+
+namespace dev
+{
+namespace evmjit
+{
+struct CodeLocation;
+
+/// Map of native code addresses to EVM code locations.
+/// Built from the line tables of emitted objects, where the line is EVM pc + 1
+/// and the column is the offset of the instruction in its basic block + 1.
+class PCMap : public llvm::JITEventListener
+{
+public:
+	static PCMap& instance();
+
+	void NotifyObjectEmitted(llvm::object::ObjectFile const& _obj, llvm::RuntimeDyld::LoadedObjectInfo const& _info) override;
+
+	bool find(uint64_t _addr, CodeLocation& o_location) const;
+
+	/// Unregisters the function starting at given address, e.g. when its machine code is freed
+	void remove(uint64_t _funcAddr);
+
+private:
+	struct Range
+	{
+		uint64_t begin;		///< Native address of the first instruction of the range
+		uint64_t pc;
+		uint64_t blockPc;
+	};
+
+	struct Function
+	{
+		std::string id;
+		uint64_t end = 0;
+		std::vector<Range> ranges;	///< Sorted by native address
+	};
+
+	mutable std::mutex x_map;
+	std::map<uint64_t, Function> m_funcs;	///< Functions by native begin address
+};
+
+}
+}
@@ -0,0 +1,190 @@
+#include "RemoteStorage.h"
+
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+
+#include "support/Socket.h"
+#include "Utils.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+namespace
+{
+	const auto c_magic = uint32_t(0x4b4a5645);	// "EVJK"
+
+	/// Lookups are on the compilation path, an unresponsive server must not stall it
+	const auto c_timeoutMs = 1000u;
+
+	/// Delay of connection attempts after failures, doubled with each failure
+	const auto c_minBackoff = std::chrono::seconds{1};
+	const auto c_maxBackoff = std::chrono::seconds{60};
+
+	/// Entries of the server
+	class Store
+	{
+	public:
+		RemoteStorage::Status handle(RemoteStorage::Op _op, std::string const& _key, std::string& io_value)
+		{
+			std::lock_guard<std::mutex> lock{x_entries};
+			switch (_op)
+			{
+			case RemoteStorage::Op::get:
+			{
+				auto it = m_entries.find(_key);
+				if (it == m_entries.end())
+					return RemoteStorage::Status::notFound;
+				io_value = it->second;
+				return RemoteStorage::Status::ok;
+			}
+			case RemoteStorage::Op::put:
+				m_entries[_key] = std::move(io_value);
+				io_value.clear();
+				return RemoteStorage::Status::ok;
+			case RemoteStorage::Op::del:
+				return m_entries.erase(_key) ? RemoteStorage::Status::ok : RemoteStorage::Status::notFound;
+			case RemoteStorage::Op::list:
+				for (auto&& entry : m_entries)
+					io_value.append(entry.first).push_back('\n');
+				return RemoteStorage::Status::ok;
+			}
+			return RemoteStorage::Status::error;
+		}
+
+	private:
+		std::mutex x_entries;
+		std::unordered_map<std::string, std::string> m_entries;
+	};
+
+	void serveConnection(int _fd, Store& _store)
+	{
+		RemoteStorage::RequestHeader header;
+		std::string key;
+		std::string value;
+		while (net::read_all(_fd, &header, sizeof(header)) && header.magic == c_magic &&
+			   net::read_string(_fd, key, header.keySize) &&
+			   net::read_string(_fd, value, header.valueSize))
+		{
+			auto status = _store.handle(header.op, key, value);
+			if (status != RemoteStorage::Status::ok)
+				value.clear();
+			RemoteStorage::ResponseHeader response{status, value.size()};
+			if (!net::write_all(_fd, &response, sizeof(response)) || !net::write_all(_fd, value.data(), value.size()))
+				break;
+		}
+		net::close(_fd);
+	}
+}
+
+RemoteStorage::Connection::~Connection()
+{
+	if (fd >= 0)
+		net::close(fd);
+}
+
+bool RemoteStorage::isAvailable() const
+{
+	return clock::now().time_since_epoch().count() >= m_retryTime.load(std::memory_order_relaxed);
+}
+
+void RemoteStorage::onConnectFailure()
+{
+	auto failures = std::min(m_failures.fetch_add(1, std::memory_order_relaxed), 6u);
+	auto backoff = std::min<clock::duration>(c_minBackoff * (1u << failures), c_maxBackoff);
+	m_retryTime.store((clock::now() + backoff).time_since_epoch().count(), std::memory_order_relaxed);
+	DLOG(cache) << "Cannot connect to " << m_address << ", retry in " << std::chrono::duration_cast<std::chrono::seconds>(backoff).count() << " s\n";
+}
+
+RemoteStorage::Status RemoteStorage::request(Connection& _connection, Op _op, std::string const& _key, llvm::StringRef _value, std::string& o_value)
+{
+	RequestHeader header{};
+	header.magic = c_magic;
+	header.op = _op;
+	header.keySize = static_cast<uint32_t>(_key.size());
+	header.valueSize = _value.size();
+
+	std::lock_guard<std::mutex> lock{_connection.x_fd};
+
+	// The server may have been restarted, reconnect once
+	for (auto attempt = 0; attempt < 2; ++attempt)
+	{
+		if (_connection.fd < 0)
+		{
+			if (!isAvailable())
+				return Status::error;
+			_connection.fd = net::connect(m_address, c_timeoutMs);
+			if (_connection.fd < 0)
+			{
+				onConnectFailure();
+				return Status::error;
+			}
+			m_failures.store(0, std::memory_order_relaxed);
+		}
+
+		auto fd = _connection.fd;
+		ResponseHeader response;
+		if (net::write_all(fd, &header, sizeof(header)) &&
+			net::write_all(fd, _key.data(), _key.size()) &&
+			net::write_all(fd, _value.data(), _value.size()) &&
+			net::read_all(fd, &response, sizeof(response)) &&
+			net::read_string(fd, o_value, response.valueSize))
+			return response.status;
+
+		DLOG(cache) << "Connection to " << m_address << " failed\n";
+		net::close(fd);
+		_connection.fd = -1;
+	}
+	return Status::error;
+}
+
+std::unique_ptr<llvm::MemoryBuffer> RemoteStorage::lookup(std::string const& _key)
+{
+	std::string value;
+	if (request(m_lookupConnection, Op::get, _key, {}, value) != Status::ok)
+		return nullptr;
+	return llvm::MemoryBuffer::getMemBufferCopy(value);
+}
+
+bool RemoteStorage::store(std::string const& _key, llvm::StringRef _value)
+{
+	std::string response;
+	return request(m_storeConnection, Op::put, _key, _value, response) == Status::ok;
+}
+
+bool RemoteStorage::evict(std::string const& _key)
+{
+	std::string response;
+	return request(m_storeConnection, Op::del, _key, {}, response) == Status::ok;
+}
+
+std::vector<std::string> RemoteStorage::enumerate()
+{
+	std::string list;
+	std::vector<std::string> keys;
+	if (request(m_lookupConnection, Op::list, {}, {}, list) != Status::ok)
+		return keys;
+	for (size_t begin = 0, end; (end = list.find('\n', begin)) != std::string::npos; begin = end + 1)
+		keys.push_back(list.substr(begin, end - begin));
+	return keys;
+}
+
+bool RemoteStorage::serve(std::string const& _address)
+{
+	auto fd = net::listen(_address);
+	if (fd < 0)
+		return false;
+
+	static Store s_store;
+	while (true)
+	{
+		auto conn = net::accept(fd);
+		if (conn >= 0)
+			std::thread{serveConnection, conn, std::ref(s_store)}.detach();
+	}
+}
+
+}
+}
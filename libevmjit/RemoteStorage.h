@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "CacheStorage.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+/// Cache storage on a key-value server shared by many nodes.
+///
+/// The protocol is a sequence of requests and responses on a stream
+/// connection (TCP "<host>:<port>" or a Unix socket path):
+///   request:  RequestHeader, key, value (put only)
+///   response: ResponseHeader, value (get and list only)
+/// list returns keys separated by '\n'. Integers use native byte order.
+/// serve() is a simple in-memory server for testing and small setups.
+///
+/// Cache entries are machine code loaded and executed by the clients, and the
+/// server has no authentication nor integrity checks: the server and every
+/// process that can connect to it must be trusted. serve() listens on loopback
+/// unless the host is given explicitly, expose it only on a private network.
+class RemoteStorage : public CacheStorage
+{
+public:
+	enum class Op : uint32_t
+	{
+		get,
+		put,
+		del,
+		list
+	};
+
+	enum class Status : uint32_t
+	{
+		ok,
+		notFound,
+		error
+	};
+
+	struct RequestHeader
+	{
+		uint32_t magic;
+		Op op;
+		uint32_t keySize;
+		uint64_t valueSize;
+	};
+
+	struct ResponseHeader
+	{
+		Status status;
+		uint64_t valueSize;
+	};
+
+	explicit RemoteStorage(std::string const& _address): m_address(_address) {}
+
+	std::unique_ptr<llvm::MemoryBuffer> lookup(std::string const& _key) override;
+	bool store(std::string const& _key, llvm::StringRef _value) override;
+	bool evict(std::string const& _key) override;
+	std::vector<std::string> enumerate() override;
+
+	/// Runs the in-memory key-value server on given address.
+	/// @returns false if the address cannot be listened on, otherwise does not return
+	static bool serve(std::string const& _address);
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	/// Connection used by one request at a time
+	struct Connection
+	{
+		std::mutex x_fd;
+		int fd = -1;
+
+		~Connection();
+	};
+
+	Status request(Connection& _connection, Op _op, std::string const& _key, llvm::StringRef _value, std::string& o_value);
+
+	/// @returns false if the server is not to be contacted after recent failures
+	bool isAvailable() const;
+	void onConnectFailure();
+
+	std::string m_address;
+	Connection m_lookupConnection;	///< get and list, not delayed by stores
+	Connection m_storeConnection;	///< put and del
+	std::atomic<unsigned> m_failures{0};				///< Consecutive failed connection attempts
+	std::atomic<clock::rep> m_retryTime{0};			///< No connection attempts before, clock ticks
+};
+
+}
+}
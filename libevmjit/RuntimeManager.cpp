@@ -38,12 +38,31 @@ llvm::StructType* RuntimeManager::getRuntimeDataType()
 			Type::Size,		// blockTimestamp
 			Type::BytePtr,	// code
 			Type::Size,		// codeSize
+			Type::WordPtr,	// blockHashes
+			Type::Size,		// blockHashesBase
 		};
 		type = llvm::StructType::create(elems, "RuntimeData");
 	}
 	return type;
 }
 
+llvm::StructType* RuntimeManager::getStencilFrameType()
+{
+	static llvm::StructType* type = nullptr;
+	if (!type)
+	{
+		llvm::Type* elems[] =
+		{
+			Type::WordPtr,					// stack base
+			Type::Size->getPointerTo(),		// stack size
+			Type::GasPtr,					// gas
+			Type::BytePtr					// jmpBuf
+		};
+		type = llvm::StructType::create(elems, "StencilFrame");
+	}
+	return type;
+}
+
 llvm::StructType* RuntimeManager::getRuntimeType()
 {
 	static llvm::StructType* type = nullptr;
@@ -53,7 +72,10 @@ llvm::StructType* RuntimeManager::getRuntimeType()
 		{
 			Type::RuntimeDataPtr,	// data
 			Type::EnvPtr,			// Env*
-			Array::getType()		// memory
+			Array::getType(),		// memory
+			Type::BytePtr,			// log buffer
+			Type::BytePtr,			// call hooks
+			Type::BytePtr			// cancel flag
 		};
 		type = llvm::StructType::create(elems, "Runtime");
 	}
@@ -83,6 +105,8 @@ llvm::Twine getName(RuntimeData::Index _index)
 	case RuntimeData::Timestamp:	return "block.timestamp";
 	case RuntimeData::Code:			return "code.ptr";
 	case RuntimeData::CodeSize:		return "code.size";
+	case RuntimeData::BlockHashes:	return "block.hashes";
+	case RuntimeData::BlockHashesBase:	return "block.hashes.base";
 	}
 }
 }
@@ -93,28 +117,24 @@ RuntimeManager::RuntimeManager(IRBuilder& _builder, code_iterator _codeBegin, co
 	m_codeEnd(_codeEnd)
 {
 	m_longjmp = llvm::Intrinsic::getDeclaration(getModule(), llvm::Intrinsic::eh_sjlj_longjmp);
+	unpackRuntime();
 
-	// Unpack data
-	auto rtPtr = getRuntimePtr();
-	m_dataPtr = m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 0), "dataPtr");
-	assert(m_dataPtr->getType() == Type::RuntimeDataPtr);
-	m_memPtr = m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 2, "mem");
-	assert(m_memPtr->getType() == Array::getType()->getPointerTo());
-	m_envPtr = m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 1), "env");
-	assert(m_envPtr->getType() == Type::EnvPtr);
-
-	auto mallocFunc = llvm::Function::Create(llvm::FunctionType::get(Type::WordPtr, {Type::Size}, false), llvm::Function::ExternalLinkage, "malloc", getModule());
-	mallocFunc->setDoesNotThrow();
-	mallocFunc->setDoesNotAlias(0);
+	// Allocate stack with ext_realloc to get the same alignment as memory
+	auto reallocFunc = getModule()->getFunction("ext_realloc");
+	if (!reallocFunc)
+	{
+		llvm::Type* reallocArgTypes[] = {Type::BytePtr, Type::Size};
+		reallocFunc = llvm::Function::Create(llvm::FunctionType::get(Type::BytePtr, reallocArgTypes, false), llvm::Function::ExternalLinkage, "ext_realloc", getModule());
+		reallocFunc->setDoesNotThrow();
+		reallocFunc->setDoesNotAlias(0);
+		reallocFunc->setDoesNotCapture(1);
+	}
 
-	m_stackBase = m_builder.CreateCall(mallocFunc, m_builder.getInt64(Type::Word->getPrimitiveSizeInBits() / 8 * stackSizeLimit), "stack.base"); // TODO: Use Type::SizeT type
+	auto stackMem = m_builder.CreateCall(reallocFunc, {llvm::ConstantPointerNull::get(Type::BytePtr), m_builder.getInt64(Type::Word->getPrimitiveSizeInBits() / 8 * stackSizeLimit)}, "stack.mem"); // TODO: Use Type::SizeT type
+	m_stackBase = m_builder.CreateBitCast(stackMem, Type::WordPtr, "stack.base");
 	m_stackSize = m_builder.CreateAlloca(Type::Size, nullptr, "stack.size");
 	m_builder.CreateStore(m_builder.getInt64(0), m_stackSize);
 
-	auto data = m_builder.CreateLoad(m_dataPtr, "data");
-	for (unsigned i = 0; i < m_dataElts.size(); ++i)
-		m_dataElts[i] = m_builder.CreateExtractValue(data, i, getName(RuntimeData::Index(i)));
-
 	m_gasPtr = m_builder.CreateAlloca(Type::Gas, nullptr, "gas.ptr");
 	m_builder.CreateStore(m_dataElts[RuntimeData::Index::Gas], m_gasPtr);
 
@@ -122,19 +142,61 @@ RuntimeManager::RuntimeManager(IRBuilder& _builder, code_iterator _codeBegin, co
 	InsertPointGuard guard{m_builder};
 	m_builder.SetInsertPoint(m_exitBB);
 	auto retPhi = m_builder.CreatePHI(Type::MainReturn, 16, "ret");
-	auto freeFunc = getModule()->getFunction("free");
+	auto freeFunc = getModule()->getFunction("ext_free");
 	if (!freeFunc)
 	{
-		freeFunc = llvm::Function::Create(llvm::FunctionType::get(Type::Void, Type::WordPtr, false), llvm::Function::ExternalLinkage, "free", getModule());
+		freeFunc = llvm::Function::Create(llvm::FunctionType::get(Type::Void, Type::BytePtr, false), llvm::Function::ExternalLinkage, "ext_free", getModule());
 		freeFunc->setDoesNotThrow();
 		freeFunc->setDoesNotCapture(1);
 	}
-	m_builder.CreateCall(freeFunc, {m_stackBase});
+	m_builder.CreateCall(freeFunc, {stackMem});
 	auto extGasPtr = m_builder.CreateStructGEP(getRuntimeDataType(), getDataPtr(), RuntimeData::Index::Gas, "msg.gas.ptr");
-	m_builder.CreateStore(getGas(), extGasPtr);
+	tagAccess(m_builder.CreateStore(getGas(), extGasPtr), Type::tbaaRuntimeData);
 	m_builder.CreateRet(retPhi);
 }
 
+RuntimeManager::RuntimeManager(IRBuilder& _builder, llvm::Value* _frame):
+	CompilerHelper(_builder),
+	m_stencil(true)
+{
+	m_longjmp = llvm::Intrinsic::getDeclaration(getModule(), llvm::Intrinsic::eh_sjlj_longjmp);
+	unpackRuntime();
+
+	auto frameType = getStencilFrameType();
+	m_stackBase = m_builder.CreateLoad(m_builder.CreateStructGEP(frameType, _frame, 0), "stack.base");
+	m_stackSize = m_builder.CreateLoad(m_builder.CreateStructGEP(frameType, _frame, 1), "stack.size.ptr");
+	m_gasPtr = m_builder.CreateLoad(m_builder.CreateStructGEP(frameType, _frame, 2), "gas.ptr");
+	m_jmpBuf = m_builder.CreateLoad(m_builder.CreateStructGEP(frameType, _frame, 3), "jmpBuf");
+
+	// The entry stencil frees the stack and writes the gas back
+	m_exitBB = llvm::BasicBlock::Create(m_builder.getContext(), "Exit", getMainFunction());
+	InsertPointGuard guard{m_builder};
+	m_builder.SetInsertPoint(m_exitBB);
+	m_builder.CreateRet(m_builder.CreatePHI(Type::MainReturn, 16, "ret"));
+}
+
+void RuntimeManager::unpackRuntime()
+{
+	// Unpack data
+	auto rtPtr = getRuntimePtr();
+	m_dataPtr = tagAccess(m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 0), "dataPtr"), Type::tbaaRuntime);
+	assert(m_dataPtr->getType() == Type::RuntimeDataPtr);
+	m_memPtr = m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 2, "mem");
+	assert(m_memPtr->getType() == Array::getType()->getPointerTo());
+	m_envPtr = tagAccess(m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 1), "env"), Type::tbaaRuntime);
+	assert(m_envPtr->getType() == Type::EnvPtr);
+	m_logBufferPtr = tagAccess(m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 3), "logBuffer"), Type::tbaaRuntime);
+	m_callHooksPtr = tagAccess(m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 4), "callHooks"), Type::tbaaRuntime);
+	auto cancelFlagPtr = tagAccess(m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 5), "cancelFlag"), Type::tbaaRuntime);
+	auto neverCancelled = new llvm::GlobalVariable(*getModule(), Type::Byte, true, llvm::GlobalValue::PrivateLinkage, m_builder.getInt8(0), "cancel.never");
+	auto hasCancelFlag = m_builder.CreateICmpNE(cancelFlagPtr, llvm::ConstantPointerNull::get(Type::BytePtr));
+	m_cancelFlagPtr = m_builder.CreateSelect(hasCancelFlag, cancelFlagPtr, neverCancelled, "cancelFlag.ptr");
+
+	auto data = tagAccess(m_builder.CreateLoad(m_dataPtr, "data"), Type::tbaaRuntimeData);
+	for (unsigned i = 0; i < m_dataElts.size(); ++i)
+		m_dataElts[i] = m_builder.CreateExtractValue(data, i, getName(RuntimeData::Index(i)));
+}
+
 llvm::Value* RuntimeManager::getRuntimePtr()
 {
 	// Expect first argument of a function to be a pointer to Runtime
@@ -150,7 +212,7 @@ llvm::Value* RuntimeManager::getDataPtr()
 		return m_dataPtr;
 
 	auto rtPtr = getRuntimePtr();
-	auto dataPtr = m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 0), "data");
+	auto dataPtr = tagAccess(m_builder.CreateLoad(m_builder.CreateStructGEP(getRuntimeType(), rtPtr, 0), "data"), Type::tbaaRuntime);
 	assert(dataPtr->getType() == getRuntimeDataType()->getPointerTo());
 	return dataPtr;
 }
@@ -161,6 +223,18 @@ llvm::Value* RuntimeManager::getEnvPtr()
 	return m_envPtr;
 }
 
+llvm::Value* RuntimeManager::getLogBufferPtr()
+{
+	assert(getMainFunction());	// Available only in main function
+	return m_logBufferPtr;
+}
+
+llvm::Value* RuntimeManager::getCallHooksPtr()
+{
+	assert(getMainFunction());	// Available only in main function
+	return m_callHooksPtr;
+}
+
 llvm::Value* RuntimeManager::getPtr(RuntimeData::Index _index)
 {
 	auto ptr = m_builder.CreateStructGEP(getRuntimeDataType(), getDataPtr(), _index);
@@ -177,13 +251,13 @@ void RuntimeManager::set(RuntimeData::Index _index, llvm::Value* _value)
 {
 	auto ptr = getPtr(_index);
 	assert(ptr->getType() == _value->getType()->getPointerTo());
-	m_builder.CreateStore(_value, ptr);
+	tagAccess(m_builder.CreateStore(_value, ptr), Type::tbaaRuntimeData);
 }
 
 void RuntimeManager::registerReturnData(llvm::Value* _offset, llvm::Value* _size)
 {
 	auto memPtr = m_builder.CreateBitCast(getMem(), Type::BytePtr->getPointerTo());
-	auto mem = m_builder.CreateLoad(memPtr, "memory");
+	auto mem = tagAccess(m_builder.CreateLoad(memPtr, "memory"), Type::tbaaRuntime);
 	auto returnDataPtr = m_builder.CreateGEP(mem, _offset);
 	set(RuntimeData::ReturnData, returnDataPtr);
 
@@ -197,10 +271,34 @@ void RuntimeManager::registerSuicide(llvm::Value* _balanceAddress)
 }
 
 void RuntimeManager::exit(ReturnCode _returnCode)
+{
+	exit(Constant::get(_returnCode));
+}
+
+void RuntimeManager::exit(llvm::Value* _returnCode)
 {
 	m_builder.CreateBr(m_exitBB);
 	auto retPhi = llvm::cast<llvm::PHINode>(&m_exitBB->front());
-	retPhi->addIncoming(Constant::get(_returnCode), m_builder.GetInsertBlock());
+	retPhi->addIncoming(_returnCode, m_builder.GetInsertBlock());
+}
+
+llvm::Value* RuntimeManager::isCancelled()
+{
+	auto flag = m_builder.CreateLoad(m_cancelFlagPtr, true, "cancelFlag.value"); // volatile: can be changed by other thread
+	return m_builder.CreateICmpNE(flag, m_builder.getInt8(0), "cancelled");
+}
+
+void RuntimeManager::trace(uint64_t _pc, Instruction _inst)
+{
+	if (!m_traceFunc)
+	{
+		llvm::Type* argTypes[] = {Type::RuntimePtr, Type::Size, Type::Byte, Type::Gas, Type::WordPtr, Type::Size};
+		m_traceFunc = llvm::Function::Create(llvm::FunctionType::get(Type::Void, argTypes, false), llvm::Function::ExternalLinkage, "ext_trace", getModule());
+		m_traceFunc->setDoesNotThrow();
+	}
+
+	auto stackSize = m_builder.CreateLoad(getStackSize(), "stack.size");
+	m_builder.CreateCall(m_traceFunc, {getRuntimePtr(), m_builder.getInt64(_pc), m_builder.getInt8(static_cast<uint8_t>(_inst)), getGas(), getStackBase(), stackSize});
 }
 
 void RuntimeManager::abort(llvm::Value* _jmpBuf)
@@ -236,6 +334,8 @@ llvm::Value* RuntimeManager::getCode()
 {
 	// OPT Check what is faster
 	//return get(RuntimeData::Code);
+	if (m_stencil)
+		return get(RuntimeData::Code);	// Stencils are shared by all code
 	if (!m_codePtr)
 		m_codePtr = m_builder.CreateGlobalStringPtr({reinterpret_cast<char const*>(m_codeBegin), static_cast<size_t>(m_codeEnd - m_codeBegin)}, "code");
 	return m_codePtr;
@@ -243,6 +343,8 @@ llvm::Value* RuntimeManager::getCode()
 
 llvm::Value* RuntimeManager::getCodeSize()
 {
+	if (m_stencil)
+		return m_builder.CreateZExt(get(RuntimeData::CodeSize), Type::Word);
 	return Constant::get(m_codeEnd - m_codeBegin);
 }
 
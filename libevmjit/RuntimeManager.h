@@ -19,9 +19,15 @@ class RuntimeManager: public CompilerHelper
 public:
 	RuntimeManager(IRBuilder& _builder, code_iterator _codeBegin, code_iterator _codeEnd);
 
+	/// Runtime manager of a stencil: the stack, gas counter and jump buffer belong to the entry stencil
+	/// and are accessed through its frame, the code is read from runtime data
+	RuntimeManager(IRBuilder& _builder, llvm::Value* _frame);
+
 	llvm::Value* getRuntimePtr();
 	llvm::Value* getDataPtr();
 	llvm::Value* getEnvPtr();
+	llvm::Value* getLogBufferPtr();
+	llvm::Value* getCallHooksPtr();
 
 	llvm::Value* get(RuntimeData::Index _index);
 	llvm::Value* get(Instruction _inst);
@@ -40,6 +46,13 @@ public:
 	void registerSuicide(llvm::Value* _balanceAddress);
 
 	void exit(ReturnCode _returnCode);
+	void exit(llvm::Value* _returnCode);
+
+	/// Checks the cancellation flag provided by the host
+	llvm::Value* isCancelled();
+
+	/// Calls the execution tracer with the current state
+	void trace(uint64_t _pc, Instruction _inst);
 
 	void abort(llvm::Value* _jmpBuf);
 
@@ -52,19 +65,30 @@ public:
 	static llvm::StructType* getRuntimeType();
 	static llvm::StructType* getRuntimeDataType();
 
+	/// Frame shared by stencils, see StencilCompiler
+	static llvm::StructType* getStencilFrameType();
+
 	//TODO Move to schedule
 	static const size_t stackSizeLimit = 1024;
 
+	/// Alignment of EVM stack and memory buffers (guaranteed by ext_realloc)
+	static const unsigned wordAlignment = 32;
+
 private:
+	void unpackRuntime();
 	llvm::Value* getPtr(RuntimeData::Index _index);
 	void set(RuntimeData::Index _index, llvm::Value* _value);
 
 	llvm::Function* m_longjmp = nullptr;
+	llvm::Function* m_traceFunc = nullptr;
 	llvm::Value* m_jmpBuf = nullptr;
 	llvm::Value* m_dataPtr = nullptr;
 	llvm::Value* m_gasPtr = nullptr;
 	llvm::Value* m_memPtr = nullptr;
 	llvm::Value* m_envPtr = nullptr;
+	llvm::Value* m_logBufferPtr = nullptr;
+	llvm::Value* m_callHooksPtr = nullptr;
+	llvm::Value* m_cancelFlagPtr = nullptr;
 
 	std::array<llvm::Value*, RuntimeData::numElements> m_dataElts;
 
@@ -76,6 +100,7 @@ private:
 	code_iterator m_codeBegin = {};
 	code_iterator m_codeEnd = {};
 	llvm::Value* m_codePtr = nullptr;
+	bool m_stencil = false;
 };
 
 }
@@ -0,0 +1,407 @@
+#include "StencilCompiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "preprocessor/llvm_includes_start.h"
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Support/ELF.h>
+#include <llvm/Support/MathExtras.h>
+#include "preprocessor/llvm_includes_end.h"
+
+#include "Instruction.h"
+#include "Utils.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+namespace
+{
+	const auto c_holePrefix = "evmjit.hole.";
+	const auto c_self = uint32_t(-1);		///< Patch kind: address of the stencil copy
+	const auto c_absolute = uint32_t(-2);	///< Symbol kind: resolved address
+	const auto c_invalid = 0xfeu;			///< Undefined opcode, its stencil aborts execution
+	const auto c_trap = '\xcc';				///< int3, fills gaps between copies
+}
+
+struct StencilCompiler::Stencil
+{
+	/// Reference to a hole or to the copy itself, patched in every copy
+	struct Patch
+	{
+		uint64_t offset;	///< Offset of the 64-bit value in the code
+		int64_t addend;
+		uint32_t hole;		///< StencilHole or c_self
+	};
+
+	std::string code;			///< Code with references to runtime symbols and stencil data resolved
+	uint64_t entry = 0;			///< Offset of the stencil function in the code
+	uint64_t alignment = 1;
+	std::vector<Patch> patches;
+};
+
+std::string getStencilHoleSymbol(StencilHole _hole)
+{
+	static char const* const names[] = {"next", "imm0", "imm1", "imm2", "imm3", "pc", "jumpTable", "jumpTableSize", "codeBase"};
+	static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(StencilHole::numHoles), "Update hole names");
+	return c_holePrefix + std::string{names[static_cast<size_t>(_hole)]};
+}
+
+StencilCompiler::StencilCompiler(ObjectGenerator _generator, SymbolResolver _resolver):
+	m_generator(std::move(_generator)),
+	m_resolver(std::move(_resolver)),
+	m_stencils(entryIndex + 1)
+{}
+
+StencilCompiler::~StencilCompiler() = default;
+
+std::string StencilCompiler::getStencilName(unsigned _index)
+{
+	if (_index == entryIndex)
+		return "stencil-entry";
+	return "stencil-" + llvm::utohexstr(_index);
+}
+
+char* StencilCompiler::allocateData(size_t _size, size_t _alignment)
+{
+	_alignment = std::max<size_t>(_alignment, 1);
+	m_data.emplace_back(new char[_size + _alignment - 1]());
+	auto addr = reinterpret_cast<uint64_t>(m_data.back().get());
+	return reinterpret_cast<char*>(llvm::RoundUpToAlignment(addr, _alignment));
+}
+
+bool StencilCompiler::load(std::string const& _object, std::string const& _name, Stencil& o_stencil)
+{
+	auto obj = llvm::object::ObjectFile::createObjectFile(llvm::MemoryBufferRef{_object, _name});
+	if (!obj || !obj.get()->isELF() || obj.get()->getArch() != llvm::Triple::x86_64)
+		return false;
+	auto& file = *obj.get();
+
+	// The stencil function and the helpers it calls are in one code section,
+	// data sections are loaded once and shared by all copies
+	llvm::object::SectionRef text;
+	auto haveText = false;
+	std::vector<std::pair<llvm::object::SectionRef, char*>> data;
+	for (auto&& section : file.sections())
+	{
+		llvm::StringRef name;
+		if (section.getName(name) || name == ".eh_frame")	// Unwind info is not registered
+			continue;
+		if (section.isText() && section.getSize() != 0)
+		{
+			if (haveText)
+				return false;
+			text = section;
+			haveText = true;
+		}
+		else if (section.isData() || section.isBSS())
+		{
+			auto mem = allocateData(section.getSize(), section.getAlignment());
+			llvm::StringRef contents;
+			if (!section.isBSS())
+			{
+				if (section.getContents(contents))
+					return false;
+				std::memcpy(mem, contents.data(), contents.size());
+			}
+			data.emplace_back(section, mem);
+		}
+	}
+
+	llvm::StringRef code;
+	if (!haveText || text.getContents(code))
+		return false;
+	o_stencil.code = code.str();
+	o_stencil.alignment = std::max<uint64_t>(text.getAlignment(), 1);
+
+	auto resolve = [&](llvm::object::symbol_iterator _symbol, uint32_t& o_kind, uint64_t& o_value)
+	{
+		if (_symbol == file.symbol_end())
+			return false;
+
+		if (_symbol->getFlags() & llvm::object::SymbolRef::SF_Undefined)
+		{
+			auto name = _symbol->getName();
+			if (!name)
+				return false;
+			o_value = 0;
+			for (uint32_t i = 0; i < static_cast<uint32_t>(StencilHole::numHoles); ++i)
+			{
+				if (*name == getStencilHoleSymbol(static_cast<StencilHole>(i)))
+				{
+					o_kind = i;
+					return true;
+				}
+			}
+			o_kind = c_absolute;
+			o_value = m_resolver(name->str());
+			return o_value != 0;
+		}
+
+		auto section = file.section_end();
+		auto address = _symbol->getAddress();
+		if (_symbol->getSection(section) || section == file.section_end() || !address)
+			return false;
+		auto offset = *address - section->getAddress();
+		if (*section == text)
+		{
+			o_kind = c_self;
+			o_value = offset;
+			return true;
+		}
+		for (auto&& d : data)
+		{
+			if (d.first == *section)
+			{
+				o_kind = c_absolute;
+				o_value = reinterpret_cast<uint64_t>(d.second) + offset;
+				return true;
+			}
+		}
+		return false;	// Reference to an excluded section
+	};
+
+	for (auto&& section : file.sections())
+	{
+		auto target = section.getRelocatedSection();
+		if (target == file.section_end())
+			continue;
+
+		char* base = nullptr;
+		if (*target == text)
+			base = &o_stencil.code[0];
+		for (auto&& d : data)
+			if (d.first == *target)
+				base = d.second;
+		if (!base)
+			continue;
+
+		for (auto&& reloc : section.relocations())
+		{
+			uint32_t kind = 0;
+			uint64_t value = 0;
+			auto addend = llvm::object::ELFRelocationRef{reloc}.getAddend();
+			auto offset = reloc.getOffset();
+			if (reloc.getType() != llvm::ELF::R_X86_64_64 || !addend || !resolve(reloc.getSymbol(), kind, value) ||
+				offset + sizeof(uint64_t) > target->getSize())
+				return false;	// Requires the large code model and static relocation model
+
+			if (kind == c_absolute)
+			{
+				value += static_cast<uint64_t>(*addend);
+				std::memcpy(base + offset, &value, sizeof(value));
+			}
+			else if (*target == text)
+				o_stencil.patches.push_back({offset, static_cast<int64_t>(value) + *addend, kind});
+			else
+				return false;	// Shared data cannot refer to a particular copy
+		}
+	}
+
+	for (llvm::object::symbol_iterator it = file.symbol_begin(); it != file.symbol_end(); ++it)
+	{
+		auto name = it->getName();
+		uint32_t kind = 0;
+		if (name && *name == _name)
+			return resolve(it, kind, o_stencil.entry) && kind == c_self;
+	}
+	return false;
+}
+
+void StencilCompiler::generate()
+{
+	assert(!m_generated);
+	for (unsigned index = 0; index < m_stencils.size(); ++index)
+	{
+		auto name = getStencilName(index);
+		auto object = m_generator(index);
+		std::unique_ptr<Stencil> stencil{new Stencil};
+		if (!object.empty() && load(object, name, *stencil))
+			m_stencils[index] = std::move(stencil);
+		else
+			DLOG(stencils) << name << ": stencil not available\n";
+	}
+	m_generated.store(true, std::memory_order_release);
+}
+
+#ifndef _WIN32
+
+uint64_t StencilCompiler::compile(byte const* _code, uint64_t _codeSize, bool _haveDelegateCall)
+{
+	struct Copy
+	{
+		Stencil const* stencil;
+		uint64_t offset;		///< Offset of the copy in the code
+		uint64_t pc;
+		code_iterator inst;		///< Null for stencils not belonging to an instruction
+	};
+
+	if (!m_generated.load(std::memory_order_acquire))
+		return 0;
+
+	std::vector<Copy> copies;
+	auto size = uint64_t(0);
+	auto end = _code + _codeSize;
+	auto add = [&](unsigned _index, uint64_t _pc, code_iterator _inst)
+	{
+		auto stencil = m_stencils[_index].get();
+		if (!stencil)
+			return false;
+		size = llvm::RoundUpToAlignment(size, stencil->alignment);
+		copies.push_back({stencil, size, _pc, _inst});
+		size += stencil->code.size();
+		return true;
+	};
+
+	if (!add(entryIndex, 0, nullptr))
+		return 0;
+
+	// Dead code is skipped as in Compiler::createBasicBlocks()
+	auto isDead = false;
+	for (auto it = _code; it != end; ++it)
+	{
+		auto curr = it;
+		auto inst = Instruction(*curr);
+		if (inst >= Instruction::PUSH1 && inst <= Instruction::PUSH32)
+			skipPushData(it, end);
+
+		if (isDead)
+		{
+			if (inst != Instruction::JUMPDEST)
+				continue;
+			isDead = false;
+		}
+
+		auto index = static_cast<unsigned>(inst);
+		if (inst == Instruction::DELEGATECALL && !_haveDelegateCall)
+			index = c_invalid;
+		if (!add(index, static_cast<uint64_t>(curr - _code), curr))
+			return 0;
+
+		switch (inst)
+		{
+		case Instruction::JUMP:
+		case Instruction::RETURN:
+		case Instruction::STOP:
+		case Instruction::SUICIDE:
+			isDead = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Execution reaching the end of the code stops
+	if (!isDead && !add(static_cast<unsigned>(Instruction::STOP), _codeSize, nullptr))
+		return 0;
+
+	if (size > std::numeric_limits<uint32_t>::max())
+		return 0;	// Jump table entries are 32-bit offsets
+
+	// Code pages followed by read-only jump table pages
+	auto pageSize = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+	auto codeSize = llvm::RoundUpToAlignment(size, pageSize);
+	auto tableSize = llvm::RoundUpToAlignment(_codeSize * sizeof(uint32_t), pageSize);
+	auto mem = ::mmap(nullptr, codeSize + tableSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return 0;
+	auto base = static_cast<char*>(mem);
+	auto table = reinterpret_cast<uint32_t*>(base + codeSize);
+	std::memset(base, c_trap, codeSize);
+
+	uint64_t holes[static_cast<size_t>(StencilHole::numHoles)] = {};
+	auto hole = [&](StencilHole _hole) -> uint64_t& { return holes[static_cast<size_t>(_hole)]; };
+	hole(StencilHole::jumpTable) = reinterpret_cast<uint64_t>(table);
+	hole(StencilHole::jumpTableSize) = _codeSize;
+	hole(StencilHole::codeBase) = reinterpret_cast<uint64_t>(base);
+
+	for (size_t i = 0; i < copies.size(); ++i)
+	{
+		auto& copy = copies[i];
+		auto& stencil = *copy.stencil;
+		auto dst = base + copy.offset;
+		std::memcpy(dst, stencil.code.data(), stencil.code.size());
+
+		auto next = i + 1 < copies.size() ? &copies[i + 1] : nullptr;	// The last stencil does not continue
+		hole(StencilHole::next) = next ? reinterpret_cast<uint64_t>(base + next->offset + next->stencil->entry) : 0;
+		hole(StencilHole::pc) = copy.pc;
+		for (auto imm : {StencilHole::imm0, StencilHole::imm1, StencilHole::imm2, StencilHole::imm3})
+			hole(imm) = 0;
+
+		if (copy.inst)
+		{
+			auto inst = Instruction(*copy.inst);
+			if (inst >= Instruction::PUSH1 && inst <= Instruction::PUSH32)
+			{
+				auto it = copy.inst;
+				auto value = readPushData(it, end);
+				auto words = value.getRawData();
+				hole(StencilHole::imm0) = words[0];
+				hole(StencilHole::imm1) = words[1];
+				hole(StencilHole::imm2) = words[2];
+				hole(StencilHole::imm3) = words[3];
+			}
+			else if (inst == Instruction::JUMPDEST)
+				table[copy.pc] = static_cast<uint32_t>(copy.offset + stencil.entry);	// Not 0, the entry stencil is the first copy
+		}
+
+		for (auto&& patch : stencil.patches)
+		{
+			auto value = patch.hole == c_self ? reinterpret_cast<uint64_t>(dst) : holes[patch.hole];
+			value += static_cast<uint64_t>(patch.addend);
+			std::memcpy(dst + patch.offset, &value, sizeof(value));
+		}
+	}
+
+	if (::mprotect(base, codeSize, PROT_READ | PROT_EXEC) != 0 ||
+		(tableSize && ::mprotect(table, tableSize, PROT_READ) != 0))
+	{
+		::munmap(mem, codeSize + tableSize);
+		return 0;
+	}
+
+	auto execFunc = reinterpret_cast<uint64_t>(base + copies.front().stencil->entry);
+	std::lock_guard<std::mutex> lock{x_mappings};
+	m_mappings.emplace(execFunc, std::make_pair(mem, codeSize + tableSize));
+	return execFunc;
+}
+
+bool StencilCompiler::release(uint64_t _execFunc)
+{
+	std::lock_guard<std::mutex> lock{x_mappings};
+	auto it = m_mappings.find(_execFunc);
+	if (it == m_mappings.end())
+		return false;
+	::munmap(it->second.first, it->second.second);
+	m_mappings.erase(it);
+	return true;
+}
+
+#else
+
+uint64_t StencilCompiler::compile(byte const*, uint64_t, bool)
+{
+	return 0;	// Executable memory is allocated with mmap
+}
+
+bool StencilCompiler::release(uint64_t)
+{
+	return false;
+}
+
+#endif
+
+}
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Common.h"
+
+namespace dev
+{
+namespace evmjit
+{
+
+/// Values patched into copies of stencils. Stencils refer to them as addresses
+/// of undefined symbols, see getStencilHoleSymbol().
+enum class StencilHole
+{
+	next,			///< Entry of the copy of the next stencil
+	imm0,			///< PUSH data, bits 0-63
+	imm1,			///< PUSH data, bits 64-127
+	imm2,			///< PUSH data, bits 128-191
+	imm3,			///< PUSH data, bits 192-255
+	pc,				///< Code index of the instruction
+	jumpTable,		///< Address of the jump table: 32-bit offsets of copies of JUMPDEST stencils by code index, 0 if not a jump destination
+	jumpTableSize,	///< Number of jump table entries, the code size
+	codeBase,		///< Address the jump table offsets are relative to
+	numHoles
+};
+
+/// Name of the undefined symbol standing for the hole in stencil objects
+std::string getStencilHoleSymbol(StencilHole _hole);
+
+/// Baseline compiler copying and patching stencils.
+///
+/// A stencil is the machine code of a single EVM instruction compiled by LLVM
+/// ahead of its use, with holes for the values known only when the code is
+/// compiled: PUSH data, the pc, the next instruction and jump destinations.
+/// Compiling EVM code concatenates copies of the stencils of its instructions
+/// and patches the holes, no LLVM code generation is involved. Instructions
+/// continue with tail calls to the next copy, jumps go through a table of
+/// JUMPDEST copies. Gas is checked in every instruction, so the code runs
+/// slower than LLVM compiled code of whole basic blocks.
+///
+/// Stencil objects are x86-64 ELF objects compiled with Engine::Options::stencils.
+/// Every reference to another section or a runtime symbol must be an R_X86_64_64
+/// relocation, otherwise the stencil is not used.
+class StencilCompiler
+{
+public:
+	/// Index of the stencil of the code entry: sets up the EVM stack and the abort
+	/// target and calls the first instruction. Other indexes are opcodes.
+	static const unsigned entryIndex = 256;
+
+	/// @returns the relocatable object of the stencil of given index, empty on failure.
+	/// The stencil function is named by getStencilName().
+	using ObjectGenerator = std::function<std::string(unsigned _index)>;
+
+	using SymbolResolver = std::function<uint64_t(std::string const&)>;
+
+	StencilCompiler(ObjectGenerator _generator, SymbolResolver _resolver);
+	~StencilCompiler();
+
+	/// Generates all stencils, takes as long as ~260 LLVM compilations of small
+	/// functions. Must be called once, e.g. in a background thread. compile()
+	/// does not compile any code until it finishes.
+	void generate();
+
+	/// Copies and patches stencils of the code into executable memory.
+	/// @returns the address of the exec function, 0 if the stencils are not generated yet
+	/// or an instruction has no usable stencil
+	uint64_t compile(byte const* _code, uint64_t _codeSize, bool _haveDelegateCall);
+
+	/// Frees the code returned by compile(). The code must not be executing.
+	/// @returns false if the address is unknown
+	bool release(uint64_t _execFunc);
+
+	/// Name of the stencil function and the identifier of the stencil object
+	static std::string getStencilName(unsigned _index);
+
+private:
+	struct Stencil;
+
+	bool load(std::string const& _object, std::string const& _name, Stencil& o_stencil);
+	char* allocateData(size_t _size, size_t _alignment);
+
+	ObjectGenerator m_generator;
+	SymbolResolver m_resolver;
+
+	/// Written only by generate(), read-only once m_generated is set
+	std::vector<std::unique_ptr<Stencil>> m_stencils;	///< By index, null if the stencil cannot be generated or used
+	std::vector<std::unique_ptr<char[]>> m_data;		///< Data sections of stencils, shared by all copies
+	std::atomic<bool> m_generated{false};
+
+	std::mutex x_mappings;
+	std::unordered_map<uint64_t, std::pair<void*, size_t>> m_mappings;	///< Memory of compiled code by exec function
+};
+
+}
+}
@@ -26,6 +26,11 @@ llvm::PointerType* Type::RuntimeDataPtr;
 llvm::PointerType* Type::RuntimePtr;
 llvm::ConstantInt* Constant::gasMax;
 llvm::MDNode* Type::expectTrue;
+llvm::MDNode* Type::expectFalse;
+llvm::MDNode* Type::tbaaStack;
+llvm::MDNode* Type::tbaaMemory;
+llvm::MDNode* Type::tbaaRuntime;
+llvm::MDNode* Type::tbaaRuntimeData;
 
 void Type::init(llvm::LLVMContext& _context)
 {
@@ -49,6 +54,19 @@ void Type::init(llvm::LLVMContext& _context)
 		Constant::gasMax = llvm::ConstantInt::getSigned(Type::Gas, std::numeric_limits<int64_t>::max());
 
 		expectTrue = llvm::MDBuilder{_context}.createBranchWeights(1, 0);
+		expectFalse = llvm::MDBuilder{_context}.createBranchWeights(0, 1);
+
+		llvm::MDBuilder mdBuilder{_context};
+		auto tbaaRoot = mdBuilder.createTBAARoot("evmjit");
+		auto createTag = [&](llvm::StringRef _name)
+		{
+			auto type = mdBuilder.createTBAAScalarTypeNode(_name, tbaaRoot);
+			return mdBuilder.createTBAAStructTagNode(type, type, 0);
+		};
+		tbaaStack = createTag("stack");
+		tbaaMemory = createTag("memory");
+		tbaaRuntime = createTag("runtime");
+		tbaaRuntimeData = createTag("runtime.data");
 	}
 }
 
@@ -40,10 +40,26 @@ struct Type
 
 	// TODO: Redesign static LLVM objects
 	static llvm::MDNode* expectTrue;
+	static llvm::MDNode* expectFalse;
+
+	/// TBAA access tags of disjoint memory regions: EVM stack, EVM memory,
+	/// Runtime structure (incl. memory array header) and RuntimeData structure
+	static llvm::MDNode* tbaaStack;
+	static llvm::MDNode* tbaaMemory;
+	static llvm::MDNode* tbaaRuntime;
+	static llvm::MDNode* tbaaRuntimeData;
 
 	static void init(llvm::LLVMContext& _context);
 };
 
+/// Marks a load or store with the TBAA tag of the accessed region
+template<typename _InstT>
+_InstT* tagAccess(_InstT* _inst, llvm::MDNode* _tag)
+{
+	_inst->setMetadata(llvm::LLVMContext::MD_tbaa, _tag);
+	return _inst;
+}
+
 struct Constant
 {
 	static llvm::ConstantInt* gasMax;
@@ -1,6 +1,8 @@
 #include "Utils.h"
 
+#include <atomic>
 #include <cstring>
+#include <memory>
 
 #include <llvm/Support/Debug.h>
 
@@ -180,5 +182,127 @@ void keccak(uint8_t const* _data, uint64_t _size, uint8_t* o_hash)
 	keccak_256(o_hash, 32, _data, _size);
 }
 
+namespace
+{
+
+std::atomic<size_t> g_keccakCacheSize{0};
+std::atomic<uint64_t> g_keccakCacheHits{0};
+std::atomic<uint64_t> g_keccakCacheMisses{0};
+
+/// Direct-mapped cache of keccak hashes of short inputs
+class KeccakCache
+{
+public:
+	static const size_t maxInputSize = 64;
+
+	explicit KeccakCache(size_t _numEntries):
+		m_entries{new Entry[_numEntries]()},
+		m_mask{_numEntries - 1}
+	{}
+
+	~KeccakCache() { flushStats(); }
+
+	bool find(uint8_t const* _data, uint64_t _size, uint8_t* o_hash)
+	{
+		auto& entry = m_entries[index(_data, _size)];
+		auto hit = entry.size == _size + 1 && std::memcmp(entry.input, _data, _size) == 0; // entry.size == 0 means empty
+		if (hit)
+		{
+			std::memcpy(o_hash, entry.hash, sizeof(entry.hash));
+			++m_hits;
+		}
+		else
+			++m_misses;
+
+		if (m_hits + m_misses >= c_statsFlushInterval)
+			flushStats();
+		return hit;
+	}
+
+	void insert(uint8_t const* _data, uint64_t _size, uint8_t const* _hash)
+	{
+		auto& entry = m_entries[index(_data, _size)];
+		entry.size = static_cast<uint8_t>(_size + 1);
+		std::memcpy(entry.input, _data, _size);
+		std::memcpy(entry.hash, _hash, sizeof(entry.hash));
+	}
+
+private:
+	static const uint64_t c_statsFlushInterval = 1024;
+
+	struct Entry
+	{
+		uint8_t size;	///< Input size + 1, 0 if empty
+		uint8_t input[maxInputSize];
+		uint8_t hash[32];
+	};
+
+	size_t index(uint8_t const* _data, uint64_t _size) const
+	{
+		// FNV-1a
+		uint64_t h = 0xcbf29ce484222325 ^ _size;
+		for (uint64_t i = 0; i < _size; ++i)
+			h = (h ^ _data[i]) * 0x100000001b3;
+		return static_cast<size_t>(h ^ (h >> 32)) & m_mask;
+	}
+
+	void flushStats()
+	{
+		g_keccakCacheHits += m_hits;
+		g_keccakCacheMisses += m_misses;
+		m_hits = 0;
+		m_misses = 0;
+	}
+
+	std::unique_ptr<Entry[]> m_entries;
+	size_t m_mask;
+	uint64_t m_hits = 0;	///< Stats are counted locally to avoid contention
+	uint64_t m_misses = 0;
+};
+
+KeccakCache* getKeccakCache()
+{
+	thread_local std::unique_ptr<KeccakCache> t_cache;
+	if (!t_cache)
+	{
+		auto size = g_keccakCacheSize.load();
+		if (size == 0)
+			return nullptr;
+		t_cache.reset(new KeccakCache{size});
+	}
+	return t_cache.get();
+}
+
+}
+
+void keccakCached(uint8_t const* _data, uint64_t _size, uint8_t* o_hash)
+{
+	if (_size > KeccakCache::maxInputSize)
+		return keccak(_data, _size, o_hash);
+
+	auto cache = getKeccakCache();
+	if (!cache)
+		return keccak(_data, _size, o_hash);
+
+	if (!cache->find(_data, _size, o_hash))
+	{
+		keccak(_data, _size, o_hash);
+		cache->insert(_data, _size, o_hash);
+	}
+}
+
+void setKeccakCacheSize(size_t _numEntries)
+{
+	size_t size = 1;
+	while (size * 2 <= _numEntries)
+		size *= 2;
+	g_keccakCacheSize = _numEntries ? size : 0;
+}
+
+KeccakCacheStats getKeccakCacheStats()
+{
+	return {g_keccakCacheHits.load(), g_keccakCacheMisses.load()};
+}
+
 }
 }
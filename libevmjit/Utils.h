@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <iostream>
 
@@ -8,6 +9,22 @@ namespace evmjit {
 
 void keccak(uint8_t const *_data, uint64_t _size, uint8_t *o_hash);
 
+/// Keccak with per-thread memoization of short inputs (up to 64 bytes).
+/// Cache must be enabled with setKeccakCacheSize() first.
+void keccakCached(uint8_t const *_data, uint64_t _size, uint8_t *o_hash);
+
+/// Sets the number of entries of per-thread keccak caches (rounded down to power of 2).
+/// Affects only caches of threads that have not used keccakCached() yet.
+void setKeccakCacheSize(size_t _numEntries);
+
+struct KeccakCacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+};
+
+KeccakCacheStats getKeccakCacheStats();
+
 // The same as assert, but expression is always evaluated and result returned
 #define CHECK(expr) (assert(expr), expr)
 
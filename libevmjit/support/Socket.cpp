@@ -0,0 +1,240 @@
+#include "Socket.h"
+#include "Path.h"
+
+#include <cstring>
+
+#if !UTILS_OS_WINDOWS
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace dev
+{
+namespace net
+{
+#if !UTILS_OS_WINDOWS
+	namespace
+	{
+		bool is_unix(std::string const& _address)
+		{
+			return _address.find('/') != std::string::npos;
+		}
+
+		bool set_unix_address(std::string const& _path, sockaddr_un& o_addr)
+		{
+			std::memset(&o_addr, 0, sizeof(o_addr));
+			o_addr.sun_family = AF_UNIX;
+			if (_path.size() >= sizeof(o_addr.sun_path))
+				return false;
+			std::memcpy(o_addr.sun_path, _path.c_str(), _path.size() + 1);
+			return true;
+		}
+
+		addrinfo* resolve(std::string const& _address, bool _passive)
+		{
+			auto colon = _address.rfind(':');
+			if (colon == std::string::npos)
+				return nullptr;
+			auto host = _address.substr(0, colon);
+			auto port = _address.substr(colon + 1);
+
+			// Without a host getaddrinfo() returns the loopback address, "*" is the wildcard address
+			auto any = _passive && host == "*";
+			addrinfo hints;
+			std::memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = any ? AI_PASSIVE : 0;
+			addrinfo* result = nullptr;
+			if (::getaddrinfo(host.empty() || any ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+				return nullptr;
+			return result;
+		}
+
+		/// Connects the socket, waits at most given time if not 0
+		bool connect_socket(int _socket, sockaddr const* _addr, socklen_t _addrSize, unsigned _timeoutMs)
+		{
+			if (!_timeoutMs)
+				return ::connect(_socket, _addr, _addrSize) == 0;
+
+			auto flags = ::fcntl(_socket, F_GETFL, 0);
+			if (flags < 0 || ::fcntl(_socket, F_SETFL, flags | O_NONBLOCK) != 0)
+				return false;
+			if (::connect(_socket, _addr, _addrSize) != 0)
+			{
+				if (errno != EINPROGRESS)
+					return false;
+				pollfd pfd{_socket, POLLOUT, 0};
+				int error = 0;
+				socklen_t errorSize = sizeof(error);
+				if (::poll(&pfd, 1, static_cast<int>(_timeoutMs)) != 1 ||
+					::getsockopt(_socket, SOL_SOCKET, SO_ERROR, &error, &errorSize) != 0 || error != 0)
+					return false;
+			}
+			return ::fcntl(_socket, F_SETFL, flags) == 0;
+		}
+
+		void set_no_sigpipe(int _socket)
+		{
+		#ifdef SO_NOSIGPIPE
+			int one = 1;
+			::setsockopt(_socket, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+		#else
+			(void)_socket;
+		#endif
+		}
+	}
+
+	int listen(std::string const& _address)
+	{
+		if (is_unix(_address))
+		{
+			sockaddr_un addr;
+			if (!set_unix_address(_address, addr))
+				return -1;
+			auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0)
+				return -1;
+			::unlink(_address.c_str());	// stale socket of a previous server
+			if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0)
+			{
+				::close(fd);
+				return -1;
+			}
+			return fd;
+		}
+
+		auto addrs = resolve(_address, true);
+		auto fd = -1;
+		for (auto ai = addrs; ai && fd < 0; ai = ai->ai_next)
+		{
+			fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			int one = 1;
+			::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (::bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(fd, SOMAXCONN) != 0)
+			{
+				::close(fd);
+				fd = -1;
+			}
+		}
+		if (addrs)
+			::freeaddrinfo(addrs);
+		return fd;
+	}
+
+	int connect(std::string const& _address, unsigned _timeoutMs)
+	{
+		auto fd = -1;
+		if (is_unix(_address))
+		{
+			sockaddr_un addr;
+			if (!set_unix_address(_address, addr))
+				return -1;
+			fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd >= 0 && !connect_socket(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr), _timeoutMs))
+			{
+				::close(fd);
+				fd = -1;
+			}
+		}
+		else
+		{
+			auto addrs = resolve(_address, false);
+			for (auto ai = addrs; ai && fd < 0; ai = ai->ai_next)
+			{
+				fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+				if (fd >= 0 && !connect_socket(fd, ai->ai_addr, ai->ai_addrlen, _timeoutMs))
+				{
+					::close(fd);
+					fd = -1;
+				}
+			}
+			if (addrs)
+				::freeaddrinfo(addrs);
+		}
+		if (fd < 0)
+			return -1;
+
+		set_no_sigpipe(fd);
+		if (_timeoutMs)
+		{
+			timeval timeout;
+			timeout.tv_sec = _timeoutMs / 1000;
+			timeout.tv_usec = (_timeoutMs % 1000) * 1000;
+			::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		}
+		return fd;
+	}
+
+	int accept(int _socket)
+	{
+		auto fd = ::accept(_socket, nullptr, nullptr);
+		if (fd >= 0)
+			set_no_sigpipe(fd);
+		return fd;
+	}
+
+	void close(int _socket)
+	{
+		::close(_socket);
+	}
+
+	bool write_all(int _socket, void const* _data, size_t _size)
+	{
+		auto p = static_cast<char const*>(_data);
+		while (_size)
+		{
+		#ifdef MSG_NOSIGNAL
+			auto n = ::send(_socket, p, _size, MSG_NOSIGNAL);	// peer crash must not kill the process
+		#else
+			auto n = ::send(_socket, p, _size, 0);
+		#endif
+			if (n <= 0)
+				return false;
+			p += n;
+			_size -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	bool read_all(int _socket, void* _data, size_t _size)
+	{
+		auto p = static_cast<char*>(_data);
+		while (_size)
+		{
+			auto n = ::recv(_socket, p, _size, 0);
+			if (n <= 0)
+				return false;
+			p += n;
+			_size -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+#else
+	int listen(std::string const&) { return -1; }
+	int connect(std::string const&, unsigned) { return -1; }
+	int accept(int) { return -1; }
+	void close(int) {}
+	bool write_all(int, void const*, size_t) { return false; }
+	bool read_all(int, void*, size_t) { return false; }
+#endif
+
+	bool read_string(int _socket, std::string& o_str, size_t _size)
+	{
+		static const size_t c_maxSize = 64 * 1024 * 1024;
+		if (_size > c_maxSize)
+			return false;
+		o_str.resize(_size);
+		return _size == 0 || read_all(_socket, &o_str[0], _size);
+	}
+}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace dev
+{
+namespace net
+{
+	/// Stream socket addresses are "<host>:<port>" for TCP or a path of a Unix domain socket.
+	/// Sockets are not supported on Windows, all functions fail there.
+
+	/// Listens on loopback if the host is empty (":<port>"), on all interfaces if it is "*".
+	/// @returns a listening socket, -1 on failure
+	int listen(std::string const& _address);
+
+	/// @param _timeoutMs Timeout of connecting and of each send and receive, 0 - none
+	/// @returns a connected socket, -1 on failure
+	int connect(std::string const& _address, unsigned _timeoutMs = 0);
+
+	/// @returns an accepted connection, -1 on failure
+	int accept(int _socket);
+
+	void close(int _socket);
+
+	bool write_all(int _socket, void const* _data, size_t _size);
+	bool read_all(int _socket, void* _data, size_t _size);
+
+	/// Reads a string of given size, at most 64 MB
+	bool read_string(int _socket, std::string& o_str, size_t _size);
+}
+}
@@ -0,0 +1,18 @@
+# Runs PROGRAM with memory loop replacement disabled and enabled and compares the outputs.
+
+set(ENV{EVMJIT} "-cache=0 -memory-loops=0")
+execute_process(COMMAND ${PROGRAM} OUTPUT_VARIABLE reference RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "${PROGRAM} failed with -memory-loops=0: ${result}")
+endif()
+
+set(ENV{EVMJIT} "-cache=0 -memory-loops=1")
+execute_process(COMMAND ${PROGRAM} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "${PROGRAM} failed with -memory-loops=1: ${result}")
+endif()
+
+if (NOT output STREQUAL reference)
+	message(FATAL_ERROR "Results differ\n-memory-loops=0:\n${reference}-memory-loops=1:\n${output}")
+endif()
+message(STATUS "${output}")
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <vector>
+
+#include <evmjit/JIT.h>
+
+using namespace dev::evmjit;
+
+namespace
+{
+
+/// Code running a word loop from 0x2000 to 0x1000 over 0x200 bytes with given body,
+/// returning MSIZE. The body gets the stack [len, dst, src] and must leave it unchanged.
+std::vector<byte> loopCode(std::vector<byte> const& _body)
+{
+	std::vector<byte> code = {
+		0x61, 0x20, 0x00,	// PUSH2 src
+		0x61, 0x10, 0x00,	// PUSH2 dst
+		0x61, 0x02, 0x00,	// PUSH2 len
+		0x5b,				// head: JUMPDEST
+		0x60, 0x20,			// PUSH1 32
+		0x81,				// DUP2
+		0x10,				// LT
+		0x61, 0x00, 0x00,	// PUSH2 exit (patched below)
+		0x57,				// JUMPI
+	};
+	code.insert(code.end(), _body.begin(), _body.end());
+	std::vector<byte> const tail = {
+		0x60, 0x20, 0x90, 0x03,			// len -= 32
+		0x90, 0x60, 0x20, 0x01, 0x90,	// dst += 32
+		0x91, 0x60, 0x20, 0x01, 0x91,	// src += 32
+		0x60, 0x09, 0x56,				// PUSH1 head, JUMP
+	};
+	code.insert(code.end(), tail.begin(), tail.end());
+	auto exit = code.size();
+	code[15] = static_cast<byte>(exit >> 8);
+	code[16] = static_cast<byte>(exit);
+	std::vector<byte> const epilogue = {
+		0x5b, 0x50, 0x50, 0x50,	// exit: JUMPDEST, POP, POP, POP
+		0x59, 0x60, 0x00, 0x52,	// mstore(0, msize)
+		0x60, 0x20, 0x60, 0x00, 0xf3,	// return(0, 32)
+	};
+	code.insert(code.end(), epilogue.begin(), epilogue.end());
+	return code;
+}
+
+struct Case
+{
+	char const* name;
+	std::vector<byte> body;
+};
+
+}
+
+int main()
+{
+	Case const cases[] = {
+		{"copy", {0x82, 0x51, 0x82, 0x52}},						// mstore(dst, mload(src))
+		{"zero-fill", {0x60, 0x00, 0x82, 0x52}},				// mstore(dst, 0)
+		{"discarded-load", {0x82, 0x51, 0x50, 0x60, 0x00, 0x82, 0x52}},	// pop(mload(src)), mstore(dst, 0)
+	};
+
+	JITSchedule schedule;
+	byte caseIndex = 0;
+	for (auto& c : cases)
+	{
+		auto code = loopCode(c.body);
+		RuntimeData data;
+		data.gas = 1000000;
+		data.code = code.data();
+		data.codeSize = code.size();
+		data.codeHash.words[0] = ++caseIndex;
+
+		ExecutionContext context{data, nullptr};
+		auto returnCode = JIT::exec(context, schedule);
+
+		uint64_t msize = 0;
+		if (returnCode == ReturnCode::Return && std::get<1>(context.returnData) == 32)
+			for (size_t i = 24; i < 32; ++i)
+				msize = (msize << 8) | std::get<0>(context.returnData)[i];
+
+		std::cout << c.name << ": return code " << static_cast<int>(returnCode)
+				  << ", gas left " << data.gas << ", msize " << msize << "\n";
+		if (returnCode != ReturnCode::Return)
+			return 1;
+	}
+	return 0;
+}